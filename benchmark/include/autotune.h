@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/AutoTune.h>
+#include <faiss/Index.h>
+#include <faiss/clone_index.h>
+
+#include "gt_format.h"
+#include "recall.h"
+#include "stopwatch.h"
+
+struct AutoTuneSettings
+{
+    size_t subsample = 1000;        // nb of queries of the screening pass
+    double perf_slack = 0.01;       // screened points this close to the frontier are confirmed as well
+    size_t workers = std::max(1u, std::thread::hardware_concurrency()); // concurrent screening searches
+    size_t memory_budget = 0;       // bytes available for index clones of the workers, 0 = no limit
+    int search_threads = 1;         // OpenMP threads of the confirmation searches
+};
+
+/**
+ * Replacement of faiss::ParameterSpace::explore in two passes.
+ *
+ * Screening: every combination of the parameter space is evaluated on an evenly spaced
+ * subsample of the queries. Like explore, the combinations are ordered from both ends
+ * inwards and a combination is skipped if the monotonicity bounds of update_bounds prove
+ * it can not improve the current frontier. Independent combinations run concurrently on
+ * cloned indexes, one single-threaded search per worker, as many workers as the memory
+ * budget allows.
+ *
+ * Confirmation: only the screened points within perf_slack of the screening frontier are
+ * searched again with the full query set, sequentially and with search_threads threads.
+ *
+ * The performance measure is the intersection recall gt_at-recall@result_at of the
+ * RecallEvaluator with k results per query, the ground truth is read in place from gt
+ * (only the rows of the subsample are copied). The time t of the returned operating points
+ * is in microseconds per query.
+ */
+inline faiss::OperatingPoints auto_tune(faiss::Index* index, const faiss::ParameterSpace& space, size_t nq, const float* xq,
+                                        const GroundTruthFile& gt, size_t k, size_t gt_at, size_t result_at,
+                                        const AutoTuneSettings& settings, StopW& stopwatch)
+{
+    const size_t d = index->d;
+    const size_t n_combinations = space.n_combinations();
+
+    // evenly spaced query subsample and its ground truth
+    const size_t nsub = std::min(settings.subsample, nq);
+    std::vector<float> xsub(nsub * d);
+    const size_t k_gt = gt.k();
+    std::vector<int32_t> gtsub(nsub * k_gt);
+    for (size_t i = 0; i < nsub; i++)
+    {
+        size_t q = i * nq / nsub;
+        std::copy(xq + q * d, xq + (q + 1) * d, xsub.data() + i * d);
+        std::copy(gt.ids() + q * gt.stride(), gt.ids() + q * gt.stride() + k_gt, gtsub.data() + i * k_gt);
+    }
+    RecallEvaluator sub_evaluator(nsub, gtsub.data(), k_gt, k_gt);
+    sub_evaluator.set_threads(1);  // runs inside the workers, next to their timed searches
+
+    // evaluation order of explore: both ends of the range first, the rest shuffled
+    std::vector<size_t> order(n_combinations);
+    std::iota(order.begin(), order.end(), 0);
+    if (n_combinations > 2)
+    {
+        std::swap(order[1], order.back());
+        std::shuffle(order.begin() + 2, order.end(), std::mt19937(123));
+    }
+
+    // worker 0 searches the index itself, every further worker needs a clone
+    std::vector<std::unique_ptr<faiss::Index>> clones;
+    const size_t max_workers = std::clamp<size_t>(settings.workers, 1, std::max<size_t>(1, n_combinations));
+    size_t clone_bytes = 0;
+    while (clones.size() + 1 < max_workers)
+    {
+        size_t rss_before = getCurrentRSS();
+        std::unique_ptr<faiss::Index> clone(faiss::clone_index(index));
+        size_t rss_after = getCurrentRSS();
+        clone_bytes = std::max(clone_bytes, rss_after > rss_before ? rss_after - rss_before : 0);
+        if (settings.memory_budget > 0 && (clones.size() + 1) * clone_bytes > settings.memory_budget)
+            break;
+        clones.push_back(std::move(clone));
+    }
+    const size_t workers = clones.size() + 1;
+#ifdef _OPENMP
+    const int previous_threads = omp_get_max_threads();
+#endif
+    printf("[%lld s] Screening %zu combinations on %zu queries with %zu workers (%zu Mb per index clone)\n",
+           stopwatch.getElapsedTimeSeconds(), n_combinations, nsub, workers, clone_bytes / 1000000);
+
+    faiss::OperatingPoints screened;
+    std::mutex screened_mutex;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> n_skipped{0};
+    auto screen = [&](faiss::Index* worker_index) {
+#ifdef _OPENMP
+        omp_set_num_threads(1);  // only affects the calling thread
+#endif
+        std::vector<float> D(nsub * k);
+        std::vector<faiss::idx_t> I(nsub * k);
+        for (size_t o = next++; o < n_combinations; o = next++)
+        {
+            size_t cno = order[o];
+            {
+                std::lock_guard<std::mutex> lock(screened_mutex);
+                double upper_bound_perf = 1.0, lower_bound_t = 0.0;
+                for (const auto& op : screened.all_pts)
+                    space.update_bounds(cno, op, &upper_bound_perf, &lower_bound_t);
+                if (screened.t_for_perf(upper_bound_perf) <= lower_bound_t)
+                {
+                    n_skipped++;
+                    continue;
+                }
+            }
+
+            space.set_index_parameters(worker_index, cno);
+            StopW timer;
+            worker_index->search(nsub, xsub.data(), k, D.data(), I.data());
+            double us_per_query = timer.getElapsedTimeMicro() / double(nsub);
+
+            // the evaluator caches sorted ground truth prefixes, hence evaluate under the lock
+            std::lock_guard<std::mutex> lock(screened_mutex);
+            double perf = sub_evaluator.recall(I.data(), k, gt_at, result_at);
+            screened.add(perf, us_per_query, space.combination_name(cno), cno);
+        }
+    };
+    {
+        std::vector<std::thread> threads;
+        for (auto& clone : clones) threads.emplace_back(screen, clone.get());
+        screen(index);
+        for (auto& t : threads) t.join();
+    }
+    clones.clear();
+    printf("[%lld s] Screened %zu combinations, skipped %zu, %zu on the frontier\n", stopwatch.getElapsedTimeSeconds(),
+           screened.all_pts.size(), n_skipped.load(), screened.optimal_pts.size());
+
+    // screened points not clearly dominated by a faster point of the frontier
+    std::vector<size_t> candidates;
+    for (const auto& op : screened.all_pts)
+    {
+        bool dominated = false;
+        for (const auto& opt : screened.optimal_pts)
+            dominated |= opt.t <= op.t && opt.perf >= op.perf + settings.perf_slack;
+        if (!dominated) candidates.push_back((size_t)op.cno);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    printf("[%lld s] Confirming %zu candidates on all %zu queries\n", stopwatch.getElapsedTimeSeconds(), candidates.size(), nq);
+
+#ifdef _OPENMP
+    omp_set_num_threads(settings.search_threads);
+#endif
+    RecallEvaluator evaluator(gt);
+    std::vector<float> D(nq * k);
+    std::vector<faiss::idx_t> I(nq * k);
+    faiss::OperatingPoints confirmed;
+    for (size_t cno : candidates)
+    {
+        space.set_index_parameters(index, cno);
+        StopW timer;
+        index->search(nq, xq, k, D.data(), I.data());
+        double us_per_query = timer.getElapsedTimeMicro() / double(nq);
+        confirmed.add(evaluator.recall(I.data(), k, gt_at, result_at), us_per_query, space.combination_name(cno), cno);
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(previous_threads);
+#endif
+    return confirmed;
+}
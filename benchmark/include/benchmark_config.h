@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Minimal ini-style configuration used by the config driven tools.
+ *
+ *   # comment
+ *   [dataset sift1m]
+ *   base = e:/Data/Feature/SIFT1M/SIFT1M/sift_base.fvecs
+ *
+ *   [index IVF1024,PQ64x4fs,Refine(SQfp16)]
+ *   nprobe = 8,16,32,64
+ *
+ * Every section has a type (dataset, index, run, ...) and an optional name, the
+ * sections of all loaded files are concatenated in order.
+ */
+struct ConfigSection
+{
+    std::string type;
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> entries;
+
+    bool has(const std::string& key) const
+    {
+        return std::any_of(entries.begin(), entries.end(), [&](const auto& e) { return e.first == key; });
+    }
+
+    std::string get(const std::string& key, const std::string& fallback = "") const
+    {
+        for (const auto& e : entries)
+            if (e.first == key) return e.second;
+        return fallback;
+    }
+
+    // value of a key which has to be present
+    std::string require(const std::string& key) const
+    {
+        if (!has(key))
+        {
+            std::cerr << "missing key \"" << key << "\" in section [" << type << " " << name << "]" << std::endl;
+            abort();
+        }
+        return get(key);
+    }
+
+    double get_double(const std::string& key, double fallback) const
+    {
+        return has(key) ? std::stod(get(key)) : fallback;
+    }
+
+    size_t get_size(const std::string& key, size_t fallback) const
+    {
+        return has(key) ? (size_t)std::stoull(get(key)) : fallback;
+    }
+
+    bool get_bool(const std::string& key, bool fallback) const
+    {
+        if (!has(key)) return fallback;
+        auto value = get(key);
+        return value == "true" || value == "1" || value == "yes" || value == "on";
+    }
+
+    // comma separated list of values
+    std::vector<std::string> get_list(const std::string& key) const
+    {
+        std::vector<std::string> values;
+        auto value = get(key);
+        size_t begin = 0;
+        while (begin <= value.size() && !value.empty())
+        {
+            size_t end = std::min(value.find(',', begin), value.size());
+            auto item = trim(value.substr(begin, end - begin));
+            if (!item.empty()) values.push_back(item);
+            begin = end + 1;
+        }
+        return values;
+    }
+
+    std::vector<double> get_double_list(const std::string& key) const
+    {
+        std::vector<double> values;
+        for (const auto& item : get_list(key)) values.push_back(std::stod(item));
+        return values;
+    }
+
+    static std::string trim(const std::string& s)
+    {
+        size_t begin = s.find_first_not_of(" \t\r\n");
+        if (begin == std::string::npos) return "";
+        size_t end = s.find_last_not_of(" \t\r\n");
+        return s.substr(begin, end - begin + 1);
+    }
+};
+
+struct BenchmarkConfig
+{
+    std::vector<ConfigSection> sections;
+
+    void load(const char* fname)
+    {
+        auto ifstream = std::ifstream(fname);
+        if (!ifstream.is_open())
+        {
+            std::cerr << "could not open config file " << fname << std::endl;
+            perror("");
+            abort();
+        }
+
+        std::string line;
+        size_t line_no = 0;
+        while (std::getline(ifstream, line))
+        {
+            line_no++;
+            line = ConfigSection::trim(line);
+            if (line.empty() || line[0] == '#' || line[0] == ';') continue;
+
+            if (line.front() == '[' && line.back() == ']')
+            {
+                auto header = ConfigSection::trim(line.substr(1, line.size() - 2));
+                size_t split = header.find_first_of(" \t");
+                ConfigSection section;
+                section.type = header.substr(0, split);
+                if (split != std::string::npos) section.name = ConfigSection::trim(header.substr(split));
+                sections.push_back(section);
+                continue;
+            }
+
+            size_t split = line.find('=');
+            if (split == std::string::npos || sections.empty())
+            {
+                std::cerr << fname << ":" << line_no << ": expected \"key = value\" inside a section" << std::endl;
+                abort();
+            }
+            sections.back().entries.emplace_back(ConfigSection::trim(line.substr(0, split)),
+                                                 ConfigSection::trim(line.substr(split + 1)));
+        }
+    }
+
+    std::vector<const ConfigSection*> all(const std::string& type) const
+    {
+        std::vector<const ConfigSection*> result;
+        for (const auto& s : sections)
+            if (s.type == type) result.push_back(&s);
+        return result;
+    }
+
+    // the last section of the given type, an empty one if there is none
+    const ConfigSection& get(const std::string& type) const
+    {
+        static const ConfigSection empty;
+        for (auto it = sections.rbegin(); it != sections.rend(); ++it)
+            if (it->type == type) return *it;
+        return empty;
+    }
+
+    const ConfigSection* find(const std::string& type, const std::string& name) const
+    {
+        for (const auto& s : sections)
+            if (s.type == type && s.name == name) return &s;
+        return nullptr;
+    }
+};
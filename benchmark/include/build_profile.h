@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <faiss/Index.h>
+#include <faiss/impl/io.h>
+#include <faiss/index_io.h>
+
+#include "index_build.h"
+#include "stopwatch.h"
+
+/**
+ * Samples the resident set size of the process in a background thread every interval_ms
+ * milliseconds, from construction until stop() or destruction. Phases of the sampled
+ * work are labeled with mark(), every sample belongs to the last phase marked before it.
+ */
+class RssSampler
+{
+public:
+    struct Sample
+    {
+        long long us;  // since the construction of the sampler
+        size_t rss;
+        size_t phase;  // index of the phase name
+    };
+
+    explicit RssSampler(unsigned interval_ms = 50) : interval_ms_(interval_ms)
+    {
+        phases_.push_back("start");
+        sample();
+        thread_ = std::thread([this]() {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_)
+            {
+                cv_.wait_for(lock, std::chrono::milliseconds(interval_ms_), [this]() { return stop_; });
+                lock.unlock();
+                sample();
+                lock.lock();
+            }
+        });
+    }
+
+    ~RssSampler() { stop(); }
+
+    RssSampler(const RssSampler&) = delete;
+    RssSampler& operator=(const RssSampler&) = delete;
+
+    // starts a new phase, with a sample at its beginning
+    void mark(const std::string& phase)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            phases_.push_back(phase);
+        }
+        sample();
+    }
+
+    // stops sampling, after a last sample
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stop_) return;
+            stop_ = true;
+        }
+        cv_.notify_all();
+        thread_.join();
+        sample();
+    }
+
+    // the samples and phase names, only consistent after stop()
+    const std::vector<Sample>& samples() const { return samples_; }
+    const std::vector<std::string>& phases() const { return phases_; }
+
+    // largest sample of a phase, or of all phases
+    size_t peak(size_t phase = size_t(-1)) const
+    {
+        size_t peak = 0;
+        for (const auto& s : samples_)
+            if (phase == size_t(-1) || s.phase == phase) peak = std::max(peak, s.rss);
+        return peak;
+    }
+
+    size_t first() const { return samples_.empty() ? 0 : samples_.front().rss; }
+    size_t last() const { return samples_.empty() ? 0 : samples_.back().rss; }
+
+private:
+    void sample()
+    {
+        size_t rss = getCurrentRSS();
+        long long us = clock_.getElapsedTimeMicro();
+        std::lock_guard<std::mutex> lock(mutex_);
+        samples_.push_back({ us, rss, phases_.size() - 1 });
+    }
+
+    unsigned interval_ms_;
+    StopW clock_;
+    std::vector<Sample> samples_;
+    std::vector<std::string> phases_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// counts the bytes written by faiss::write_index instead of keeping them
+struct CountingIOWriter : faiss::IOWriter
+{
+    size_t bytes = 0;
+
+    size_t operator()(const void*, size_t size, size_t nitems) override
+    {
+        bytes += size * nitems;
+        return nitems;
+    }
+};
+
+// size of the serialized index, its codes, ids, quantizers and transforms
+inline size_t serialized_index_bytes(const faiss::Index* index)
+{
+    CountingIOWriter writer;
+    faiss::write_index(index, &writer);
+    return writer.bytes;
+}
+
+// minimum, median and maximum add throughput over the chunks of a build
+struct ChunkThroughput
+{
+    double min = 0, median = 0, max = 0;
+};
+
+inline ChunkThroughput chunk_throughput(const std::vector<ChunkTiming>& chunks)
+{
+    ChunkThroughput t;
+    if (chunks.empty()) return t;
+    std::vector<double> rates;
+    for (const auto& chunk : chunks) rates.push_back(chunk.vectors_per_s());
+    std::sort(rates.begin(), rates.end());
+    t.min = rates.front();
+    t.max = rates.back();
+    t.median = rates.size() % 2 ? rates[rates.size() / 2] : (rates[rates.size() / 2 - 1] + rates[rates.size() / 2]) / 2;
+    return t;
+}
@@ -0,0 +1,310 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "config.h"
+
+/*****************************************************
+ * Distance kernels of the harness' own math (distance ratio reranking, ground truth
+ * norms), specialized at compile time for the dimensions of the benchmarked datasets:
+ * Deep 96, GloVe 100, SIFT 128, Msong 420, clip 768 and gpret 1024. With a constant
+ * dimension all loops are fully unrolled and the tail of dimensions that are no multiple
+ * of the vector width is handled by one masked step (AVX-512) or a few unrolled scalar
+ * operations (AVX) instead of a loop. Vector code is selected by USE_AVX512 / USE_AVX of config.h, FMA is
+ * used when the target has it (AVX2 targets always do).
+ *
+ * l2sqr_kernel(d) and ip_kernel(d) return the specialized kernel for d, or the generic
+ * runtime dimension one for all other dimensions. They are resolved once per batch,
+ * not per distance.
+ *****************************************************/
+
+// dimensions with specialized kernels
+inline constexpr size_t specialized_dimensions[] = { 96, 100, 128, 420, 768, 1024 };
+
+// squared L2 distance or inner product of two d dimensional vectors, d is ignored by the specialized kernels
+using DistanceKernel = float (*)(const float* a, const float* b, size_t d);
+
+#if defined(USE_AVX) && (defined(__FMA__) || defined(__AVX2__))
+  #define FAISSBENCH_FMA
+#endif
+
+#ifdef USE_AVX512
+static inline __m512 madd512(__m512 a, __m512 b, __m512 acc) { return _mm512_fmadd_ps(a, b, acc); }
+#endif
+
+#ifdef USE_AVX
+static inline __m256 madd256(__m256 a, __m256 b, __m256 acc)
+{
+#ifdef FAISSBENCH_FMA
+    return _mm256_fmadd_ps(a, b, acc);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), acc);
+#endif
+}
+
+static inline float hsum256(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+/**
+ * Sum over i < D of f(a_i, b_i) with f = (a - b)^2 (L2) or a * b (inner product). Four
+ * accumulators hide the latency of the fused multiply-adds.
+ */
+template <bool L2, size_t D>
+inline float accumulate_fixed(const float* a, const float* b)
+{
+#if defined(USE_AVX512)
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    __m512 acc2 = _mm512_setzero_ps();
+    __m512 acc3 = _mm512_setzero_ps();
+    size_t i = 0;
+    for (; i + 64 <= D; i += 64)
+    {
+        __m512 a0 = _mm512_loadu_ps(a + i), b0 = _mm512_loadu_ps(b + i);
+        __m512 a1 = _mm512_loadu_ps(a + i + 16), b1 = _mm512_loadu_ps(b + i + 16);
+        __m512 a2 = _mm512_loadu_ps(a + i + 32), b2 = _mm512_loadu_ps(b + i + 32);
+        __m512 a3 = _mm512_loadu_ps(a + i + 48), b3 = _mm512_loadu_ps(b + i + 48);
+        if constexpr (L2)
+        {
+            a0 = _mm512_sub_ps(a0, b0);
+            a1 = _mm512_sub_ps(a1, b1);
+            a2 = _mm512_sub_ps(a2, b2);
+            a3 = _mm512_sub_ps(a3, b3);
+            acc0 = madd512(a0, a0, acc0);
+            acc1 = madd512(a1, a1, acc1);
+            acc2 = madd512(a2, a2, acc2);
+            acc3 = madd512(a3, a3, acc3);
+        }
+        else
+        {
+            acc0 = madd512(a0, b0, acc0);
+            acc1 = madd512(a1, b1, acc1);
+            acc2 = madd512(a2, b2, acc2);
+            acc3 = madd512(a3, b3, acc3);
+        }
+    }
+    if constexpr (D % 64 >= 32)
+    {
+        __m512 a0 = _mm512_loadu_ps(a + i), b0 = _mm512_loadu_ps(b + i);
+        __m512 a1 = _mm512_loadu_ps(a + i + 16), b1 = _mm512_loadu_ps(b + i + 16);
+        if constexpr (L2)
+        {
+            a0 = _mm512_sub_ps(a0, b0);
+            a1 = _mm512_sub_ps(a1, b1);
+            acc0 = madd512(a0, a0, acc0);
+            acc1 = madd512(a1, a1, acc1);
+        }
+        else
+        {
+            acc0 = madd512(a0, b0, acc0);
+            acc1 = madd512(a1, b1, acc1);
+        }
+        i += 32;
+    }
+    if constexpr (D % 32 >= 16)
+    {
+        __m512 a0 = _mm512_loadu_ps(a + i), b0 = _mm512_loadu_ps(b + i);
+        if constexpr (L2) { a0 = _mm512_sub_ps(a0, b0); acc0 = madd512(a0, a0, acc0); }
+        else acc0 = madd512(a0, b0, acc0);
+        i += 16;
+    }
+    if constexpr (D % 16 != 0)
+    {
+        const __mmask16 mask = (__mmask16)((1u << (D % 16)) - 1);
+        __m512 a0 = _mm512_maskz_loadu_ps(mask, a + i), b0 = _mm512_maskz_loadu_ps(mask, b + i);
+        if constexpr (L2) { a0 = _mm512_sub_ps(a0, b0); acc1 = madd512(a0, a0, acc1); }
+        else acc1 = madd512(a0, b0, acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(_mm512_add_ps(acc0, acc1), _mm512_add_ps(acc2, acc3)));
+#elif defined(USE_AVX)
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 32 <= D; i += 32)
+    {
+        __m256 a0 = _mm256_loadu_ps(a + i), b0 = _mm256_loadu_ps(b + i);
+        __m256 a1 = _mm256_loadu_ps(a + i + 8), b1 = _mm256_loadu_ps(b + i + 8);
+        __m256 a2 = _mm256_loadu_ps(a + i + 16), b2 = _mm256_loadu_ps(b + i + 16);
+        __m256 a3 = _mm256_loadu_ps(a + i + 24), b3 = _mm256_loadu_ps(b + i + 24);
+        if constexpr (L2)
+        {
+            a0 = _mm256_sub_ps(a0, b0);
+            a1 = _mm256_sub_ps(a1, b1);
+            a2 = _mm256_sub_ps(a2, b2);
+            a3 = _mm256_sub_ps(a3, b3);
+            acc0 = madd256(a0, a0, acc0);
+            acc1 = madd256(a1, a1, acc1);
+            acc2 = madd256(a2, a2, acc2);
+            acc3 = madd256(a3, a3, acc3);
+        }
+        else
+        {
+            acc0 = madd256(a0, b0, acc0);
+            acc1 = madd256(a1, b1, acc1);
+            acc2 = madd256(a2, b2, acc2);
+            acc3 = madd256(a3, b3, acc3);
+        }
+    }
+    if constexpr (D % 32 >= 16)
+    {
+        __m256 a0 = _mm256_loadu_ps(a + i), b0 = _mm256_loadu_ps(b + i);
+        __m256 a1 = _mm256_loadu_ps(a + i + 8), b1 = _mm256_loadu_ps(b + i + 8);
+        if constexpr (L2)
+        {
+            a0 = _mm256_sub_ps(a0, b0);
+            a1 = _mm256_sub_ps(a1, b1);
+            acc0 = madd256(a0, a0, acc0);
+            acc1 = madd256(a1, a1, acc1);
+        }
+        else
+        {
+            acc0 = madd256(a0, b0, acc0);
+            acc1 = madd256(a1, b1, acc1);
+        }
+        i += 16;
+    }
+    if constexpr (D % 16 >= 8)
+    {
+        __m256 a0 = _mm256_loadu_ps(a + i), b0 = _mm256_loadu_ps(b + i);
+        if constexpr (L2) { a0 = _mm256_sub_ps(a0, b0); acc0 = madd256(a0, a0, acc0); }
+        else acc0 = madd256(a0, b0, acc0);
+        i += 8;
+    }
+    float sum = hsum256(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    if constexpr (D % 8 != 0)
+    {
+        for (; i < D; i++)
+        {
+            float t = L2 ? a[i] - b[i] : a[i];
+            sum += t * (L2 ? t : b[i]);
+        }
+    }
+    return sum;
+#else
+    float sum0 = 0, sum1 = 0;
+    size_t i = 0;
+    for (; i + 2 <= D; i += 2)
+    {
+        float t0 = L2 ? a[i] - b[i] : a[i];
+        float t1 = L2 ? a[i + 1] - b[i + 1] : a[i + 1];
+        sum0 += t0 * (L2 ? t0 : b[i]);
+        sum1 += t1 * (L2 ? t1 : b[i + 1]);
+    }
+    if constexpr (D % 2) sum0 += L2 ? (a[i] - b[i]) * (a[i] - b[i]) : a[i] * b[i];
+    return sum0 + sum1;
+#endif
+}
+
+// runtime dimension version of accumulate_fixed
+template <bool L2>
+inline float accumulate_dynamic(const float* a, const float* b, size_t d)
+{
+    size_t i = 0;
+    float sum = 0;
+#if defined(USE_AVX512)
+    __m512 acc = _mm512_setzero_ps();
+    for (; i + 16 <= d; i += 16)
+    {
+        __m512 a0 = _mm512_loadu_ps(a + i), b0 = _mm512_loadu_ps(b + i);
+        if constexpr (L2) { a0 = _mm512_sub_ps(a0, b0); acc = madd512(a0, a0, acc); }
+        else acc = madd512(a0, b0, acc);
+    }
+    if (i < d)
+    {
+        const __mmask16 mask = (__mmask16)((1u << (d - i)) - 1);
+        __m512 a0 = _mm512_maskz_loadu_ps(mask, a + i), b0 = _mm512_maskz_loadu_ps(mask, b + i);
+        if constexpr (L2) { a0 = _mm512_sub_ps(a0, b0); acc = madd512(a0, a0, acc); }
+        else acc = madd512(a0, b0, acc);
+        i = d;
+    }
+    sum = _mm512_reduce_add_ps(acc);
+#elif defined(USE_AVX)
+    __m256 acc = _mm256_setzero_ps();
+    for (; i + 8 <= d; i += 8)
+    {
+        __m256 a0 = _mm256_loadu_ps(a + i), b0 = _mm256_loadu_ps(b + i);
+        if constexpr (L2) { a0 = _mm256_sub_ps(a0, b0); acc = madd256(a0, a0, acc); }
+        else acc = madd256(a0, b0, acc);
+    }
+    sum = hsum256(acc);
+#endif
+    for (; i < d; i++)
+    {
+        float t = L2 ? a[i] - b[i] : a[i];
+        sum += t * (L2 ? t : b[i]);
+    }
+    return sum;
+}
+
+template <size_t D>
+inline float l2sqr_fixed(const float* a, const float* b, size_t = D) { return accumulate_fixed<true, D>(a, b); }
+
+template <size_t D>
+inline float ip_fixed(const float* a, const float* b, size_t = D) { return accumulate_fixed<false, D>(a, b); }
+
+inline float l2sqr_dynamic(const float* a, const float* b, size_t d) { return accumulate_dynamic<true>(a, b, d); }
+inline float ip_dynamic(const float* a, const float* b, size_t d) { return accumulate_dynamic<false>(a, b, d); }
+
+/**
+ * Specialized kernel for dimension d, the generic one for all other dimensions.
+ * The kernels produce the same sums as faiss::fvec_L2sqr / fvec_inner_product up to
+ * float rounding of the different summation order.
+ */
+inline DistanceKernel l2sqr_kernel(size_t d)
+{
+    switch (d)
+    {
+        case 96:   return &l2sqr_fixed<96>;
+        case 100:  return &l2sqr_fixed<100>;
+        case 128:  return &l2sqr_fixed<128>;
+        case 420:  return &l2sqr_fixed<420>;
+        case 768:  return &l2sqr_fixed<768>;
+        case 1024: return &l2sqr_fixed<1024>;
+        default:   return &l2sqr_dynamic;
+    }
+}
+
+inline DistanceKernel ip_kernel(size_t d)
+{
+    switch (d)
+    {
+        case 96:   return &ip_fixed<96>;
+        case 100:  return &ip_fixed<100>;
+        case 128:  return &ip_fixed<128>;
+        case 420:  return &ip_fixed<420>;
+        case 768:  return &ip_fixed<768>;
+        case 1024: return &ip_fixed<1024>;
+        default:   return &ip_dynamic;
+    }
+}
+
+inline bool has_specialized_kernel(size_t d)
+{
+    for (size_t s : specialized_dimensions)
+        if (s == d) return true;
+    return false;
+}
+
+/**
+ * Squared L2 norms of n contiguous d dimensional vectors, in parallel over the vectors.
+ */
+inline void norms_l2sqr(float* norms, const float* x, size_t d, size_t n)
+{
+    const DistanceKernel ip = ip_kernel(d);
+    #pragma omp parallel for if (n > 1024)
+    for (int64_t i = 0; i < (int64_t)n; i++)
+        norms[i] = ip(x + i * d, x + i * d, d);
+}
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <faiss/Index.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexRefine.h>
+#include <faiss/impl/FaissException.h>
+#include <faiss/impl/IDSelector.h>
+
+#include "gt_engine.h"
+#include "measure.h"
+#include "recall.h"
+#include "result_buffer.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+#include "vecs_stream.h"
+
+// how the filter of a search is passed to faiss
+enum class FilterSelector
+{
+    bitmap,  // IDSelectorBitmap, the passing ids are scattered over the base
+    range,   // IDSelectorRange, the passing ids are a prefix of the base
+};
+
+inline const char* filter_selector_name(FilterSelector selector)
+{
+    return selector == FilterSelector::bitmap ? "bitmap" : "range";
+}
+
+/**
+ * Synthetic attribute filter over the nb base vectors which passes a fraction selectivity
+ * of them. For the bitmap selector every vector gets a uniformly distributed attribute
+ * and the filter is attribute < selectivity, like a category or a tenant. For the range
+ * selector the attribute grows with the id, like an insertion time, and the filter passes
+ * the ids [0, selectivity * nb).
+ */
+class AttributeFilter
+{
+    FilterSelector selector_;
+    double selectivity_;
+    size_t nb_;
+    size_t count_ = 0;
+    std::vector<uint8_t> bitmap_;  // bit i of byte i / 8 for id i, as IDSelectorBitmap reads it
+    std::unique_ptr<faiss::IDSelector> sel_;
+
+public:
+    AttributeFilter(FilterSelector selector, double selectivity, size_t nb, uint64_t seed = 1234)
+        : selector_(selector), selectivity_(selectivity), nb_(nb)
+    {
+        if (selector == FilterSelector::range)
+        {
+            count_ = std::min(nb, size_t(std::llround(selectivity * nb)));
+            sel_ = std::make_unique<faiss::IDSelectorRange>(0, (faiss::idx_t)count_);
+            return;
+        }
+
+        bitmap_.assign((nb + 7) / 8, 0);
+        std::mt19937_64 rng(seed);
+        std::uniform_real_distribution<double> attribute(0.0, 1.0);
+        for (size_t i = 0; i < nb; i++)
+        {
+            if (attribute(rng) < selectivity)
+            {
+                bitmap_[i >> 3] |= uint8_t(1 << (i & 7));
+                count_++;
+            }
+        }
+        sel_ = std::make_unique<faiss::IDSelectorBitmap>(nb, bitmap_.data());
+    }
+
+    FilterSelector selector_type() const { return selector_; }
+    double selectivity() const { return selectivity_; }
+    size_t count() const { return count_; }  // passing base vectors
+    const faiss::IDSelector* selector() const { return sel_.get(); }
+
+    bool is_member(faiss::idx_t id) const
+    {
+        if (id < 0 || size_t(id) >= nb_) return false;
+        if (selector_ == FilterSelector::range) return size_t(id) < count_;
+        return (bitmap_[id >> 3] >> (id & 7)) & 1;
+    }
+
+    std::string name() const { return string_format("%s %g%%", filter_selector_name(selector_), selectivity_ * 100); }
+};
+
+/**
+ * Exact k-nn of the queries among the base vectors passing the filter, nq * k ids padded
+ * with -1. Only the passing rows are added to the GroundTruthEngine, a range filter
+ * streams just its prefix of the base.
+ */
+template<typename T>
+inline std::vector<faiss::idx_t> filtered_ground_truth(const VecsView<T>& xb, size_t nq, const float* xq, size_t k, const AttributeFilter& filter)
+{
+    const size_t d = xb.dims();
+    GroundTruthEngine engine(nq, d, xq, k);
+    if (filter.selector_type() == FilterSelector::range)
+    {
+        engine.add(xb, 0, filter.count());
+    }
+    else
+    {
+        std::vector<float> rows;
+        std::vector<faiss::idx_t> ids;
+        stream_chunks<T, float>(xb, engine.base_tile(), [&](size_t first, size_t count, const float* x) {
+            rows.clear();
+            ids.clear();
+            for (size_t j = 0; j < count; j++)
+            {
+                if (!filter.is_member(faiss::idx_t(first + j))) continue;
+                ids.push_back(faiss::idx_t(first + j));
+                rows.insert(rows.end(), x + j * d, x + (j + 1) * d);
+            }
+            engine.add(ids.size(), rows.data(), ids.data());
+        });
+    }
+
+    std::vector<float> D(nq * k);
+    std::vector<faiss::idx_t> I(nq * k);
+    engine.result(D.data(), I.data());
+    return I;
+}
+
+/**
+ * Keeps the first k results of every query of an nq * k_fetch result list which pass the
+ * filter, missing results are padded with -1.
+ */
+inline void post_filter(size_t nq, size_t k_fetch, const float* D_fetch, const faiss::idx_t* I_fetch, const AttributeFilter& filter,
+                        size_t k, float* D, faiss::idx_t* I)
+{
+    #pragma omp parallel for
+    for (int64_t q = 0; q < (int64_t)nq; q++)
+    {
+        size_t kept = 0;
+        for (size_t j = 0; j < k_fetch && kept < k; j++)
+        {
+            faiss::idx_t id = I_fetch[q * k_fetch + j];
+            if (!filter.is_member(id)) continue;
+            D[q * k + kept] = D_fetch[q * k_fetch + j];
+            I[q * k + kept] = id;
+            kept++;
+        }
+        for (; kept < k; kept++)
+        {
+            D[q * k + kept] = HUGE_VALF;
+            I[q * k + kept] = -1;
+        }
+    }
+}
+
+/**
+ * Search parameters of an IVF index or of an IndexRefine over an IVF index, with an
+ * optional selector. faiss applies the selector in the list scan of the base index.
+ */
+struct IVFSearchParameters
+{
+    faiss::SearchParametersIVF ivf;
+    faiss::IndexRefineSearchParameters refine;
+
+    const faiss::SearchParameters* get(const faiss::Index* index, size_t nprobe, float k_factor, const faiss::IDSelector* sel)
+    {
+        ivf.nprobe = nprobe;
+        ivf.sel = const_cast<faiss::IDSelector*>(sel);
+        if (dynamic_cast<const faiss::IndexRefine*>(index) == nullptr) return &ivf;
+        refine.k_factor = k_factor;
+        refine.base_index_params = &ivf;
+        return &refine;
+    }
+};
+
+struct FilteredSearchSettings
+{
+    std::vector<double> selectivities = { 0.5, 0.1, 0.01, 0.001 };
+    std::vector<FilterSelector> selectors = { FilterSelector::bitmap, FilterSelector::range };
+
+    // post-filtering fetches k * k_factor / selectivity results, at most max_fetch. The
+    // refine k_factor of the over-fetch search is lowered so that the base index is asked
+    // for at most max(max_fetch, fetched results) candidates per query
+    std::vector<double> post_k_factors = { 1, 2, 4 };
+    size_t max_fetch = 2048;
+
+    TimingSettings timing;  // of every filtered search
+};
+
+// a filter with the exact results of the queries among its passing base vectors
+struct FilteredCase
+{
+    AttributeFilter filter;
+    std::vector<faiss::idx_t> gt;  // nq * k
+};
+
+// the filters of all selectivities and selectors with their filtered ground truth
+template<typename T>
+inline std::vector<FilteredCase> filtered_cases(const VecsView<T>& xb, size_t nq, const float* xq, size_t k, const FilteredSearchSettings& settings, StopW& stopwatch)
+{
+    std::vector<FilteredCase> cases;
+    for (double selectivity : settings.selectivities)
+    {
+        for (FilterSelector selector : settings.selectors)
+        {
+            AttributeFilter filter(selector, selectivity, xb.size());
+            printf("[%lld s] Filtered ground truth of %s, %zu passing vectors\n", stopwatch.getElapsedTimeSeconds(), filter.name().c_str(), filter.count());
+            auto gt = filtered_ground_truth(xb, nq, xq, k, filter);
+            cases.push_back({ std::move(filter), std::move(gt) });
+        }
+    }
+    return cases;
+}
+
+/**
+ * Filtered searches of one operating point (nprobe, k_factor of a refine index) of an IVF
+ * index, for every filter case
+ *
+ *  - pre-filtering, the selector is passed to faiss in the search parameters and the list
+ *    scan skips the failing ids. Indexes which do not support selectors throw, this is
+ *    reported and only post-filtering is measured.
+ *  - post-filtering, an unfiltered search over-fetches k * k_factor / selectivity results
+ *    (at most max_fetch) and the first k passing ones are kept. The refine k_factor of
+ *    this search is capped so it reranks at most max(max_fetch, fetched) candidates.
+ *
+ * The recall is computed against the filtered ground truth, every measurement is printed
+ * and appended to the store as a search record with the filter in its params.
+ */
+inline void filtered_search_sweep(const std::string& benchmark, const std::string& dataset, const std::string& index_type, const faiss::Index* index,
+                                  size_t nq, const float* xq, size_t k, size_t k_recall_at, size_t nprobe, float k_factor,
+                                  const std::vector<FilteredCase>& cases, const FilteredSearchSettings& settings, ResultsStore& store)
+{
+    ResultBuffer results(nq, k);
+    ResultBuffer fetched(nq, std::max(k, settings.max_fetch));
+    IVFSearchParameters params;
+    bool prefilter_supported = true;
+
+    for (const auto& c : cases)
+    {
+        RecallEvaluator evaluator(nq, c.gt.data(), k);
+        const std::string point = string_format("nprobe=%zu,k_factor=%g,filter=%s,selectivity=%g",
+                                                nprobe, k_factor, filter_selector_name(c.filter.selector_type()), c.filter.selectivity());
+        auto report = [&](const char* mode, const std::string& mode_params, const TimingStats& timing) {
+            const auto duration_us = (long long)timing.median_us;
+            float recall = evaluator.recall(results.I(), k, k_recall_at, k);
+            auto record = search_record(benchmark, dataset, index_type, point + ",mode=" + mode + mode_params, k, k_recall_at, recall, duration_us, nq);
+            record.set("filter", filter_selector_name(c.filter.selector_type()))
+                  .set("selectivity", c.filter.selectivity())
+                  .set("passing", c.filter.count())
+                  .set("mode", mode)
+                  .set("repetitions", timing.samples_us.size());
+            store.append(record);
+            printf("  %-14s %-24s %zuR@%zu = %.4f with %8.1f us/query, %9.0f QPS\n", c.filter.name().c_str(), (mode + mode_params).c_str(),
+                   k_recall_at, k, recall, duration_us / double(nq), nq / (std::max<long long>(duration_us, 1) / 1e6));
+        };
+
+        if (prefilter_supported)
+        {
+            try
+            {
+                auto search_params = params.get(index, nprobe, k_factor, c.filter.selector());
+                auto timing = measure_repeated(settings.timing, [&]() { index->search(nq, xq, k, results.D(), results.I(), search_params); });
+                report("pre", "", timing);
+            }
+            catch (const faiss::FaissException& e)
+            {
+                printf("  pre-filtering is not supported by %s, only post-filtering is measured: %s\n", index_type.c_str(), e.what());
+                prefilter_supported = false;
+            }
+        }
+
+        for (double post_k_factor : settings.post_k_factors)
+        {
+            const size_t k_fetch = std::clamp<size_t>(size_t(std::ceil(k * post_k_factor / c.filter.selectivity())), k, std::max(k, settings.max_fetch));
+            // without the cap a refine k_factor of 128 would rerank up to 128 * max_fetch candidates per query
+            const float fetch_k_factor = std::clamp<float>(float(settings.max_fetch) / k_fetch, 1.0f, std::max(k_factor, 1.0f));
+            auto search_params = params.get(index, nprobe, fetch_k_factor, nullptr);
+            auto timing = measure_repeated(settings.timing, [&]() {
+                index->search(nq, xq, k_fetch, fetched.D(), fetched.I(), search_params);
+                post_filter(nq, k_fetch, fetched.D(), fetched.I(), c.filter, k, results.D(), results.I());
+            });
+            report("post", string_format(",fetch=%zu,fetch_k_factor=%g", k_fetch, fetch_k_factor), timing);
+        }
+    }
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Index.h>
+#include <faiss/utils/Heap.h>
+#include <faiss/utils/distances.h>
+
+#include "distance_kernels.h"
+#include "vecs_io.h"
+#include "vecs_stream.h"
+
+// integer type of the BLAS interface faiss is linked against (long for ILP64 builds)
+#ifndef FINTEGER
+#define FINTEGER int
+#endif
+
+extern "C" {
+// provided by the BLAS library faiss links against
+int sgemm_(const char* transa, const char* transb, FINTEGER* m, FINTEGER* n, FINTEGER* k, const float* alpha,
+           const float* a, FINTEGER* lda, const float* b, FINTEGER* ldb, float* beta, float* c, FINTEGER* ldc);
+}
+
+/**
+ * Exact brute-force k-nn engine for ground truth computation.
+ *
+ * The base vectors are processed tile by tile and never have to be resident at once.
+ * For every block of queries the inner products with a base tile are computed by one
+ * (cache-blocked, multi-threaded) BLAS sgemm call and turned into squared L2 distances
+ * with the precomputed norms. Each query keeps its top-k in a max-heap with separate
+ * distance and id arrays; most candidates are rejected by a single compare against the
+ * heap top, which keeps the inner loop branch-light and vectorizable. The heap updates
+ * run in parallel over the queries of a block.
+ */
+class GroundTruthEngine
+{
+    size_t nq_, d_, k_;
+    const float* xq_;
+    size_t query_block_, base_tile_;
+
+    std::vector<float> q_norms_;
+    std::vector<float> heap_dis_;         // nq * k, max-heap per query
+    std::vector<faiss::idx_t> heap_ids_;  // nq * k
+    std::vector<float> b_norms_;          // base norms of the current tile
+    std::vector<float> ip_block_;         // query_block * base_tile inner products
+    size_t ntotal_ = 0;
+    float range_radius_ = 0;  // > 0 collects the range results
+    std::vector<std::vector<std::pair<float, faiss::idx_t>>> range_;  // per query
+
+    // adds n contiguous base vectors, the id of row j is id_of(j)
+    template<typename IdOf>
+    void add_rows(size_t n, const float* xb, IdOf id_of)
+    {
+        for (size_t t0 = 0; t0 < n; t0 += base_tile_)
+        {
+            FINTEGER nt = (FINTEGER)std::min(base_tile_, n - t0);
+            const float* tile = xb + t0 * d_;
+            norms_l2sqr(b_norms_.data(), tile, d_, nt);
+
+            for (size_t q0 = 0; q0 < nq_; q0 += query_block_)
+            {
+                FINTEGER nqb = (FINTEGER)std::min(query_block_, nq_ - q0);
+                FINTEGER di = (FINTEGER)d_;
+                float one = 1, zero = 0;
+
+                // ip_block[i * nt + j] = <xq[q0 + i], tile[j]>
+                sgemm_("Transpose", "Not transpose", &nt, &nqb, &di, &one, tile, &di, xq_ + q0 * d_, &di, &zero,
+                       ip_block_.data(), &nt);
+
+                #pragma omp parallel for
+                for (int64_t i = 0; i < (int64_t)nqb; i++)
+                {
+                    size_t q = q0 + i;
+                    float* dis = heap_dis_.data() + q * k_;
+                    faiss::idx_t* ids = heap_ids_.data() + q * k_;
+                    const float* ip = ip_block_.data() + i * nt;
+                    const float q_norm = q_norms_[q];
+
+                    float threshold = dis[0];
+                    for (FINTEGER j = 0; j < nt; j++)
+                    {
+                        float distance = std::max(0.0f, q_norm + b_norms_[j] - 2 * ip[j]);
+                        if (distance < threshold)
+                        {
+                            faiss::maxheap_replace_top(k_, dis, ids, distance, id_of(t0 + j));
+                            threshold = dis[0];
+                        }
+                    }
+
+                    if (range_radius_ > 0)
+                    {
+                        auto& found = range_[q];
+                        for (FINTEGER j = 0; j < nt; j++)
+                        {
+                            float distance = std::max(0.0f, q_norm + b_norms_[j] - 2 * ip[j]);
+                            if (distance < range_radius_) found.emplace_back(distance, id_of(t0 + j));
+                        }
+                    }
+                }
+            }
+        }
+        ntotal_ += n;
+    }
+
+public:
+    GroundTruthEngine(size_t nq, size_t d, const float* xq, size_t k, size_t query_block = 1024, size_t base_tile = 8192)
+        : nq_(nq), d_(d), k_(k), xq_(xq), query_block_(query_block), base_tile_(base_tile),
+          q_norms_(nq), heap_dis_(nq * k), heap_ids_(nq * k), b_norms_(base_tile), ip_block_(query_block * base_tile)
+    {
+        norms_l2sqr(q_norms_.data(), xq_, d_, nq_);
+        for (size_t q = 0; q < nq_; q++)
+            faiss::maxheap_heapify(k_, heap_dis_.data() + q * k_, heap_ids_.data() + q * k_);
+    }
+
+    size_t ntotal() const { return ntotal_; }
+    size_t base_tile() const { return base_tile_; }
+
+    /**
+     * Adds n contiguous base vectors, their ids start at id_offset.
+     */
+    void add(size_t n, const float* xb, faiss::idx_t id_offset)
+    {
+        add_rows(n, xb, [id_offset](size_t j) { return id_offset + (faiss::idx_t)j; });
+    }
+
+    /**
+     * Adds n contiguous base vectors with the ids ids[0 .. n), e.g. the rows of a subset.
+     */
+    void add(size_t n, const float* xb, const faiss::idx_t* ids)
+    {
+        add_rows(n, xb, [ids](size_t j) { return ids[j]; });
+    }
+
+    /**
+     * Adds the rows [begin, end) of a mapped vecs file, their ids are the row numbers.
+     * The tiles are de-strided (and converted to float) by a reader thread while the
+     * previous tile is processed.
+     */
+    template<typename T>
+    void add(const VecsView<T>& xb, size_t begin, size_t end)
+    {
+        stream_chunks<T, float>(xb, begin, end, base_tile_, [&](size_t first, size_t count, const float* x) {
+            add(count, x, (faiss::idx_t)first);
+        });
+    }
+
+    /**
+     * Also collects all base vectors closer than radius (squared L2, like the radius of
+     * faiss range_search) to every query, the exact range search results of all radii up
+     * to radius. Has to be called before the first add.
+     */
+    void collect_range(float radius)
+    {
+        range_radius_ = radius;
+        range_.assign(nq_, {});
+    }
+
+    // (distance, id) of the base vectors within the radius of collect_range of query q, in the order they were added
+    const std::vector<std::pair<float, faiss::idx_t>>& range_result(size_t q) const { return range_[q]; }
+
+    /**
+     * The current top-k of every query sorted by increasing distance, nq * k matrices.
+     * Queries with less than k results so far are padded with -1.
+     */
+    void result(float* D, faiss::idx_t* I) const
+    {
+        std::copy(heap_dis_.begin(), heap_dis_.end(), D);
+        std::copy(heap_ids_.begin(), heap_ids_.end(), I);
+
+        #pragma omp parallel for
+        for (int64_t q = 0; q < (int64_t)nq_; q++)
+            faiss::maxheap_reorder(k_, D + q * k_, I + q * k_);
+    }
+};
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "vecs_io.h"
+
+/*****************************************************
+ * Compact ground truth files (.gt)
+ *
+ * One 64 byte header followed by the nq * k neighbor ids of all queries and optionally
+ * their nq * k float distances. The ids are stored as int32 or bitpacked with as many
+ * bits per id as the largest id needs (20 bits for 1M base vectors). Raw files are used
+ * in place from the memory mapping, packed ones are unpacked once when they are opened.
+ * Ids are not delta coded, the rows are ordered by distance and not by id.
+ *
+ * GroundTruthFile reads ivecs files as well, also in place: their ids are accessed with
+ * a row stride of k + 1 to skip the per row headers.
+ *****************************************************/
+
+struct GroundTruthHeader
+{
+    char magic[4];              // "FBGT"
+    uint32_t version;           // 1
+    uint64_t nq;
+    uint32_t k;
+    uint32_t id_bits;           // 0 = int32 ids, otherwise bits per packed id + 1
+    uint32_t flags;             // bit 0: distances present
+    uint32_t reserved0;
+    uint64_t ids_offset;        // from the start of the file
+    uint64_t distances_offset;  // 0 without distances
+    uint8_t reserved[16];
+};
+static_assert(sizeof(GroundTruthHeader) == 64, "the ground truth header has to be 64 bytes");
+
+inline constexpr char ground_truth_magic[4] = { 'F', 'B', 'G', 'T' };
+inline constexpr uint32_t ground_truth_has_distances = 1;
+
+/**
+ * Writes nq * k ground truth ids (and distances, unless D is nullptr) to a .gt file. With
+ * bitpack the ids are stored with the minimal number of bits, negative ids (missing
+ * neighbors) are kept as -1.
+ */
+inline void write_ground_truth(const char* fname, size_t nq, size_t k, const int64_t* I, const float* D = nullptr, bool bitpack = true)
+{
+    GroundTruthHeader header{};
+    std::memcpy(header.magic, ground_truth_magic, sizeof(header.magic));
+    header.version = 1;
+    header.nq = nq;
+    header.k = (uint32_t)k;
+    header.flags = D != nullptr ? ground_truth_has_distances : 0;
+    header.ids_offset = sizeof(GroundTruthHeader);
+
+    // packed values are id + 1, 0 marks a missing neighbor
+    std::vector<uint64_t> words;
+    size_t ids_bytes = nq * k * sizeof(int32_t);
+    if (bitpack)
+    {
+        int64_t max_id = 0;
+        for (size_t i = 0; i < nq * k; i++) max_id = std::max(max_id, I[i]);
+        const uint32_t bits = std::max<uint32_t>(1, (uint32_t)std::bit_width(uint64_t(max_id + 1)));
+        header.id_bits = bits + 1;
+
+        words.assign((nq * k * bits + 63) / 64 + 1, 0);  // one word of padding for the unpacker
+        for (size_t i = 0; i < nq * k; i++)
+        {
+            uint64_t v = uint64_t(std::max<int64_t>(I[i], -1) + 1);
+            size_t bit = i * bits, word = bit / 64, shift = bit % 64;
+            words[word] |= v << shift;
+            if (shift + bits > 64) words[word + 1] |= v >> (64 - shift);
+        }
+        ids_bytes = words.size() * sizeof(uint64_t);
+    }
+    if (D != nullptr) header.distances_offset = (header.ids_offset + ids_bytes + 63) / 64 * 64;
+
+    auto out = std::ofstream(fname, std::ios::binary);
+    if (!out.is_open())
+    {
+        std::cerr << "could not open " << fname << std::endl;
+        perror("");
+        abort();
+    }
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (bitpack)
+    {
+        out.write(reinterpret_cast<const char*>(words.data()), ids_bytes);
+    }
+    else
+    {
+        std::vector<int32_t> ids(I, I + nq * k);
+        out.write(reinterpret_cast<const char*>(ids.data()), ids_bytes);
+    }
+    if (D != nullptr)
+    {
+        const char zeros[64] = {};
+        out.write(zeros, header.distances_offset - (header.ids_offset + ids_bytes));
+        out.write(reinterpret_cast<const char*>(D), nq * k * sizeof(float));
+    }
+}
+
+/**
+ * Memory mapped ground truth of a .gt or .ivecs file. The ids of query i are the k int32
+ * values at ids() + i * stride(), distances() is nullptr unless the file contains them.
+ */
+class GroundTruthFile
+{
+    MappedFile file_;
+    size_t nq_ = 0;
+    size_t k_ = 0;
+    size_t stride_ = 0;
+    const int32_t* ids_ = nullptr;
+    const float* distances_ = nullptr;
+    std::vector<int32_t> unpacked_;
+    bool packed_ = false;
+
+    static void fail(const char* fname, const char* message)
+    {
+        std::cerr << "ground truth file " << fname << " " << message << std::endl;
+        abort();
+    }
+
+    void unpack(const uint64_t* words, uint32_t bits)
+    {
+        unpacked_.resize(nq_ * k_);
+        const uint64_t mask = bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1;
+        #pragma omp parallel for
+        for (int64_t q = 0; q < (int64_t)nq_; q++)
+        {
+            for (size_t j = 0; j < k_; j++)
+            {
+                size_t i = q * k_ + j;
+                size_t bit = i * bits, word = bit / 64, shift = bit % 64;
+                uint64_t v = words[word] >> shift;
+                if (shift + bits > 64) v |= words[word + 1] << (64 - shift);
+                unpacked_[i] = int32_t(int64_t(v & mask) - 1);
+            }
+        }
+    }
+
+public:
+    explicit GroundTruthFile(const char* fname) : file_(fname)
+    {
+        const auto data = file_.data();
+        const size_t size = file_.size();
+        if (size >= sizeof(GroundTruthHeader) && std::memcmp(data, ground_truth_magic, sizeof(ground_truth_magic)) == 0)
+        {
+            GroundTruthHeader header;
+            std::memcpy(&header, data, sizeof(header));
+            if (header.version != 1) fail(fname, "has an unsupported version");
+            nq_ = header.nq;
+            k_ = header.k;
+            stride_ = k_;
+
+            size_t ids_bytes = header.id_bits == 0 ? nq_ * k_ * sizeof(int32_t) : ((nq_ * k_ * (header.id_bits - 1) + 63) / 64 + 1) * sizeof(uint64_t);
+            if (header.ids_offset + ids_bytes > size) fail(fname, "is truncated");
+            if (header.id_bits == 0)
+            {
+                ids_ = reinterpret_cast<const int32_t*>(data + header.ids_offset);
+            }
+            else
+            {
+                unpack(reinterpret_cast<const uint64_t*>(data + header.ids_offset), header.id_bits - 1);
+                file_.release(header.ids_offset, ids_bytes);
+                ids_ = unpacked_.data();
+                packed_ = true;
+            }
+
+            if (header.flags & ground_truth_has_distances)
+            {
+                if (header.distances_offset + nq_ * k_ * sizeof(float) > size) fail(fname, "is truncated");
+                distances_ = reinterpret_cast<const float*>(data + header.distances_offset);
+            }
+        }
+        else
+        {
+            // ivecs, every row is the dimension k followed by k ids
+            if (size < sizeof(int32_t)) fail(fname, "is too small to be a vecs file");
+            int32_t k;
+            std::memcpy(&k, data, sizeof(k));
+            if (k <= 0 || size % ((k + 1) * sizeof(int32_t)) != 0) fail(fname, "is neither a .gt nor an ivecs file");
+            k_ = (size_t)k;
+            stride_ = k_ + 1;
+            nq_ = size / (stride_ * sizeof(int32_t));
+            ids_ = reinterpret_cast<const int32_t*>(data) + 1;
+        }
+    }
+
+    size_t nq() const { return nq_; }
+    size_t k() const { return k_; }
+    size_t stride() const { return stride_; }
+    bool packed() const { return packed_; }
+
+    const int32_t* ids() const { return ids_; }
+    const int32_t* row(size_t i) const { return ids_ + i * stride_; }
+
+    // nq * k distances to the neighbors, nullptr if not stored
+    const float* distances() const { return distances_; }
+
+    // bytes of the ids in memory, the mapped ones are only paged in when accessed
+    size_t id_bytes() const { return nq_ * stride_ * sizeof(int32_t); }
+};
@@ -0,0 +1,386 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Clustering.h>
+#include <faiss/Index.h>
+#include <faiss/IndexFlat.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexRefine.h>
+#include <faiss/IndexScalarQuantizer.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/impl/FaissException.h>
+#include <faiss/index_factory.h>
+
+#ifdef FAISSBENCH_GPU
+#include <faiss/gpu/GpuIndexFlat.h>
+#include <faiss/gpu/StandardGpuResources.h>
+#endif
+
+#include "benchmark_config.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+#include "vecs_stream.h"
+
+// how the coarse quantizer of IVF indexes is trained
+enum class CoarseTraining
+{
+    flat,          // faiss k-means into nlist centroids
+    hierarchical,  // two-level k-means, see hierarchical_kmeans
+    gpu,           // faiss k-means with the assignment on the GPU (FAISSBENCH_GPU builds)
+};
+
+inline const char* coarse_training_name(CoarseTraining coarse)
+{
+    switch (coarse)
+    {
+        case CoarseTraining::hierarchical: return "hierarchical";
+        case CoarseTraining::gpu:          return "gpu";
+        default:                           return "flat";
+    }
+}
+
+inline CoarseTraining parse_coarse_training(const std::string& name)
+{
+    if (name == "hierarchical") return CoarseTraining::hierarchical;
+    if (name == "gpu") return CoarseTraining::gpu;
+    if (name != "flat") std::cerr << "unknown coarse training \"" << name << "\", using flat k-means" << std::endl;
+    return CoarseTraining::flat;
+}
+
+/**
+ * Settings of an index build besides the factory string and train percentage. All but
+ * threads change the built index and are part of its cache key.
+ */
+struct BuildSettings
+{
+    int threads = 0;                 // OpenMP threads of training and adding, 0 keeps the setting of the caller
+    uint64_t train_seed = 1234;      // of the training sample and the k-means initialization
+    size_t max_train_points = 0;     // upper bound of the random training sample, 0 = train_percentage only
+    int kmeans_iterations = 0;       // k-means iterations of the coarse quantizer, 0 = faiss default
+    int max_points_per_centroid = 0; // faiss k-means subsamples larger training sets, 0 = faiss default
+    CoarseTraining coarse = CoarseTraining::flat;
+    std::function<void(const char*)> on_phase;  // called when "train" and "add" start, e.g. to label an RSS timeline
+
+    // cache key part, the default settings give the key of builds before these settings existed
+    std::string cache_params() const
+    {
+        std::string params = string_format("seed=%llu", (unsigned long long)train_seed);
+        if (max_train_points > 0) params += string_format(",max_train=%zu", max_train_points);
+        if (kmeans_iterations > 0) params += string_format(",niter=%d", kmeans_iterations);
+        if (max_points_per_centroid > 0) params += string_format(",max_ppc=%d", max_points_per_centroid);
+        if (coarse != CoarseTraining::flat) params += string_format(",coarse=%s", coarse_training_name(coarse));
+        return params;
+    }
+};
+
+/**
+ * Build settings of an [index] section: max_train_points, kmeans_iterations,
+ * max_points_per_centroid and coarse_training (flat, hierarchical or gpu).
+ */
+inline BuildSettings build_settings(const ConfigSection& section, int threads = 0)
+{
+    BuildSettings settings;
+    settings.threads = threads;
+    settings.max_train_points = section.get_size("max_train_points", 0);
+    settings.kmeans_iterations = (int)section.get_size("kmeans_iterations", 0);
+    settings.max_points_per_centroid = (int)section.get_size("max_points_per_centroid", 0);
+    settings.coarse = parse_coarse_training(section.get("coarse_training", "flat"));
+    return settings;
+}
+
+// one chunk added by build_index, the time excludes the wait for the reader thread
+struct ChunkTiming
+{
+    size_t count = 0;
+    long long us = 0;
+
+    double vectors_per_s() const { return us > 0 ? count * 1e6 / us : 0; }
+};
+
+// time spent by build_index, the chunks are only known for a build and not for a cached index
+struct BuildStats
+{
+    size_t train_points = 0;
+    double train_s = 0;
+    double add_s = 0;
+    int threads = 0;
+    std::vector<ChunkTiming> chunks;
+
+    // training seconds per million training vectors
+    double train_s_per_million() const { return train_points > 0 ? train_s * 1e6 / train_points : 0; }
+};
+
+// the IVF index of an index or of the base of a refine index, nullptr if there is none
+inline faiss::IndexIVF* ivf_of(faiss::Index* index)
+{
+    if (auto refine = dynamic_cast<faiss::IndexRefine*>(index)) index = refine->base_index;
+    return dynamic_cast<faiss::IndexIVF*>(index);
+}
+
+/**
+ * Two-level k-means into nlist centroids. The training vectors are clustered into
+ * sqrt(nlist) top level clusters first, then every top level cluster is split into a
+ * share of the nlist centroids proportional to its size, trained on its own vectors
+ * only. The assignment cost per iteration drops from nlist to about 2 sqrt(nlist)
+ * distances per vector, at the price of slightly less balanced and less accurate
+ * centroids. Returns the nlist * d centroids, fewer if n < nlist.
+ */
+inline std::vector<float> hierarchical_kmeans(size_t d, size_t n, const float* x, size_t nlist, const faiss::ClusteringParameters& cp)
+{
+    const size_t n1 = std::clamp<size_t>(size_t(std::sqrt(double(nlist)) + 0.5), 1, nlist);
+    faiss::Clustering top(d, n1, cp);
+    faiss::IndexFlatL2 top_index(d);
+    top.train(n, x, top_index);
+
+    std::vector<faiss::idx_t> assign(n);
+    {
+        std::vector<float> distances(n);
+        top_index.search(n, x, 1, distances.data(), assign.data());
+    }
+    std::vector<std::vector<size_t>> members(n1);
+    for (size_t i = 0; i < n; i++) members[assign[i]].push_back(i);
+
+    // split nlist proportionally to the cluster sizes, at least one centroid per non-empty
+    // cluster and never more centroids than vectors
+    std::vector<size_t> share(n1, 0);
+    size_t total = 0;
+    for (size_t c = 0; c < n1; c++)
+    {
+        if (members[c].empty()) continue;
+        share[c] = std::clamp<size_t>(nlist * members[c].size() / n, 1, members[c].size());
+        total += share[c];
+    }
+    while (total != nlist)
+    {
+        // give to the cluster with the most vectors per centroid, take from the one with the fewest
+        size_t best = n1;
+        for (size_t c = 0; c < n1; c++)
+        {
+            if (total < nlist ? share[c] >= members[c].size() : share[c] <= 1) continue;
+            double ratio = double(members[c].size()) / std::max<size_t>(share[c], 1);
+            double best_ratio = best < n1 ? double(members[best].size()) / std::max<size_t>(share[best], 1) : 0;
+            if (best == n1 || (total < nlist ? ratio > best_ratio : ratio < best_ratio)) best = c;
+        }
+        if (best == n1) break;  // fewer training vectors than centroids
+        if (total < nlist) { share[best]++; total++; }
+        else { share[best]--; total--; }
+    }
+
+    std::vector<float> centroids;
+    centroids.reserve(nlist * d);
+    for (size_t c = 0; c < n1; c++)
+    {
+        if (share[c] == 0) continue;
+        std::vector<float> xc(members[c].size() * d);
+        for (size_t i = 0; i < members[c].size(); i++)
+            std::copy(x + members[c][i] * d, x + (members[c][i] + 1) * d, xc.data() + i * d);
+
+        faiss::ClusteringParameters cpc = cp;
+        cpc.seed = cp.seed + int(c) + 1;
+        cpc.verbose = false;
+        faiss::Clustering sub(d, share[c], cpc);
+        faiss::IndexFlatL2 sub_index(d);
+        sub.train(members[c].size(), xc.data(), sub_index);
+        centroids.insert(centroids.end(), sub.centroids.begin(), sub.centroids.end());
+    }
+    return centroids;
+}
+
+/**
+ * Trains the index on n vectors, its IVF coarse quantizer with the k-means settings and
+ * method of settings. A hierarchical or GPU trained quantizer is trained (and filled)
+ * first, IndexIVF::train then skips it and only trains the rest of the index.
+ */
+inline void train_index(faiss::Index* index, size_t n, const float* x, const BuildSettings& settings)
+{
+    faiss::IndexIVF* ivf = ivf_of(index);
+    if (ivf != nullptr)
+    {
+        if (settings.kmeans_iterations > 0) ivf->cp.niter = settings.kmeans_iterations;
+        if (settings.max_points_per_centroid > 0) ivf->cp.max_points_per_centroid = settings.max_points_per_centroid;
+        ivf->cp.seed = (int)settings.train_seed;
+    }
+
+    if (ivf != nullptr && settings.coarse == CoarseTraining::hierarchical && ivf->quantizer->ntotal == 0)
+    {
+        // both levels subsample their training vectors to max_points_per_centroid as usual,
+        // with fewer vectors than centroids the second level returns less than nlist of them
+        FAISS_THROW_IF_NOT_MSG(n >= ivf->nlist, "hierarchical coarse training needs at least nlist training vectors");
+        auto centroids = hierarchical_kmeans(ivf->d, n, x, ivf->nlist, ivf->cp);
+        ivf->quantizer->train(ivf->nlist, centroids.data());
+        ivf->quantizer->add(ivf->nlist, centroids.data());
+        index->train(n, x);
+        return;
+    }
+
+    if (ivf != nullptr && settings.coarse == CoarseTraining::gpu)
+    {
+#ifdef FAISSBENCH_GPU
+        faiss::gpu::StandardGpuResources resources;
+        faiss::gpu::GpuIndexFlatL2 gpu_index(&resources, ivf->d);
+        ivf->clustering_index = &gpu_index;
+        index->train(n, x);
+        ivf->clustering_index = nullptr;
+        return;
+#else
+        std::cerr << "GPU k-means needs a FAISSBENCH_GPU build, training the coarse quantizer on the CPU" << std::endl;
+#endif
+    }
+
+    index->train(n, x);
+}
+
+/**
+ * True if the codes of a flat scalar quantizer index are the raw values of T vectors:
+ * SQfp16 for fp16, SQbf16 for bf16 and SQ8_direct for uint8 base vectors. Such vectors
+ * are appended to the codes as they are, without a float copy and without encoding.
+ */
+template<typename T>
+inline bool stores_raw_values(const faiss::Index* index)
+{
+    auto sq = dynamic_cast<const faiss::IndexScalarQuantizer*>(index);
+    if (sq == nullptr) return false;
+    if constexpr (std::is_same_v<T, float16>) return sq->sq.qtype == faiss::ScalarQuantizer::QT_fp16;
+#if FAISS_VERSION_MAJOR > 1 || FAISS_VERSION_MINOR >= 8
+    if constexpr (std::is_same_v<T, bfloat16>) return sq->sq.qtype == faiss::ScalarQuantizer::QT_bf16;
+#endif
+    if constexpr (std::is_same_v<T, uint8_t>) return sq->sq.qtype == faiss::ScalarQuantizer::QT_8bit_direct;
+    return false;
+}
+
+/**
+ * Creates the index described by index_type, trains it on a random sample of
+ * train_percentage percent of the base vectors (drawn with train_seed) and streams all
+ * of them into the index in chunks of chunk_size vectors, with settings.threads OpenMP
+ * threads. Progress and memory usage are logged with the timestamps of stopwatch, the
+ * train and add times are returned in stats.
+ *
+ * Base vectors of reduced precision are converted to float chunk by chunk, by the reader
+ * thread of the stream. If the index stores exactly these values (stores_raw_values) the
+ * chunks are appended to its codes directly.
+ */
+template<typename T>
+inline faiss::Index* build_index(const VecsView<T>& xb, const char* index_type, float train_percentage,
+                                 size_t chunk_size, StopW& stopwatch, const BuildSettings& settings = {}, BuildStats* stats = nullptr)
+{
+    size_t nb = xb.size();
+    size_t d = xb.dims();
+
+#ifdef _OPENMP
+    const int previous_threads = omp_get_max_threads();
+    if (settings.threads > 0) omp_set_num_threads(settings.threads);
+    const int threads = omp_get_max_threads();
+#else
+    const int threads = 1;
+#endif
+    BuildStats build_stats;
+    build_stats.threads = threads;
+
+    printf("[%lld s] Preparing index \"%s\" d=%zu\n", stopwatch.getElapsedTimeSeconds(), index_type, d);
+    faiss::Index* index = faiss::index_factory((int)d, index_type, faiss::METRIC_L2);
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after creating the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    if (!index->is_trained)
+    {
+        auto train_size = size_t(nb * (train_percentage / 100));
+        if (settings.max_train_points > 0) train_size = std::min(train_size, settings.max_train_points);
+        printf("[%lld s] Train on a random sample of the database, size %zu*%zu, %s coarse k-means, %d threads\n", stopwatch.getElapsedTimeSeconds(),
+               train_size, d, coarse_training_name(settings.coarse), threads);
+        if (settings.on_phase) settings.on_phase("train");
+        StopW timer;
+        {
+            std::vector<float> xt = sample_rows<T, float>(xb, train_size, settings.train_seed);
+            train_index(index, train_size, xt.data(), settings);
+        }
+        build_stats.train_points = train_size;
+        build_stats.train_s = timer.getElapsedTimeMicro() / 1e6;
+        printf("[%lld s] Trained in %.1f s, %.1f s per million training vectors\n", stopwatch.getElapsedTimeSeconds(), build_stats.train_s, build_stats.train_s_per_million());
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after training the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    }
+
+    if (settings.on_phase) settings.on_phase("add");
+    StopW add_timer;
+
+    if (stores_raw_values<T>(index))
+    {
+        auto sq = static_cast<faiss::IndexScalarQuantizer*>(index);
+        printf("[%lld s] Indexing database, size %zu*%zu, %zu byte codes copied without conversion\n", stopwatch.getElapsedTimeSeconds(), nb, d, sq->code_size);
+        sq->codes.resize(nb * sq->code_size);
+        stream_chunks(xb, chunk_size, [&](size_t first, size_t count, const T* x) {
+            StopW chunk_timer;
+            std::memcpy(sq->codes.data() + first * sq->code_size, x, count * sq->code_size);
+            build_stats.chunks.push_back({ count, chunk_timer.getElapsedTimeMicro() });
+        });
+        sq->ntotal = nb;
+    }
+    else
+    {
+        printf("[%lld s] Indexing database, size %zu*%zu\n", stopwatch.getElapsedTimeSeconds(), nb, d);
+        stream_chunks<T, float>(xb, chunk_size, [&](size_t, size_t count, const float* x) {
+            StopW chunk_timer;
+            index->add(count, x);
+            build_stats.chunks.push_back({ count, chunk_timer.getElapsedTimeMicro() });
+        });
+    }
+    build_stats.add_s = add_timer.getElapsedTimeMicro() / 1e6;
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after filling the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+#ifdef _OPENMP
+    omp_set_num_threads(previous_threads);
+#endif
+    if (stats != nullptr) *stats = build_stats;
+    return index;
+}
+
+/**
+ * Rough peak memory in bytes of build_index for nb base vectors of dimension d: the
+ * encoded base vectors with their ids (inverted lists grow by doubling, 1.5x on average),
+ * the training sample (capped at settings.max_train_points) with a working copy for
+ * k-means, the coarse centroids and the
+ * two chunks in flight of the streaming add. The code size is taken from an empty index
+ * of the factory string, vectors are assumed to be stored as floats if it is unknown.
+ */
+inline size_t estimate_build_memory(size_t d, size_t nb, const char* index_type, float train_percentage, size_t chunk_size,
+                                    const BuildSettings& settings = BuildSettings())
+{
+    std::unique_ptr<faiss::Index> index(faiss::index_factory((int)d, index_type, faiss::METRIC_L2));
+
+    size_t code_size = d * sizeof(float);
+    try
+    {
+        size_t sa_code_size = index->sa_code_size();
+        if (sa_code_size > 0) code_size = sa_code_size;
+    }
+    catch (const faiss::FaissException&)
+    {
+        // not implemented for this index type
+    }
+
+    auto ivf = dynamic_cast<const faiss::IndexIVF*>(index.get());
+    if (auto refine = dynamic_cast<const faiss::IndexRefine*>(index.get()))
+        ivf = dynamic_cast<const faiss::IndexIVF*>(refine->base_index);
+
+    size_t id_size = ivf != nullptr ? sizeof(faiss::idx_t) : 0;
+    size_t train_size = size_t(nb * (train_percentage / 100));
+    if (settings.max_train_points > 0) train_size = std::min(train_size, settings.max_train_points);
+    size_t bytes = nb * (code_size + id_size) * 3 / 2
+                 + 2 * train_size * d * sizeof(float)
+                 + (ivf != nullptr ? ivf->nlist * d * sizeof(float) : 0)
+                 + 2 * chunk_size * d * sizeof(float);
+    return bytes;
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <faiss/Index.h>
+#include <faiss/impl/FaissException.h>
+#include <faiss/index_io.h>
+
+#include "index_build.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+/*****************************************************
+ * On-disk cache of built indexes
+ *
+ * The cache file name contains a hash of everything the built index depends on: the
+ * content of the base file, the factory string, the train fraction, the train seed, the
+ * k-means settings and the faiss version. Changing any of them results in a new cache entry instead of
+ * silently reusing a stale index. Cached indexes are opened with memory mapped read-only
+ * inverted lists where the index type supports it, which makes a cold start almost
+ * instant and lets concurrent benchmark processes share the page cache.
+ *****************************************************/
+
+inline uint64_t fnv1a_hash(const void* data, size_t length, uint64_t hash = 14695981039346656037ull)
+{
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline uint64_t fnv1a_hash(const std::string& s, uint64_t hash)
+{
+    return fnv1a_hash(s.data(), s.size(), hash);
+}
+
+/**
+ * Hash of the size and of sample_blocks evenly spaced blocks of block_size bytes of a
+ * file. Only the sampled pages are read, hashing a base file of many GB takes a few ms.
+ */
+inline uint64_t file_content_hash(const char* fname, size_t sample_blocks = 16, size_t block_size = 64 * 1024)
+{
+    MappedFile file(fname);
+    const size_t size = file.size();
+    uint64_t hash = fnv1a_hash(&size, sizeof(size));
+    if (size == 0) return hash;
+
+    block_size = std::min(block_size, size);
+    const size_t last = size - block_size;
+    for (size_t b = 0; b < sample_blocks; b++)
+    {
+        size_t offset = sample_blocks > 1 ? last / (sample_blocks - 1) * b : 0;
+        hash = fnv1a_hash(file.data() + offset, block_size, hash);
+    }
+    file.release(0, size);
+    return hash;
+}
+
+/**
+ * File name of the cached index built from base_file with the given settings.
+ * build_params describes any further setting the built index depends on.
+ */
+inline std::string index_cache_file(const std::string& index_dir, const std::string& base_file, const std::string& index_type,
+                                    float train_percentage, const std::string& build_params = "")
+{
+    uint64_t hash = file_content_hash(base_file.c_str());
+    hash = fnv1a_hash(index_type, hash);
+    hash = fnv1a_hash(string_format("train=%.6f", train_percentage), hash);
+    hash = fnv1a_hash(build_params, hash);
+    hash = fnv1a_hash(string_format("faiss=%d.%d.%d", FAISS_VERSION_MAJOR, FAISS_VERSION_MINOR, FAISS_VERSION_PATCH), hash);
+    return string_format("%s/%s,Train%4.1f,%016llx.ivf", index_dir.c_str(), index_type.c_str(), train_percentage, (unsigned long long)hash);
+}
+
+// cache file name of an index built by load_or_build_index
+inline std::string cached_index_file(const std::string& index_dir, const std::string& base_file, const std::string& index_type,
+                                     float train_percentage, const BuildSettings& settings)
+{
+    return index_cache_file(index_dir, base_file, index_type, train_percentage, settings.cache_params());
+}
+
+inline std::string cached_index_file(const std::string& index_dir, const std::string& base_file, const std::string& index_type,
+                                     float train_percentage, uint64_t train_seed = 1234)
+{
+    BuildSettings settings;
+    settings.train_seed = train_seed;
+    return cached_index_file(index_dir, base_file, index_type, train_percentage, settings);
+}
+
+/**
+ * The build times of a cached index are kept next to it in <index file>.build.json, so
+ * they can be reported when the index is loaded instead of built.
+ */
+inline void write_build_stats(const std::string& index_file, const BuildStats& stats)
+{
+    ResultRecord record;
+    record.set("train_points", stats.train_points)
+          .set("train_s", stats.train_s)
+          .set("add_s", stats.add_s)
+          .set("threads", stats.threads);
+    std::ofstream out(index_file + ".build.json", std::ios::binary);
+    out << record.to_json() << "\n";
+}
+
+inline bool read_build_stats(const std::string& index_file, BuildStats& stats)
+{
+    if (!std::filesystem::exists(index_file + ".build.json")) return false;  // cached by an older build
+    auto records = read_records(index_file + ".build.json");
+    if (records.empty()) return false;
+    auto& record = records.front();
+    for (const char* key : { "train_points", "train_s", "add_s", "threads" })
+        if (!record.count(key)) return false;  // written by an older or an interrupted build
+
+    try
+    {
+        BuildStats read;
+        read.train_points = (size_t)std::stoull(record["train_points"]);
+        read.train_s = std::stod(record["train_s"]);
+        read.add_s = std::stod(record["add_s"]);
+        read.threads = std::stoi(record["threads"]);
+        stats = read;
+    }
+    catch (const std::exception&)  // not a number
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Opens an index file with memory mapped read-only inverted lists. Index types which
+ * can not be mapped are deserialized into memory as usual.
+ */
+inline faiss::Index* read_index_mapped(const char* fname)
+{
+    try
+    {
+        return faiss::read_index(fname, faiss::IO_FLAG_MMAP | faiss::IO_FLAG_READ_ONLY);
+    }
+    catch (const faiss::FaissException& e)
+    {
+        std::cerr << "could not map " << fname << ", reading it into memory instead: " << e.what() << std::endl;
+        return faiss::read_index(fname);
+    }
+}
+
+/**
+ * Returns the cached index of (base_file, index_type, train_percentage, settings), builds
+ * and caches it first if it does not exist yet. The index is written to a temporary file
+ * and renamed, processes running at the same time never see a partially written index.
+ * The build times are returned in stats, for a cached index those of its build (if known).
+ */
+inline faiss::Index* load_or_build_index(const std::string& index_dir, const std::string& base_file, const char* index_type,
+                                         float train_percentage, size_t chunk_size, StopW& stopwatch, const BuildSettings& settings,
+                                         BuildStats* stats = nullptr)
+{
+    const auto index_file = cached_index_file(index_dir, base_file, index_type, train_percentage, settings);
+    if (std::filesystem::exists(index_file))
+    {
+        printf("[%lld s] Loading index %s\n", stopwatch.getElapsedTimeSeconds(), index_file.c_str());
+        faiss::Index* index = read_index_mapped(index_file.c_str());
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+        if (stats != nullptr && !read_build_stats(index_file, *stats)) *stats = BuildStats();
+        return index;
+    }
+
+    printf("[%lld s] Index %s is not cached, mapping %s database\n", stopwatch.getElapsedTimeSeconds(), index_file.c_str(), vecs_type_name(vecs_type(base_file)));
+    BuildStats build_stats;
+    faiss::Index* index = with_vecs_view(base_file.c_str(), [&](const auto& xb) {
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after mapping data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+        return build_index(xb, index_type, train_percentage, chunk_size, stopwatch, settings, &build_stats);
+    });
+    if (stats != nullptr) *stats = build_stats;
+
+    std::filesystem::create_directories(index_dir);
+    const auto temp_file = string_format("%s.%lld.tmp", index_file.c_str(), (long long)std::chrono::steady_clock::now().time_since_epoch().count());
+    faiss::write_index(index, temp_file.c_str());
+    std::error_code ec{};
+    std::filesystem::rename(temp_file, index_file, ec);
+    if (ec != std::error_code{})
+    {
+        std::cerr << "could not move " << temp_file << " to " << index_file << " message: " << ec.message() << std::endl;
+        std::filesystem::remove(temp_file, ec);
+    }
+    else
+    {
+        write_build_stats(index_file, build_stats);
+    }
+    return index;
+}
+
+inline faiss::Index* load_or_build_index(const std::string& index_dir, const std::string& base_file, const char* index_type,
+                                         float train_percentage, size_t chunk_size, StopW& stopwatch, uint64_t train_seed = 1234)
+{
+    BuildSettings settings;
+    settings.train_seed = train_seed;
+    return load_or_build_index(index_dir, base_file, index_type, train_percentage, chunk_size, stopwatch, settings);
+}
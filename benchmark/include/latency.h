@@ -0,0 +1,173 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <faiss/Index.h>
+
+#include "stopwatch.h"
+
+/**
+ * Log-linear latency histogram in the spirit of HdrHistogram. Values below 2^(sub_bits+1)
+ * are counted exactly, larger values are grouped into 2^sub_bits linear sub-buckets per
+ * power of two, which bounds the relative error of a reported percentile by 2^-sub_bits.
+ * Recording a value is a few bit operations and one increment.
+ */
+class LatencyHistogram
+{
+    static constexpr uint32_t sub_bits = 7;
+    static constexpr uint64_t half = uint64_t(1) << sub_bits;
+    static constexpr uint32_t max_bits = 48;  // about 3 days in nanoseconds
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t min_ = UINT64_MAX;
+    uint64_t max_ = 0;
+    double sum_ = 0;
+
+    static size_t bucket_of(uint64_t value)
+    {
+        if (value < 2 * half) return (size_t)value;
+        uint32_t msb = (uint32_t)std::bit_width(value) - 1;
+        uint32_t shift = std::min(msb, max_bits) - sub_bits;
+        uint64_t sub = std::min(value >> shift, 2 * half - 1);
+        return (size_t)(2 * half + (shift - 1) * half + (sub - half));
+    }
+
+    // midpoint of the value range counted by the bucket
+    static uint64_t value_of(size_t bucket)
+    {
+        if (bucket < 2 * half) return bucket;
+        uint64_t shift = (bucket - 2 * half) / half + 1;
+        uint64_t sub = (bucket - 2 * half) % half + half;
+        return (sub << shift) + ((uint64_t(1) << shift) >> 1);
+    }
+
+public:
+    LatencyHistogram() : counts_(2 * half + (max_bits - sub_bits) * half, 0) {}
+
+    void record(uint64_t value, uint64_t count = 1)
+    {
+        counts_[bucket_of(value)] += count;
+        total_ += count;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+        sum_ += double(value) * count;
+    }
+
+    void merge(const LatencyHistogram& other)
+    {
+        for (size_t i = 0; i < counts_.size(); i++) counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+        sum_ += other.sum_;
+    }
+
+    void reset()
+    {
+        std::fill(counts_.begin(), counts_.end(), 0);
+        total_ = 0;
+        min_ = UINT64_MAX;
+        max_ = 0;
+        sum_ = 0;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t min() const { return total_ ? min_ : 0; }
+    uint64_t max() const { return max_; }
+    double mean() const { return total_ ? sum_ / total_ : 0; }
+
+    // value below which the given percentage (0-100) of all recorded values fall
+    uint64_t percentile(double p) const
+    {
+        if (total_ == 0) return 0;
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100.0 * total_ + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); i++)
+        {
+            seen += counts_[i];
+            if (seen >= rank) return i + 1 == counts_.size() ? max_ : std::clamp(value_of(i), min_, max_);
+        }
+        return max_;
+    }
+};
+
+/**
+ * Issues the nq queries in batches of batch_size (1 = one query at a time) and records the
+ * duration of every search call in nanoseconds into hist, weighted with the number of its
+ * queries if per_query is set. Per query, all queries of a batch are assigned the duration
+ * of the whole batch, since none of them is answered before the batch returns. Returns the
+ * total search time in microseconds.
+ */
+inline long long measure_latency(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D,
+                                 faiss::idx_t* I, size_t batch_size, LatencyHistogram& hist, bool per_query = true)
+{
+    long long total_ns = 0;
+    for (size_t first = 0; first < nq; first += batch_size)
+    {
+        size_t count = std::min(batch_size, nq - first);
+
+        StopW timer;
+        index->search(count, xq + first * index->d, k, D + first * k, I + first * k);
+        auto duration_ns = timer.getElapsedTimeNano();
+
+        hist.record((uint64_t)duration_ns, per_query ? count : 1);
+        total_ns += duration_ns;
+    }
+    return total_ns / 1000;
+}
+
+// the tail percentiles of a latency histogram in microseconds
+inline std::string format_percentiles(const LatencyHistogram& hist)
+{
+    return string_format("p50 = %6.0f us, p99 = %6.0f us, p99.9 = %6.0f us", hist.percentile(50) / 1000.0,
+                         hist.percentile(99) / 1000.0, hist.percentile(99.9) / 1000.0);
+}
+
+/**
+ * Issues the nq queries in batches of batch_size and records the duration of every search
+ * call (one sample per batch) in nanoseconds into batch_hist. Returns the total search
+ * time in microseconds.
+ */
+inline long long measure_batches(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D,
+                                 faiss::idx_t* I, size_t batch_size, LatencyHistogram& batch_hist)
+{
+    return measure_latency(index, nq, xq, k, D, I, batch_size, batch_hist, false);
+}
+
+/**
+ * Prints QPS and the per-batch latency of the current operating point of the index for
+ * every batch size, a batch size of 0 stands for all nq queries in one search call. The
+ * knee of the curve, the smallest batch size which achieves knee_fraction of the peak QPS,
+ * is printed and returned.
+ */
+inline size_t print_batch_sweep(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D,
+                                faiss::idx_t* I, const std::vector<size_t>& batch_sizes, double knee_fraction = 0.9)
+{
+    std::vector<std::pair<size_t, double>> curve;  // batch size, QPS
+    for (size_t batch_size : batch_sizes)
+    {
+        if (batch_size == 0 || batch_size > nq) batch_size = nq;
+
+        LatencyHistogram batch_latency;
+        auto duration_us = measure_batches(index, nq, xq, k, D, I, batch_size, batch_latency);
+        double qps = nq / (std::max<long long>(duration_us, 1) / 1000000.0);
+        printf("    batch = %6zu: %9.0f QPS, batch latency mean = %8.0f us, %s\n", batch_size, qps,
+               batch_latency.mean() / 1000.0, format_percentiles(batch_latency).c_str());
+        curve.emplace_back(batch_size, qps);
+    }
+    if (curve.empty()) return 0;
+
+    double peak = 0;
+    for (const auto& point : curve) peak = std::max(peak, point.second);
+    size_t knee = 0;
+    for (const auto& point : curve)
+        if (point.second >= knee_fraction * peak && (knee == 0 || point.first < knee)) knee = point.first;
+    printf("    knee at batch = %zu, %.0f%% of the peak of %.0f QPS\n", knee, knee_fraction * 100, peak);
+    return knee;
+}
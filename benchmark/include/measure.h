@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+  #include <sched.h>
+#endif
+
+#include "perf_counters.h"
+#include "stopwatch.h"
+
+// how a timed region is repeated
+struct TimingSettings
+{
+    size_t warmup = 1;       // untimed runs first, they pay for cold caches and page faults
+    size_t repetitions = 5;  // timed runs, the median is reported
+};
+
+// statistics over the timed repetitions of a region
+struct TimingStats
+{
+    std::vector<long long> samples_us;
+    long long total_us = 0;
+    double median_us = 0;
+    double mad_us = 0;       // median absolute deviation from the median
+    double min_us = 0;
+    double max_us = 0;
+
+    // frequency of the CPU the region started on, sampled around every repetition (Linux)
+    double min_mhz = 0;
+    double max_mhz = 0;
+    double nominal_mhz = 0;  // cpuinfo_max_freq
+    std::string governor;
+    bool migrated = false;   // the region did not always start on the same CPU
+
+    PerfCounts perf;         // summed over the timed repetitions, if counters were given
+
+    // the frequency changed by more than 5% during the measurement or is set by a governor other than performance
+    bool frequency_scaling() const
+    {
+        if (max_mhz > 0 && (max_mhz - min_mhz) > 0.05 * max_mhz) return true;
+        return !governor.empty() && governor != "performance";
+    }
+};
+
+inline double median_of(std::vector<double> values)
+{
+    if (values.empty()) return 0;
+    auto mid = values.begin() + values.size() / 2;
+    std::nth_element(values.begin(), mid, values.end());
+    if (values.size() % 2) return *mid;
+    return (*mid + *std::max_element(values.begin(), mid)) / 2;
+}
+
+// CPU the calling thread currently runs on, -1 if unknown
+inline int current_cpu()
+{
+#if defined(__linux__)
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+}
+
+// a value of /sys/devices/system/cpu/cpu<cpu>/cpufreq/<name>, empty if not available
+inline std::string cpufreq_value(int cpu, const char* name)
+{
+#if defined(__linux__)
+    if (cpu < 0) return "";
+    std::ifstream in(string_format("/sys/devices/system/cpu/cpu%d/cpufreq/%s", cpu, name));
+    std::string value;
+    in >> value;
+    return value;
+#else
+    (void)cpu;
+    (void)name;
+    return "";
+#endif
+}
+
+inline double cpufreq_mhz(int cpu, const char* name)
+{
+    auto value = cpufreq_value(cpu, name);
+    return value.empty() ? 0.0 : atof(value.c_str()) / 1000.0;  // kHz
+}
+
+/**
+ * Runs region settings.warmup times untimed, then settings.repetitions times timed and
+ * returns the median and median absolute deviation of the timed runs, which are robust
+ * against the occasional run disturbed by other processes of a shared host. The
+ * frequency of the CPU is sampled before and after every timed run to detect frequency
+ * scaling. If counters are given they only count the timed runs.
+ */
+template <typename Region>
+inline TimingStats measure_repeated(const TimingSettings& settings, Region region, PerfCounters* counters = nullptr)
+{
+    for (size_t w = 0; w < settings.warmup; w++) region();
+
+    TimingStats stats;
+    const int cpu = current_cpu();
+    stats.governor = cpufreq_value(cpu, "scaling_governor");
+    stats.nominal_mhz = cpufreq_mhz(cpu, "cpuinfo_max_freq");
+    std::vector<double> mhz;
+
+    if (counters) counters->start();
+    const size_t repetitions = std::max<size_t>(settings.repetitions, 1);
+    for (size_t r = 0; r < repetitions; r++)
+    {
+        stats.migrated |= current_cpu() != cpu;
+        if (double f = cpufreq_mhz(cpu, "scaling_cur_freq"); f > 0) mhz.push_back(f);
+
+        StopW timer;
+        region();
+        stats.samples_us.push_back(timer.getElapsedTimeMicro());
+
+        if (double f = cpufreq_mhz(cpu, "scaling_cur_freq"); f > 0) mhz.push_back(f);
+    }
+    if (counters) stats.perf = counters->stop();
+
+    std::vector<double> samples(stats.samples_us.begin(), stats.samples_us.end());
+    for (auto s : stats.samples_us) stats.total_us += s;
+    stats.median_us = median_of(samples);
+    std::vector<double> deviations;
+    for (double s : samples) deviations.push_back(std::abs(s - stats.median_us));
+    stats.mad_us = median_of(deviations);
+    stats.min_us = *std::min_element(samples.begin(), samples.end());
+    stats.max_us = *std::max_element(samples.begin(), samples.end());
+    if (!mhz.empty())
+    {
+        stats.min_mhz = *std::min_element(mhz.begin(), mhz.end());
+        stats.max_mhz = *std::max_element(mhz.begin(), mhz.end());
+    }
+    return stats;
+}
+
+// repetitions, spread and CPU frequency of a measurement
+inline std::string format_timing(const TimingStats& stats)
+{
+    std::string s = string_format(", median of %zu runs (MAD = %.1f%%, min = %.0f us, max = %.0f us)", stats.samples_us.size(),
+                                  stats.median_us > 0 ? 100.0 * stats.mad_us / stats.median_us : 0.0, stats.min_us, stats.max_us);
+    if (stats.max_mhz > 0)
+        s += string_format(", CPU at %.0f-%.0f MHz of %.0f MHz", stats.min_mhz, stats.max_mhz, stats.nominal_mhz);
+    if (stats.frequency_scaling())
+        s += string_format(", WARNING frequency scaling (governor %s)", stats.governor.empty() ? "unknown" : stats.governor.c_str());
+    if (stats.migrated)
+        s += ", WARNING thread migrated between CPUs";
+    return s;
+}
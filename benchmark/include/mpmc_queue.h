@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Bounded lock-free multi-producer multi-consumer queue after Dmitry Vyukov. Every cell
+ * carries a sequence number which tells producers and consumers whether the cell is free
+ * for the current lap, so push and pop are one compare-and-swap on the shared position
+ * plus one store, without locks or allocations. The capacity is rounded up to a power
+ * of two. try_push fails when the queue is full and try_pop when it is empty.
+ */
+template <typename T>
+class MPMCQueue
+{
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    static constexpr size_t cache_line = 64;
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_;
+    alignas(cache_line) std::atomic<size_t> enqueue_pos_{ 0 };
+    alignas(cache_line) std::atomic<size_t> dequeue_pos_{ 0 };
+
+public:
+    explicit MPMCQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity) size *= 2;
+        cells_ = std::make_unique<Cell[]>(size);
+        mask_ = size - 1;
+        for (size_t i = 0; i < size; i++) cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    size_t capacity() const { return mask_ + 1; }
+
+    bool try_push(const T& value)
+    {
+        size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.data = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;  // full, the cell still holds a value of the previous lap
+            }
+            else
+            {
+                pos = enqueue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& value)
+    {
+        size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell& cell = cells_[pos & mask_];
+            size_t seq = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = cell.data;
+                    cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;  // empty, the cell was not written in this lap yet
+            }
+            else
+            {
+                pos = dequeue_pos_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
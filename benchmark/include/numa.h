@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Index.h>
+#include <faiss/IndexShards.h>
+#include <faiss/clone_index.h>
+
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+/*****************************************************
+ * NUMA helpers
+ *
+ * The topology is read from /sys/devices/system/node, on other platforms and on
+ * machines without NUMA information all cores form a single node. Threads are bound to
+ * the cores of a node, memory is placed on a node by first touch from a bound thread.
+ *****************************************************/
+
+// parses a kernel cpu list like "0-3,8-11"
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    size_t begin = 0;
+    while (begin < list.size())
+    {
+        size_t end = std::min(list.find(',', begin), list.size());
+        auto item = list.substr(begin, end - begin);
+        auto dash = item.find('-');
+        if (!item.empty())
+        {
+            int first = std::stoi(item.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+            for (int c = first; c <= last; c++) cpus.push_back(c);
+        }
+        begin = end + 1;
+    }
+    return cpus;
+}
+
+// the cores of every NUMA node
+inline std::vector<std::vector<int>> numa_nodes()
+{
+    std::vector<std::vector<int>> nodes;
+#if defined(__linux__)
+    for (int n = 0;; n++)
+    {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+        if (!file) break;
+        std::string list;
+        std::getline(file, list);
+        auto cpus = parse_cpu_list(list);
+        if (!cpus.empty()) nodes.push_back(cpus);  // memory-only nodes have no cores
+    }
+#endif
+    if (nodes.empty())
+    {
+        std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+        for (size_t c = 0; c < cpus.size(); c++) cpus[c] = (int)c;
+        nodes.push_back(cpus);
+    }
+    return nodes;
+}
+
+/**
+ * Binds the calling thread to the given cores and sizes its OpenMP team accordingly,
+ * OpenMP threads started by it inherit the binding. Returns false if binding is not
+ * supported on this platform.
+ */
+inline bool pin_current_thread(const std::vector<int>& cpus)
+{
+#ifdef _OPENMP
+    omp_set_num_threads((int)cpus.size());  // only affects the calling thread
+#endif
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) CPU_SET(c, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Splits the base vectors into one contiguous shard per NUMA node and wraps them in
+ * a threaded faiss::IndexShards. Every shard is cloned from the trained but empty index
+ * and filled by a thread bound to its node, so its inverted lists and codes are first
+ * touched on that node. The worker thread of every shard is bound to the same node and
+ * runs the OpenMP search of its shard with all cores of the node.
+ */
+inline faiss::IndexShards* build_numa_shards(const faiss::Index* trained, const FVecsView& xb,
+                                             const std::vector<std::vector<int>>& nodes, size_t chunk_size, StopW& stopwatch)
+{
+    const size_t nb = xb.size();
+    const size_t nshards = nodes.size();
+    std::vector<faiss::Index*> shards(nshards);
+
+    printf("[%lld s] Building %zu NUMA shards of %zu vectors\n", stopwatch.getElapsedTimeSeconds(), nshards, nb);
+    {
+        std::vector<std::thread> builders;
+        for (size_t s = 0; s < nshards; s++)
+        {
+            builders.emplace_back([&, s]() {
+                pin_current_thread(nodes[s]);
+                shards[s] = faiss::clone_index(trained);
+                xb.for_each_chunk(s * nb / nshards, (s + 1) * nb / nshards, chunk_size,
+                                  [&](size_t, size_t count, const float* x) { shards[s]->add(count, x); });
+            });
+        }
+        for (auto& b : builders) b.join();
+    }
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after building the shards\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    auto sharded = new faiss::IndexShards(trained->d, true, true);
+    for (auto shard : shards) sharded->add_shard(shard);
+    sharded->own_indices = true;
+
+    // bind the persistent worker thread of every shard to its node
+    sharded->runOnIndex([&](int s, faiss::Index*) { pin_current_thread(nodes[s]); });
+    return sharded;
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "stopwatch.h"
+
+// a measured configuration of a parameter sweep
+struct SweepPoint
+{
+    std::vector<double> params;
+    double recall = 0;
+    double qps = 0;
+};
+
+/**
+ * Points which are not dominated by any other point, i.e. no other point has a higher
+ * or equal recall with a higher or equal QPS (and is strictly better in one of them).
+ * Sorted by increasing recall and thus decreasing QPS.
+ */
+inline std::vector<SweepPoint> pareto_frontier(std::vector<SweepPoint> points)
+{
+    std::sort(points.begin(), points.end(), [](const SweepPoint& a, const SweepPoint& b) {
+        return a.recall != b.recall ? a.recall > b.recall : a.qps > b.qps;
+    });
+
+    // descending recall: a point is on the frontier if it is faster than all points with more recall
+    std::vector<SweepPoint> frontier;
+    for (auto& p : points)
+        if (frontier.empty() || p.qps > frontier.back().qps) frontier.push_back(std::move(p));
+    std::reverse(frontier.begin(), frontier.end());
+    return frontier;
+}
+
+// answer to "what is the cheapest configuration reaching the target recall"
+struct RecallTarget
+{
+    bool reached = false;      // false if no measured point reaches the target recall
+    SweepPoint cheapest;       // fastest measured point with recall >= target
+    double interpolated_qps = 0;  // frontier QPS at exactly the target recall
+};
+
+/**
+ * Looks up the fastest point of a frontier (as returned by pareto_frontier) with at least
+ * target_recall. The QPS of the frontier at exactly the target recall is interpolated
+ * between the two neighbouring frontier points, linear in log(QPS) since QPS drops about
+ * exponentially as recall approaches 1. It estimates what a configuration between the
+ * two measured ones would achieve.
+ */
+inline RecallTarget cheapest_at_recall(const std::vector<SweepPoint>& frontier, double target_recall)
+{
+    RecallTarget result;
+    auto above = std::find_if(frontier.begin(), frontier.end(), [&](const SweepPoint& p) { return p.recall >= target_recall; });
+    if (above == frontier.end()) return result;
+
+    result.reached = true;
+    result.cheapest = *above;
+    result.interpolated_qps = above->qps;
+    if (above != frontier.begin() && above->recall > target_recall)
+    {
+        auto below = std::prev(above);
+        double t = (target_recall - below->recall) / (above->recall - below->recall);
+        result.interpolated_qps = std::exp(std::log(below->qps) + t * (std::log(above->qps) - std::log(below->qps)));
+    }
+    return result;
+}
+
+/**
+ * Thins out a frontier (as returned by pareto_frontier) to the points which gain at least
+ * min_recall_gain over the previously kept, faster point. Tiny recall differences are
+ * usually measurement noise (one query of the query set) and not worth a slower search.
+ */
+inline std::vector<SweepPoint> thin_frontier(const std::vector<SweepPoint>& frontier, double min_recall_gain)
+{
+    std::vector<SweepPoint> thinned;
+    for (const auto& p : frontier)
+        if (thinned.empty() || p.recall >= thinned.back().recall + min_recall_gain) thinned.push_back(p);
+    return thinned;
+}
+
+/**
+ * Coarse to fine search for the recall-vs-QPS frontier over a grid of search parameters.
+ * Every axis is an ordered ladder of values. At first every initial_stride-th value of
+ * each axis (and its last value) is measured. Then the unmeasured grid neighbours at the
+ * current step around every frontier point are measured until the frontier does not
+ * change anymore, the step is halved and the refinement repeated down to a step of one.
+ * Only frontier points which gain at least min_recall_gain over the next faster one are
+ * refined. Dominated regions of the grid are never measured at full resolution.
+ */
+class AdaptiveGrid
+{
+    std::vector<std::vector<double>> axes_;
+    std::map<std::vector<size_t>, SweepPoint> measured_;
+
+    std::vector<double> values(const std::vector<size_t>& cell) const
+    {
+        std::vector<double> params(axes_.size());
+        for (size_t a = 0; a < axes_.size(); a++) params[a] = axes_[a][cell[a]];
+        return params;
+    }
+
+    // all cells whose indices are multiples of stride, or the last index of each axis
+    std::vector<std::vector<size_t>> lattice(size_t stride) const
+    {
+        std::vector<std::vector<size_t>> cells = { {} };
+        for (const auto& axis : axes_)
+        {
+            std::vector<size_t> indices;
+            for (size_t i = 0; i < axis.size(); i += stride) indices.push_back(i);
+            if (indices.back() != axis.size() - 1) indices.push_back(axis.size() - 1);
+
+            std::vector<std::vector<size_t>> next;
+            for (const auto& cell : cells)
+                for (size_t i : indices)
+                {
+                    next.push_back(cell);
+                    next.back().push_back(i);
+                }
+            cells = std::move(next);
+        }
+        return cells;
+    }
+
+public:
+    explicit AdaptiveGrid(std::vector<std::vector<double>> axes) : axes_(std::move(axes)) {}
+
+    size_t evaluations() const { return measured_.size(); }
+    size_t grid_size() const
+    {
+        size_t n = 1;
+        for (const auto& axis : axes_) n *= axis.size();
+        return n;
+    }
+
+    std::vector<SweepPoint> points() const
+    {
+        std::vector<SweepPoint> result;
+        for (const auto& entry : measured_) result.push_back(entry.second);
+        return result;
+    }
+
+    /**
+     * Runs the sweep, measure(params) returns the (recall, QPS) of a configuration.
+     * An initial_stride of 1 measures the full grid. Returns all measured points.
+     */
+    template <typename Measure>
+    std::vector<SweepPoint> run(Measure measure, size_t initial_stride, double min_recall_gain = 0.001)
+    {
+        auto evaluate = [&](const std::vector<size_t>& cell) {
+            if (measured_.count(cell)) return false;
+            SweepPoint point;
+            point.params = values(cell);
+            std::tie(point.recall, point.qps) = measure(point.params);
+            measured_[cell] = point;
+            return true;
+        };
+
+        initial_stride = std::max<size_t>(initial_stride, 1);
+        for (const auto& cell : lattice(initial_stride)) evaluate(cell);
+        if (initial_stride == 1) return points();
+
+        for (size_t step = initial_stride; step > 0; step /= 2)
+        {
+            bool changed = true;
+            while (changed)
+            {
+                changed = false;
+
+                // cells of the current frontier, measured points are identified by their values
+                std::set<std::vector<double>> frontier_params;
+                for (const auto& p : thin_frontier(pareto_frontier(points()), min_recall_gain)) frontier_params.insert(p.params);
+                std::vector<std::vector<size_t>> frontier_cells;
+                for (const auto& entry : measured_)
+                    if (frontier_params.count(entry.second.params)) frontier_cells.push_back(entry.first);
+
+                for (const auto& cell : frontier_cells)
+                    for (size_t a = 0; a < axes_.size(); a++)
+                    {
+                        if (cell[a] >= step)
+                        {
+                            auto below = cell;
+                            below[a] -= step;
+                            changed |= evaluate(below);
+                        }
+                        if (cell[a] + step < axes_[a].size())
+                        {
+                            auto above = cell;
+                            above[a] += step;
+                            changed |= evaluate(above);
+                        }
+                    }
+            }
+        }
+        return points();
+    }
+};
+
+// "name=value,..." of the parameters of a point
+inline std::string describe_params(const SweepPoint& p, const std::vector<std::string>& names)
+{
+    std::string s;
+    for (size_t a = 0; a < names.size(); a++) s += string_format("%s%s=%g", a ? "," : "", names[a].c_str(), p.params[a]);
+    return s;
+}
+
+// recall and QPS of the configurations of a frontier, one per line
+inline void print_frontier(const std::vector<SweepPoint>& frontier, const std::vector<std::string>& names)
+{
+    for (const auto& p : frontier)
+        printf("    recall = %.4f %9.0f QPS at %s\n", p.recall, p.qps, describe_params(p, names).c_str());
+}
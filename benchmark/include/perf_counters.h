@@ -0,0 +1,197 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+  #include <linux/perf_event.h>
+  #include <sys/ioctl.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "stopwatch.h"
+
+// hardware event counts of a measured region, summed over all threads
+struct PerfCounts
+{
+    bool valid = false;  // false if the counters are not available (platform, permissions)
+    uint64_t cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t llc_misses = 0;
+    uint64_t branch_misses = 0;
+};
+
+/**
+ * Hardware performance counters (cycles, instructions, last level cache misses and branch
+ * misses) around timed regions, based on perf_event_open on Linux. Elsewhere, or if the
+ * kernel does not permit user space counting (see /proc/sys/kernel/perf_event_paranoid),
+ * all counts are reported as invalid.
+ *
+ * One counter group is opened in every thread of an OpenMP team of the given size.
+ * OpenMP keeps its thread pool between parallel regions, hence the searches following
+ * start() run on the counted threads. The counts are scaled if the kernel had to
+ * multiplex the counter groups.
+ */
+class PerfCounters
+{
+#if defined(__linux__)
+    std::vector<int> leaders_;
+    std::vector<int> fds_;
+
+    static int open_counter(uint64_t config, int group_fd)
+    {
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group_fd == -1 ? 1 : 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);  // calling thread, any cpu
+    }
+#endif
+
+public:
+    explicit PerfCounters(int threads = 0)
+    {
+#if defined(__linux__)
+  #ifdef _OPENMP
+        if (threads <= 0) threads = omp_get_max_threads();
+  #else
+        threads = 1;
+  #endif
+        leaders_.assign(threads, -1);
+        std::vector<std::vector<int>> members(threads);
+
+        #pragma omp parallel num_threads(threads)
+        {
+  #ifdef _OPENMP
+            int t = omp_get_thread_num();
+  #else
+            int t = 0;
+  #endif
+            int leader = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+            if (leader != -1)
+            {
+                for (uint64_t config : { PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES })
+                {
+                    int fd = open_counter(config, leader);
+                    if (fd == -1)
+                    {
+                        for (int member : members[t]) close(member);
+                        members[t].clear();
+                        close(leader);
+                        leader = -1;
+                        break;
+                    }
+                    members[t].push_back(fd);
+                }
+            }
+            leaders_[t] = leader;
+        }
+
+        for (int t = 0; t < threads; t++)
+        {
+            if (leaders_[t] == -1)  // counting only some threads would be misleading
+            {
+                close_all(leaders_, members);
+                return;
+            }
+            fds_.insert(fds_.end(), members[t].begin(), members[t].end());
+        }
+#else
+        (void)threads;
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#if defined(__linux__)
+        for (int fd : fds_) close(fd);
+        for (int fd : leaders_) close(fd);
+#endif
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const
+    {
+#if defined(__linux__)
+        return !leaders_.empty();
+#else
+        return false;
+#endif
+    }
+
+    void start()
+    {
+#if defined(__linux__)
+        for (int leader : leaders_)
+        {
+            ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#endif
+    }
+
+    PerfCounts stop()
+    {
+        PerfCounts counts;
+#if defined(__linux__)
+        for (int leader : leaders_) ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        counts.valid = available();
+        for (int leader : leaders_)
+        {
+            uint64_t data[3 + 4] = {};  // nr, time enabled, time running, 4 values
+            if (read(leader, data, sizeof(data)) < (ssize_t)sizeof(data))
+            {
+                counts.valid = false;
+                continue;
+            }
+            double scale = data[2] > 0 ? double(data[1]) / data[2] : 0.0;
+            counts.cycles += uint64_t(data[3] * scale);
+            counts.instructions += uint64_t(data[4] * scale);
+            counts.llc_misses += uint64_t(data[5] * scale);
+            counts.branch_misses += uint64_t(data[6] * scale);
+        }
+#endif
+        return counts;
+    }
+
+private:
+#if defined(__linux__)
+    void close_all(std::vector<int>& leaders, std::vector<std::vector<int>>& members)
+    {
+        for (auto& fds : members)
+            for (int fd : fds) close(fd);
+        for (int fd : leaders)
+            if (fd != -1) close(fd);
+        leaders.clear();
+        fds_.clear();
+    }
+#endif
+};
+
+/**
+ * Per query counts of a region which searched nq queries in duration_us. The memory
+ * bandwidth is approximated by one 64 byte cache line per last level cache miss.
+ */
+inline std::string format_perf_counts(const PerfCounts& counts, size_t nq, long long duration_us)
+{
+    if (!counts.valid) return ", perf counters unavailable";
+    double seconds = std::max<long long>(duration_us, 1) / 1000000.0;
+    return string_format(", %.0f cycles/query, IPC = %.2f, %.1f LLC misses/query, %.1f branch misses/query, ~%.2f GB/s",
+                         counts.cycles / double(nq), counts.instructions / double(std::max<uint64_t>(counts.cycles, 1)),
+                         counts.llc_misses / double(nq), counts.branch_misses / double(nq),
+                         counts.llc_misses * 64.0 / seconds / 1e9);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Index.h>
+#include <faiss/impl/AuxIndexStructures.h>
+
+#include "gt_engine.h"
+
+/**
+ * Radii of a range search sweep, the given quantiles of distances to ground truth
+ * neighbors (squared L2). A radius at quantile p returns about p of the ground truth
+ * neighbors of a typical query.
+ */
+inline std::vector<float> radii_from_quantiles(std::vector<float> distances, const std::vector<double>& quantiles)
+{
+    std::vector<float> radii;
+    if (distances.empty()) return radii;
+    std::sort(distances.begin(), distances.end());
+    for (double p : quantiles)
+    {
+        size_t rank = std::min(distances.size() - 1, size_t(std::clamp(p, 0.0, 1.0) * (distances.size() - 1) + 0.5));
+        radii.push_back(distances[rank]);
+    }
+    return radii;
+}
+
+// distribution of the number of results per query of a range search
+struct RangeCounts
+{
+    size_t total = 0;
+    double mean = 0;
+    size_t p50 = 0, p90 = 0, p99 = 0, max = 0;
+    double empty_fraction = 0;  // queries without any result
+};
+
+inline RangeCounts range_counts(const faiss::RangeSearchResult& result)
+{
+    RangeCounts counts;
+    const size_t nq = result.nq;
+    if (nq == 0) return counts;
+    std::vector<size_t> per_query(nq);
+    size_t empty = 0;
+    for (size_t q = 0; q < nq; q++)
+    {
+        per_query[q] = result.lims[q + 1] - result.lims[q];
+        if (per_query[q] == 0) empty++;
+    }
+    std::sort(per_query.begin(), per_query.end());
+    auto at = [&](double p) { return per_query[std::min(nq - 1, size_t(p * nq))]; };
+    counts.total = result.lims[nq];
+    counts.mean = double(counts.total) / nq;
+    counts.p50 = at(0.5);
+    counts.p90 = at(0.9);
+    counts.p99 = at(0.99);
+    counts.max = per_query.back();
+    counts.empty_fraction = double(empty) / nq;
+    return counts;
+}
+
+// bytes of the lims, labels and distances arrays of a range search result
+inline size_t range_result_bytes(const faiss::RangeSearchResult& result)
+{
+    return (result.nq + 1) * sizeof(size_t) + result.lims[result.nq] * (sizeof(faiss::idx_t) + sizeof(float));
+}
+
+// micro averaged over all queries: found exact results / results and found / exact results
+struct RangeAccuracy
+{
+    size_t found = 0, results = 0, exact = 0;
+
+    double precision() const { return results > 0 ? double(found) / results : 1.0; }
+    double recall() const { return exact > 0 ? double(found) / exact : 1.0; }
+};
+
+/**
+ * Compares a range search with radius against the exact range results of a
+ * GroundTruthEngine which collected (collect_range) at least this radius.
+ */
+inline RangeAccuracy range_accuracy(const faiss::RangeSearchResult& result, const GroundTruthEngine& exact, float radius)
+{
+    size_t found = 0, results = 0, exact_count = 0;
+    #pragma omp parallel for reduction(+ : found, results, exact_count)
+    for (int64_t q = 0; q < (int64_t)result.nq; q++)
+    {
+        std::vector<faiss::idx_t> truth;
+        for (const auto& [distance, id] : exact.range_result(q))
+            if (distance < radius) truth.push_back(id);
+        std::vector<faiss::idx_t> ids(result.labels + result.lims[q], result.labels + result.lims[q + 1]);
+        std::sort(truth.begin(), truth.end());
+        std::sort(ids.begin(), ids.end());
+
+        size_t common = 0;
+        for (size_t i = 0, j = 0; i < truth.size() && j < ids.size();)
+        {
+            if (truth[i] < ids[j]) i++;
+            else if (ids[j] < truth[i]) j++;
+            else { common++; i++; j++; }
+        }
+        found += common;
+        results += ids.size();
+        exact_count += truth.size();
+    }
+
+    RangeAccuracy accuracy;
+    accuracy.found = found;
+    accuracy.results = results;
+    accuracy.exact = exact_count;
+    return accuracy;
+}
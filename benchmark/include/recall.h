@@ -0,0 +1,269 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <type_traits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Index.h>
+
+#include "distance_kernels.h"
+#include "gt_format.h"
+#include "vecs_io.h"
+
+/**
+ * Evaluates search results against the ground truth without hashing and without the
+ * quadratic scan over both id lists. Short id lists are compared with a branch free
+ * block compare, longer ones are sorted once and intersected with a merge. Ground truth
+ * prefixes are sorted only once per prefix length and reused for all evaluations.
+ *
+ * The evaluation runs in parallel over the queries with all available cores (unless
+ * restricted with set_threads), independent of the number of threads configured for the
+ * searches, and is meant to be called outside of the timed regions.
+ *
+ * The ground truth is either a faiss::idx_t matrix or int32 rows with a row stride, as
+ * found in the memory mapping of a GroundTruthFile, which are read in place.
+ */
+class RecallEvaluator
+{
+    size_t nq_;
+    const faiss::idx_t* gt64_ = nullptr;
+    const int32_t* gt32_ = nullptr;
+    size_t k_gt_;      // nb of results per query in the GT
+    size_t stride_;    // distance of the GT rows in ids
+    const float* gt_stored_distances_ = nullptr;  // nq * k_gt exact distances, if known
+    int threads_ = 0;  // evaluation threads, 0 = all cores
+
+    mutable std::map<size_t, std::vector<faiss::idx_t>> sorted_gt_;  // prefix length -> sorted prefixes
+    mutable std::map<size_t, std::vector<float>> gt_distances_;      // prefix length -> exact distances
+
+    // lists with at most this many id pairs are compared directly
+    static constexpr size_t block_compare_limit = 256;
+
+    int eval_threads() const
+    {
+#ifdef _OPENMP
+        return threads_ > 0 ? threads_ : omp_get_num_procs();
+#else
+        return 1;
+#endif
+    }
+
+    // calls fn with the typed pointer to the ground truth ids
+    template <typename Fn>
+    decltype(auto) with_gt(Fn&& fn) const
+    {
+        return gt32_ != nullptr ? fn(gt32_) : fn(gt64_);
+    }
+
+    const std::vector<faiss::idx_t>& sorted_gt(size_t gt_at) const
+    {
+        auto it = sorted_gt_.find(gt_at);
+        if (it != sorted_gt_.end()) return it->second;
+
+        auto& sorted = sorted_gt_[gt_at];
+        sorted.resize(nq_ * gt_at);
+        with_gt([&](auto gt) {
+            #pragma omp parallel for num_threads(eval_threads())
+            for (int64_t i = 0; i < (int64_t)nq_; i++)
+            {
+                auto row = sorted.data() + i * gt_at;
+                std::copy(gt + i * stride_, gt + i * stride_ + gt_at, row);
+                std::sort(row, row + gt_at);
+            }
+        });
+        return sorted;
+    }
+
+public:
+    RecallEvaluator(size_t nq, const faiss::idx_t* gt, size_t k_gt) : nq_(nq), gt64_(gt), k_gt_(k_gt), stride_(k_gt) {}
+
+    RecallEvaluator(size_t nq, const int32_t* gt, size_t k_gt, size_t stride) : nq_(nq), gt32_(gt), k_gt_(k_gt), stride_(stride) {}
+
+    // reads the ids of the file in place and uses its distances, if it has them
+    explicit RecallEvaluator(const GroundTruthFile& gt) : RecallEvaluator(gt.nq(), gt.ids(), gt.k(), gt.stride())
+    {
+        gt_stored_distances_ = gt.distances();
+    }
+
+    size_t nq() const { return nq_; }
+    size_t k_gt() const { return k_gt_; }
+
+    // restricts the evaluation to the given number of threads, e.g. when it runs next to timed searches
+    void set_threads(int threads) { threads_ = threads; }
+
+    /**
+     * Intersection recall |GT[0:gt_at] ∩ I[0:result_at]| averaged over all queries and
+     * normalized by min(gt_at, result_at). k is the number of results per query in I.
+     * With gt_at = 1 this is the 1-recall@result_at, with gt_at = result_at the
+     * result_at-recall@result_at.
+     */
+    float recall(const faiss::idx_t* I, size_t k, size_t gt_at, size_t result_at) const
+    {
+        gt_at = std::min(gt_at, k_gt_);
+        result_at = std::min(result_at, k);
+
+        size_t found = 0;
+        if (gt_at * result_at <= block_compare_limit)
+        {
+            with_gt([&](auto gt) {
+                #pragma omp parallel for num_threads(eval_threads()) reduction(+ : found)
+                for (int64_t i = 0; i < (int64_t)nq_; i++)
+                {
+                    auto gt_nn = gt + i * stride_;
+                    auto result_nn = I + i * k;
+                    size_t hits = 0;
+                    for (size_t m = 0; m < result_at; m++)
+                    {
+                        size_t match = 0;
+                        for (size_t j = 0; j < gt_at; j++) match |= size_t(gt_nn[j] == result_nn[m]);
+                        hits += match;
+                    }
+                    found += hits;
+                }
+            });
+        }
+        else
+        {
+            const auto& gt_sorted = sorted_gt(gt_at);
+            #pragma omp parallel num_threads(eval_threads()) reduction(+ : found)
+            {
+                std::vector<faiss::idx_t> result_sorted(result_at);
+
+                #pragma omp for
+                for (int64_t i = 0; i < (int64_t)nq_; i++)
+                {
+                    std::copy(I + i * k, I + i * k + result_at, result_sorted.begin());
+                    std::sort(result_sorted.begin(), result_sorted.end());
+
+                    // merge both sorted lists and count the common ids
+                    auto a = gt_sorted.data() + i * gt_at, a_end = a + gt_at;
+                    auto b = result_sorted.data(), b_end = b + result_at;
+                    size_t hits = 0;
+                    while (a != a_end && b != b_end)
+                    {
+                        if (*a < *b) a++;
+                        else if (*b < *a) b++;
+                        else
+                        {
+                            hits++;
+                            a++;
+                            b++;
+                        }
+                    }
+                    found += hits;
+                }
+            }
+        }
+        return found / float(nq_) / std::min(gt_at, result_at);
+    }
+
+    /**
+     * Mean reciprocal rank of the true nearest neighbor within the first result_at results,
+     * queries without the nearest neighbor in their results contribute 0.
+     */
+    float mrr(const faiss::idx_t* I, size_t k, size_t result_at) const
+    {
+        result_at = std::min(result_at, k);
+
+        double sum = 0;
+        with_gt([&](auto gt) {
+            #pragma omp parallel for num_threads(eval_threads()) reduction(+ : sum)
+            for (int64_t i = 0; i < (int64_t)nq_; i++)
+            {
+                faiss::idx_t nn = gt[i * stride_];
+                auto result_nn = I + i * k;
+                for (size_t m = 0; m < result_at; m++)
+                {
+                    if (result_nn[m] == nn)
+                    {
+                        sum += 1.0 / (m + 1);
+                        break;
+                    }
+                }
+            }
+        });
+        return float(sum / nq_);
+    }
+
+    /**
+     * Exact squared L2 distances of the queries to their first gt_at ground truth neighbors,
+     * nq * gt_at values. Distances stored with the ground truth are used if there are any,
+     * otherwise they are computed from the base vectors (converted row by row if reduced
+     * precision). Computed once per prefix length.
+     */
+    template<typename T>
+    const std::vector<float>& gt_distances(const VecsView<T>& xb, const float* xq, size_t gt_at) const
+    {
+        gt_at = std::min(gt_at, k_gt_);
+        auto it = gt_distances_.find(gt_at);
+        if (it != gt_distances_.end()) return it->second;
+
+        const size_t d = xb.dims();
+        const DistanceKernel l2sqr = l2sqr_kernel(d);
+        auto base_row = [&](size_t id, std::vector<float>& buffer) -> const float* {
+            if constexpr (std::is_same_v<T, float>) return xb.row(id);
+            convert_values(xb.row(id), d, buffer.data());
+            return buffer.data();
+        };
+        std::vector<float> distances(nq_ * gt_at);
+        with_gt([&](auto gt) {
+            #pragma omp parallel for num_threads(eval_threads())
+            for (int64_t i = 0; i < (int64_t)nq_; i++)
+            {
+                std::vector<float> buffer(d);
+                for (size_t j = 0; j < gt_at; j++)
+                    distances[i * gt_at + j] = gt_stored_distances_ != nullptr ? gt_stored_distances_[i * k_gt_ + j]
+                                             : l2sqr(xq + i * d, base_row(gt[i * stride_ + j], buffer), d);
+            }
+        });
+        return gt_distances_.emplace(gt_at, std::move(distances)).first->second;
+    }
+
+    /**
+     * Mean of sqrt(d(q, r_j) / d(q, g_j)) over the first result_at ranks j and all queries,
+     * r_j is the j-th result and g_j the j-th ground truth neighbor. Both distances are
+     * exact L2 distances computed from the base vectors, hence approximate distances
+     * returned by compressed indexes do not distort the ratio. Ranks with a missing
+     * result or a zero ground truth distance are skipped. Distances stored with the ground
+     * truth (squared L2, as computed by faiss) are used instead of the base vectors.
+     * Reduced precision base files are converted row by row.
+     */
+    template<typename T>
+    float distance_ratio(const VecsView<T>& xb, const float* xq, const faiss::idx_t* I, size_t k, size_t result_at) const
+    {
+        result_at = std::min({result_at, k, k_gt_});
+        const size_t d = xb.dims();
+        const DistanceKernel l2sqr = l2sqr_kernel(d);
+        auto base_row = [&](size_t id, std::vector<float>& buffer) -> const float* {
+            if constexpr (std::is_same_v<T, float>) return xb.row(id);
+            convert_values(xb.row(id), d, buffer.data());
+            return buffer.data();
+        };
+
+        const auto& exact = gt_distances(xb, xq, result_at);
+
+        double sum = 0;
+        size_t count = 0;
+        #pragma omp parallel for num_threads(eval_threads()) reduction(+ : sum, count)
+        for (int64_t i = 0; i < (int64_t)nq_; i++)
+        {
+            std::vector<float> buffer(d);
+            for (size_t j = 0; j < result_at; j++)
+            {
+                auto id = I[i * k + j];
+                float gt_dist = exact[i * result_at + j];
+                if (id < 0 || gt_dist <= 0) continue;
+                sum += std::sqrt(l2sqr(xq + i * d, base_row(id, buffer), d) / gt_dist);
+                count++;
+            }
+        }
+        return count ? float(sum / count) : 0.0f;
+    }
+};
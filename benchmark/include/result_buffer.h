@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Index.h>
+
+/**
+ * Preallocated output arena of the searches, nq * k labels and distances.
+ *
+ * The memory is allocated once, page aligned and optionally backed by transparent huge
+ * pages, and every page is touched right away. The first touch happens in an OpenMP loop
+ * over the query rows with the same static schedule faiss uses for its searches, hence
+ * with first-touch placement the rows of a thread are local to its NUMA node. Reusing the
+ * buffer for all timed configurations keeps page faults out of the measured us/query.
+ */
+class ResultBuffer
+{
+    size_t nq_, k_;
+    size_t bytes_ = 0;
+    void* memory_ = nullptr;
+    faiss::idx_t* labels_ = nullptr;
+    float* distances_ = nullptr;
+
+public:
+    ResultBuffer(size_t nq, size_t k, bool huge_pages = true) : nq_(nq), k_(k)
+    {
+        size_t label_bytes = (nq * k * sizeof(faiss::idx_t) + 63) / 64 * 64;  // distances start on a cache line
+        bytes_ = std::max<size_t>(1, label_bytes + nq * k * sizeof(float));
+
+#if defined(_WIN32)
+        memory_ = VirtualAlloc(NULL, bytes_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (memory_ == NULL)
+#else
+        memory_ = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory_ == MAP_FAILED)
+#endif
+        {
+            std::cerr << "could not allocate " << bytes_ << " bytes for the search results" << std::endl;
+            perror("");
+            abort();
+        }
+#if defined(MADV_HUGEPAGE)
+        if (huge_pages) madvise(memory_, bytes_, MADV_HUGEPAGE);
+#else
+        (void)huge_pages;
+#endif
+
+        labels_ = reinterpret_cast<faiss::idx_t*>(memory_);
+        distances_ = reinterpret_cast<float*>(reinterpret_cast<uint8_t*>(memory_) + label_bytes);
+        prefault();
+    }
+
+    ~ResultBuffer()
+    {
+#if defined(_WIN32)
+        VirtualFree(memory_, 0, MEM_RELEASE);
+#else
+        munmap(memory_, bytes_);
+#endif
+    }
+
+    ResultBuffer(const ResultBuffer&) = delete;
+    ResultBuffer& operator=(const ResultBuffer&) = delete;
+
+    size_t nq() const { return nq_; }
+    size_t k() const { return k_; }
+    size_t bytes() const { return bytes_; }
+
+    faiss::idx_t* I() { return labels_; }
+    float* D() { return distances_; }
+
+    // writes every row, faults in all pages with the first-touch NUMA placement of the row owners
+    void prefault()
+    {
+        #pragma omp parallel for schedule(static)
+        for (int64_t q = 0; q < (int64_t)nq_; q++)
+        {
+            for (size_t j = 0; j < k_; j++)
+            {
+                labels_[q * k_ + j] = -1;
+                distances_[q * k_ + j] = 0;
+            }
+        }
+    }
+};
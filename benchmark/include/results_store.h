@@ -0,0 +1,330 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+  #include <cpuid.h>
+#endif
+
+#include "stopwatch.h"
+
+/*****************************************************
+ * Machine readable benchmark results
+ *
+ * Every operating point of a benchmark is appended as one JSON object per line (JSON
+ * Lines) to a results file. Besides the measurements each record contains the machine
+ * and software context it was measured in: CPU model, core count, git revision of the
+ * benchmark sources and the faiss version. faiss_compare_results compares two such files
+ * and reports recall and throughput regressions.
+ *****************************************************/
+
+// git revision of the benchmark sources, set by CMake at configure time
+#ifndef FAISSBENCH_GIT_SHA
+  #define FAISSBENCH_GIT_SHA "unknown"
+#endif
+
+inline std::string json_escape(const std::string& s)
+{
+    std::string out;
+    out.reserve(s.size() + 2);
+    for (char c : s)
+    {
+        switch (c)
+        {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) out += string_format("\\u%04x", (unsigned)(unsigned char)c);
+                else out += c;
+        }
+    }
+    return out;
+}
+
+/**
+ * One benchmark result, an ordered list of fields written as a flat JSON object.
+ * Setting a field a second time replaces its value.
+ */
+class ResultRecord
+{
+    std::vector<std::pair<std::string, std::string>> fields_;  // key, encoded JSON value
+
+    void set_encoded(const std::string& key, std::string encoded)
+    {
+        for (auto& field : fields_)
+        {
+            if (field.first == key)
+            {
+                field.second = std::move(encoded);
+                return;
+            }
+        }
+        fields_.emplace_back(key, std::move(encoded));
+    }
+
+public:
+    ResultRecord& set(const std::string& key, const std::string& value)
+    {
+        set_encoded(key, "\"" + json_escape(value) + "\"");
+        return *this;
+    }
+
+    ResultRecord& set(const std::string& key, const char* value)
+    {
+        return set(key, std::string(value));
+    }
+
+    template <typename T>
+        requires std::is_arithmetic_v<T>
+    ResultRecord& set(const std::string& key, T value)
+    {
+        if constexpr (std::is_same_v<T, bool>)
+            set_encoded(key, value ? "true" : "false");
+        else if constexpr (std::is_integral_v<T>)
+            set_encoded(key, std::to_string(value));
+        else if (std::isfinite(value))
+            set_encoded(key, string_format("%.10g", double(value)));
+        else
+            set_encoded(key, "null");  // JSON has no NaN or infinity
+        return *this;
+    }
+
+    std::string to_json() const
+    {
+        std::string json = "{";
+        for (size_t i = 0; i < fields_.size(); i++)
+            json += string_format("%s\"%s\":%s", i ? "," : "", json_escape(fields_[i].first).c_str(), fields_[i].second.c_str());
+        return json + "}";
+    }
+};
+
+// model name of the CPU, e.g. "Intel(R) Xeon(R) Gold 6248 CPU @ 2.50GHz"
+inline std::string cpu_model()
+{
+#if defined(__linux__)
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.rfind("model name", 0) != 0) continue;
+        auto colon = line.find(':');
+        if (colon != std::string::npos) return line.substr(line.find_first_not_of(" \t", colon + 1));
+    }
+#endif
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    // processor brand string of the extended cpuid leaves
+    unsigned int regs[12] = {};
+    for (unsigned int leaf = 0; leaf < 3; leaf++)
+    {
+  #if defined(_MSC_VER)
+        __cpuid(reinterpret_cast<int*>(regs + 4 * leaf), int(0x80000002 + leaf));
+  #else
+        if (!__get_cpuid(0x80000002 + leaf, regs + 4 * leaf, regs + 4 * leaf + 1, regs + 4 * leaf + 2, regs + 4 * leaf + 3)) return "unknown";
+  #endif
+    }
+    std::string brand(reinterpret_cast<const char*>(regs), sizeof(regs));
+    brand = brand.substr(0, brand.find('\0'));
+    auto first = brand.find_first_not_of(' ');
+    if (first != std::string::npos) return brand.substr(first);
+#endif
+    return "unknown";
+}
+
+// current UTC time in ISO 8601, e.g. 2024-03-01T12:00:00Z
+inline std::string utc_timestamp()
+{
+    std::time_t now = std::time(nullptr);
+    std::tm utc{};
+#if defined(_WIN32)
+    gmtime_s(&utc, &now);
+#else
+    gmtime_r(&now, &utc);
+#endif
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &utc);
+    return buf;
+}
+
+/**
+ * Record of a search benchmark operating point with the fields faiss_compare_results
+ * matches records by (benchmark, dataset, factory, params, k, recall_at) and compares
+ * (recall, qps), plus memory usage and the machine context.
+ */
+inline ResultRecord search_record(const std::string& benchmark, const std::string& dataset, const std::string& factory,
+                                  const std::string& params, size_t k, size_t recall_at, double recall,
+                                  long long duration_us, size_t nq)
+{
+    ResultRecord record;
+    record.set("benchmark", benchmark)
+          .set("dataset", dataset)
+          .set("factory", factory)
+          .set("params", params)
+          .set("k", k)
+          .set("recall_at", recall_at)
+          .set("recall", recall)
+          .set("us_per_query", duration_us / double(nq))
+          .set("qps", nq / (std::max<long long>(duration_us, 1) / 1000000.0))
+          .set("nq", nq)
+          .set("rss_mb", getCurrentRSS() / 1000000)
+          .set("peak_rss_mb", getPeakRSS() / 1000000)
+          .set("cpu_model", cpu_model())
+          .set("cores", std::thread::hardware_concurrency())
+          .set("git_sha", FAISSBENCH_GIT_SHA)
+          .set("timestamp", utc_timestamp());
+#ifdef FAISS_VERSION_MAJOR  // faiss headers are not needed to read and compare results
+    record.set("faiss_version", string_format("%d.%d.%d", FAISS_VERSION_MAJOR, FAISS_VERSION_MINOR, FAISS_VERSION_PATCH));
+#endif
+#ifdef FAISSBENCH_ISA
+    record.set("isa", FAISSBENCH_ISA);
+#endif
+    return record;
+}
+
+// p50, p99 and p99.9 in microseconds of a histogram of nanoseconds, e.g. a LatencyHistogram
+template <typename Histogram>
+inline void set_percentiles(ResultRecord& record, const Histogram& hist)
+{
+    record.set("p50_us", hist.percentile(50) / 1000.0)
+          .set("p99_us", hist.percentile(99) / 1000.0)
+          .set("p999_us", hist.percentile(99.9) / 1000.0);
+}
+
+/**
+ * Appends records to a JSON Lines file, an empty file name disables the store. Each
+ * record is written with a single write call and flushed, several processes can append
+ * to the same file.
+ */
+class ResultsStore
+{
+    std::string fname_;
+
+public:
+    explicit ResultsStore(std::string fname = "") : fname_(std::move(fname))
+    {
+        if (fname_.empty()) return;
+        auto dir = std::filesystem::path(fname_).parent_path();
+        std::error_code ec{};
+        if (!dir.empty()) std::filesystem::create_directories(dir, ec);
+    }
+
+    bool enabled() const { return !fname_.empty(); }
+    const std::string& file() const { return fname_; }
+
+    void append(const ResultRecord& record) const
+    {
+        if (fname_.empty()) return;
+        FILE* f = fopen(fname_.c_str(), "ab");
+        if (f == nullptr)
+        {
+            std::cerr << "could not open results file " << fname_ << std::endl;
+            perror("");
+            abort();
+        }
+        std::string line = record.to_json() + "\n";
+        fwrite(line.data(), 1, line.size(), f);
+        fclose(f);
+    }
+};
+
+/**
+ * Parses a flat JSON object as written by ResultRecord. Returns the fields with string
+ * values unescaped and numbers, booleans and null as their literal text. Nested objects
+ * and arrays are not supported, an empty map is returned for lines which can not be parsed.
+ */
+inline std::map<std::string, std::string> parse_record(const std::string& line)
+{
+    std::map<std::string, std::string> fields;
+    size_t pos = 0;
+    auto skip_space = [&]() { while (pos < line.size() && isspace((unsigned char)line[pos])) pos++; };
+    auto parse_string = [&](std::string& out) {
+        if (pos >= line.size() || line[pos] != '"') return false;
+        for (pos++; pos < line.size() && line[pos] != '"'; pos++)
+        {
+            char c = line[pos];
+            if (c == '\\' && pos + 1 < line.size())
+            {
+                c = line[++pos];
+                if (c == 'n') c = '\n';
+                else if (c == 'r') c = '\r';
+                else if (c == 't') c = '\t';
+                else if (c == 'u' && pos + 4 < line.size())
+                {
+                    c = (char)std::stoi(line.substr(pos + 1, 4), nullptr, 16);  // control characters only
+                    pos += 4;
+                }
+            }
+            out += c;
+        }
+        return pos++ < line.size();
+    };
+
+    skip_space();
+    if (pos >= line.size() || line[pos++] != '{') return {};
+    for (;;)
+    {
+        skip_space();
+        if (pos < line.size() && line[pos] == '}') return fields;
+        std::string key, value;
+        if (!parse_string(key)) return {};
+        skip_space();
+        if (pos >= line.size() || line[pos++] != ':') return {};
+        skip_space();
+        if (pos < line.size() && line[pos] == '"')
+        {
+            if (!parse_string(value)) return {};
+        }
+        else
+        {
+            size_t end = line.find_first_of(",}", pos);
+            if (end == std::string::npos) return {};
+            value = line.substr(pos, end - pos);
+            while (!value.empty() && isspace((unsigned char)value.back())) value.pop_back();
+            pos = end;
+        }
+        fields[key] = value;
+        skip_space();
+        if (pos < line.size() && line[pos] == ',') pos++;
+    }
+}
+
+// all records of a JSON Lines results file
+inline std::vector<std::map<std::string, std::string>> read_records(const std::string& fname)
+{
+    std::ifstream in(fname);
+    if (!in)
+    {
+        std::cerr << "could not open results file " << fname << std::endl;
+        perror("");
+        abort();
+    }
+    std::vector<std::map<std::string, std::string>> records;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        auto record = parse_record(line);
+        if (record.empty()) std::cerr << "skipping malformed line of " << fname << ": " << line << std::endl;
+        else records.push_back(std::move(record));
+    }
+    return records;
+}
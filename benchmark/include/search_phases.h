@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexRefine.h>
+#include <faiss/impl/DistanceComputer.h>
+#include <faiss/impl/FaissAssert.h>
+#include <faiss/utils/Heap.h>
+
+#include "result_buffer.h"
+#include "stopwatch.h"
+
+// time per query of the phases of a refined IVF search and the work counted by faiss
+struct SearchPhases
+{
+    double coarse_us = 0;        // coarse quantizer, assignment of the queries to nprobe lists
+    double scan_us = 0;          // scan of the inverted lists, the base search minus the coarse assignment
+    double refine_us = 0;        // reranking of the k * k_factor candidates with the refine index
+    double lists_per_query = 0;  // from indexIVF_stats
+    double codes_per_query = 0;  // from indexIVF_stats
+    double stats_quantization_ms = 0;
+    double stats_search_ms = 0;
+};
+
+/**
+ * Reranks the k_base candidates of one query with the distance computer of the refine
+ * index into the k results dis, ids. C is the heap of IndexRefine::search, CMax for L2
+ * and CMin for inner products.
+ */
+template<class C>
+inline void refine_candidates(faiss::DistanceComputer& dc, size_t k, size_t k_base, const faiss::idx_t* labels, float* dis, faiss::idx_t* ids)
+{
+    faiss::heap_heapify<C>(k, dis, ids);
+    for (size_t j = 0; j < k_base; j++)
+    {
+        faiss::idx_t id = labels[j];
+        if (id < 0) break;  // less than k_base candidates found
+        float distance = dc(id);
+        if (C::cmp(dis[0], distance)) faiss::heap_replace_top<C>(k, dis, ids, distance, id);
+    }
+    faiss::heap_reorder<C>(k, dis, ids);
+}
+
+/**
+ * Replays the search of an IndexRefine with an IVF base index phase by phase: the coarse
+ * quantization alone, the base search of k * k_factor candidates (coarse quantization plus
+ * list scan) and the refine pass, reranking the candidates with a DistanceComputer of
+ * the refine index like IndexRefine::search does for the L2 and inner product metrics,
+ * other metrics throw. The faiss counters of indexIVF_stats are reset before the base
+ * search. The final results are written to D and I (nq * k).
+ */
+inline SearchPhases measure_refine_phases(const faiss::IndexRefine* index, size_t nq, const float* xq, size_t k,
+                                          float* D, faiss::idx_t* I)
+{
+    const faiss::MetricType metric = index->refine_index->metric_type;
+    if (metric != faiss::METRIC_L2 && metric != faiss::METRIC_INNER_PRODUCT)
+        FAISS_THROW_MSG("measure_refine_phases supports the L2 and inner product metrics only");
+
+    SearchPhases phases;
+    const size_t k_base = std::max<size_t>(k, size_t(k * index->k_factor));
+    ResultBuffer candidates(nq, k_base);
+
+    // coarse quantization on its own
+    auto ivf = dynamic_cast<const faiss::IndexIVF*>(index->base_index);
+    if (ivf != nullptr)
+    {
+        ResultBuffer assignment(nq, ivf->nprobe);
+        StopW timer;
+        ivf->quantizer->search(nq, xq, ivf->nprobe, assignment.D(), assignment.I());
+        phases.coarse_us = timer.getElapsedTimeMicro() / double(nq);
+    }
+
+    // base search, coarse quantization and list scan
+    faiss::indexIVF_stats.reset();
+    {
+        StopW timer;
+        index->base_index->search(nq, xq, k_base, candidates.D(), candidates.I());
+        phases.scan_us = std::max(0.0, timer.getElapsedTimeMicro() / double(nq) - phases.coarse_us);
+    }
+    phases.lists_per_query = faiss::indexIVF_stats.nlist / double(nq);
+    phases.codes_per_query = faiss::indexIVF_stats.ndis / double(nq);
+    phases.stats_quantization_ms = faiss::indexIVF_stats.quantization_time;
+    phases.stats_search_ms = faiss::indexIVF_stats.search_time;
+
+    // refine pass
+    {
+        const faiss::idx_t* labels = candidates.I();
+        StopW timer;
+        #pragma omp parallel
+        {
+            std::unique_ptr<faiss::DistanceComputer> dc(index->refine_index->get_distance_computer());
+
+            #pragma omp for
+            for (int64_t q = 0; q < (int64_t)nq; q++)
+            {
+                dc->set_query(xq + q * index->d);
+                if (metric == faiss::METRIC_L2)
+                    refine_candidates<faiss::CMax<float, faiss::idx_t>>(*dc, k, k_base, labels + q * k_base, D + q * k, I + q * k);
+                else
+                    refine_candidates<faiss::CMin<float, faiss::idx_t>>(*dc, k, k_base, labels + q * k_base, D + q * k, I + q * k);
+            }
+        }
+        phases.refine_us = timer.getElapsedTimeMicro() / double(nq);
+    }
+    return phases;
+}
+
+inline std::string format_phases(const SearchPhases& phases)
+{
+    return string_format("    phases: coarse = %7.1f us, list scan = %7.1f us, refine = %7.1f us per query, "
+                         "%.1f lists and %.0f codes per query (faiss stats: quantization %.1f ms, search %.1f ms)",
+                         phases.coarse_us, phases.scan_us, phases.refine_us, phases.lists_per_query,
+                         phases.codes_per_query, phases.stats_quantization_ms, phases.stats_search_ms);
+}
@@ -35,6 +35,11 @@ public:
         return (std::chrono::duration_cast<std::chrono::microseconds>(time_end - time_begin).count());
     }
 
+    long long getElapsedTimeNano()
+    {
+        std::chrono::steady_clock::time_point time_end = std::chrono::steady_clock::now();
+        return (std::chrono::duration_cast<std::chrono::nanoseconds>(time_end - time_begin).count());
+    }
 
     void reset()
     {
@@ -160,3 +165,31 @@ static size_t getCurrentRSS()
     return (size_t)0L; /* Unsupported. */
 #endif
 }
+
+/**
+* Returns the size of the physical memory of the machine in bytes,
+* or zero if the value cannot be determined on this OS.
+*/
+static size_t getPhysicalMemory()
+{
+#if defined(_WIN32)
+    /* Windows -------------------------------------------------- */
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (!GlobalMemoryStatusEx(&status))
+        return (size_t)0L; /* Can't access? */
+    return (size_t)status.ullTotalPhys;
+
+#elif defined(__unix__) || defined(__unix) || defined(unix) || (defined(__APPLE__) && defined(__MACH__))
+    /* BSD, Linux, and OSX -------------------------------------- */
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0)
+        return (size_t)0L; /* Can't access? */
+    return (size_t)pages * (size_t)page_size;
+
+#else
+    /* Unknown OS ----------------------------------------------- */
+    return (size_t)0L; /* Unsupported. */
+#endif
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <faiss/Index.h>
+
+#include "stopwatch.h"
+
+/**
+ * Thread counts 1, 2, 4, ... up to max_threads, max_threads itself is always included.
+ */
+inline std::vector<size_t> thread_counts(size_t max_threads)
+{
+    std::vector<size_t> counts;
+    for (size_t t = 1; t < max_threads; t *= 2) counts.push_back(t);
+    counts.push_back(std::max<size_t>(1, max_threads));
+    return counts;
+}
+
+/**
+ * Queries per second of a single batched search over all nq queries, parallelized
+ * internally by faiss with the given number of OpenMP threads.
+ */
+inline double measure_omp_qps(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D,
+                              faiss::idx_t* I, size_t threads)
+{
+#ifdef _OPENMP
+    int previous_threads = omp_get_max_threads();
+    omp_set_num_threads((int)threads);
+#endif
+
+    StopW timer;
+    index->search(nq, xq, k, D, I);
+    auto duration_us = timer.getElapsedTimeMicro();
+
+#ifdef _OPENMP
+    omp_set_num_threads(previous_threads);
+#endif
+    return nq / (std::max<long long>(duration_us, 1) / 1000000.0);
+}
+
+/**
+ * Queries per second of the given number of worker threads sharing the index, each of
+ * them takes the next open query and searches it on its own (single-threaded faiss).
+ */
+inline double measure_external_qps(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D,
+                                   faiss::idx_t* I, size_t threads)
+{
+    std::atomic<size_t> next_query{0};
+    auto worker = [&]() {
+#ifdef _OPENMP
+        omp_set_num_threads(1);  // only affects the calling thread
+#endif
+        for (size_t q = next_query++; q < nq; q = next_query++)
+            index->search(1, xq + q * index->d, k, D + q * k, I + q * k);
+    };
+
+    StopW timer;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; t++) workers.emplace_back(worker);
+    for (auto& w : workers) w.join();
+    auto duration_us = timer.getElapsedTimeMicro();
+
+    return nq / (std::max<long long>(duration_us, 1) / 1000000.0);
+}
+
+/**
+ * Prints the QPS-vs-threads scaling curve of the current operating point of the index,
+ * for faiss-internal (OpenMP) and external (worker threads) parallelism. The scaling
+ * efficiency is the QPS at T threads divided by T times the single-thread QPS.
+ */
+inline void print_throughput_curve(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D,
+                                   faiss::idx_t* I, size_t max_threads)
+{
+    double omp_base = 0, external_base = 0;
+    for (size_t threads : thread_counts(max_threads))
+    {
+        double omp_qps = measure_omp_qps(index, nq, xq, k, D, I, threads);
+        double external_qps = measure_external_qps(index, nq, xq, k, D, I, threads);
+        if (threads == 1)
+        {
+            omp_base = omp_qps;
+            external_base = external_qps;
+        }
+
+        printf("    threads = %3zu: openmp %9.0f QPS (efficiency %5.1f%%), external %9.0f QPS (efficiency %5.1f%%)\n",
+               threads, omp_qps, 100.0 * omp_qps / (threads * omp_base), external_qps,
+               100.0 * external_qps / (threads * external_base));
+    }
+}
@@ -0,0 +1,513 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#if defined(__AVX2__) || defined(__F16C__)
+  #include <immintrin.h>
+#endif
+
+/*****************************************************
+ * I/O functions for fvecs and ivecs
+ *
+ * Every row of a *vecs file is stored as a 4 byte dimension header followed by the
+ * row values. The files are memory mapped and accessed as a strided view, rows are
+ * only copied (and de-strided) when a contiguous buffer is actually needed.
+ *
+ * Besides fp32 (.fvecs) and int32 (.ivecs) the base and query vectors can be stored
+ * with uint8 (.bvecs), IEEE half (.fp16vecs) or bfloat16 (.bf16vecs) values. Their rows
+ * are converted to float when they are copied out of the mapping, chunk by chunk, so
+ * no fp32 copy of the whole file is ever needed.
+ *****************************************************/
+
+// IEEE 754 half precision value
+struct float16
+{
+    uint16_t bits;
+
+    static float16 from_float(float f)
+    {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        const uint16_t sign = uint16_t((x >> 16) & 0x8000);
+        const int32_t exponent = int32_t((x >> 23) & 0xff) - 127 + 15;
+        uint32_t mantissa = x & 0x7fffff;
+
+        if (((x >> 23) & 0xff) == 0xff) return { uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0)) };  // inf, nan
+        if (exponent >= 31) return { uint16_t(sign | 0x7c00) };  // overflow
+        if (exponent <= 0)
+        {
+            // subnormal, round to nearest even
+            if (exponent < -10) return { sign };
+            mantissa |= 0x800000;
+            const uint32_t shift = uint32_t(14 - exponent);
+            uint32_t h = mantissa >> shift;
+            const uint32_t rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+            if (rest > halfway || (rest == halfway && (h & 1))) h++;
+            return { uint16_t(sign | h) };
+        }
+        uint32_t h = (uint32_t(exponent) << 10) | (mantissa >> 13);
+        const uint32_t rest = mantissa & 0x1fff;
+        if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;  // a carry into the exponent is correct
+        return { uint16_t(sign | h) };
+    }
+
+    operator float() const
+    {
+        const uint32_t sign = uint32_t(bits & 0x8000) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1f;
+        uint32_t mantissa = bits & 0x3ff;
+        uint32_t x;
+        if (exponent == 0)
+        {
+            if (mantissa == 0)
+            {
+                x = sign;
+            }
+            else
+            {
+                // subnormal, normalize
+                exponent = 127 - 15 + 1;
+                while (!(mantissa & 0x400)) { mantissa <<= 1; exponent--; }
+                x = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+            }
+        }
+        else if (exponent == 31)
+        {
+            x = sign | 0x7f800000 | (mantissa << 13);
+        }
+        else
+        {
+            x = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+        }
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+};
+
+// bfloat16 value, the upper half of a float
+struct bfloat16
+{
+    uint16_t bits;
+
+    static bfloat16 from_float(float f)
+    {
+        uint32_t x;
+        std::memcpy(&x, &f, sizeof(x));
+        if ((x & 0x7fffffff) > 0x7f800000) return { uint16_t((x >> 16) | 0x40) };  // keep nan a nan
+        return { uint16_t((x + 0x7fff + ((x >> 16) & 1)) >> 16) };                // round to nearest even
+    }
+
+    operator float() const
+    {
+        uint32_t x = uint32_t(bits) << 16;
+        float f;
+        std::memcpy(&f, &x, sizeof(f));
+        return f;
+    }
+};
+
+/**
+ * Converts n values, the overloads for the reduced precision types convert 8 values at
+ * a time with AVX2 / F16C.
+ */
+template<typename S, typename D>
+inline void convert_values(const S* src, size_t n, D* out)
+{
+    if constexpr (std::is_same_v<S, D>)
+        std::copy(src, src + n, out);
+    else if constexpr (std::is_same_v<D, float16> || std::is_same_v<D, bfloat16>)
+        for (size_t i = 0; i < n; i++) out[i] = D::from_float(float(src[i]));
+    else if constexpr (std::is_same_v<D, uint8_t> && std::is_floating_point_v<S>)
+        for (size_t i = 0; i < n; i++) out[i] = uint8_t(std::clamp(src[i] + S(0.5), S(0), S(255)));
+    else
+        std::copy(src, src + n, out);
+}
+
+inline void convert_values(const float16* src, size_t n, float* out)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+#endif
+    for (; i < n; i++) out[i] = float(src[i]);
+}
+
+inline void convert_values(const bfloat16* src, size_t n, float* out)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i x = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(out + i, _mm256_castsi256_ps(_mm256_slli_epi32(x, 16)));
+    }
+#endif
+    for (; i < n; i++) out[i] = float(src[i]);
+}
+
+inline void convert_values(const uint8_t* src, size_t n, float* out)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i x = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + i)));
+        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(x));
+    }
+#endif
+    for (; i < n; i++) out[i] = float(src[i]);
+}
+
+/**
+ * Read-only memory mapping of a whole file.
+ */
+class MappedFile
+{
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+
+#if defined(_WIN32)
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = NULL;
+#endif
+
+public:
+    explicit MappedFile(const char* fname)
+    {
+        std::error_code ec{};
+        size_ = std::filesystem::file_size(fname, ec);
+        if (ec != std::error_code{})
+        {
+            std::cerr << "error when accessing file " << fname << ", size is: " << size_ << " message: " << ec.message() << std::endl;
+            perror("");
+            abort();
+        }
+        if (size_ == 0)
+            return;
+
+#if defined(_WIN32)
+        file_ = CreateFileA(fname, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file_ == INVALID_HANDLE_VALUE)
+        {
+            std::cerr << "could not open " << fname << std::endl;
+            abort();
+        }
+        mapping_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping_ == NULL)
+        {
+            std::cerr << "could not map " << fname << std::endl;
+            abort();
+        }
+        data_ = reinterpret_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+        if (data_ == nullptr)
+        {
+            std::cerr << "could not map " << fname << std::endl;
+            abort();
+        }
+#else
+        int fd = open(fname, O_RDONLY);
+        if (fd == -1)
+        {
+            std::cerr << "could not open " << fname << std::endl;
+            perror("");
+            abort();
+        }
+        void* ptr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED)
+        {
+            std::cerr << "could not map " << fname << std::endl;
+            perror("");
+            abort();
+        }
+        data_ = reinterpret_cast<const uint8_t*>(ptr);
+        madvise(ptr, size_, MADV_SEQUENTIAL);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined(_WIN32)
+        if (data_ != nullptr) UnmapViewOfFile(data_);
+        if (mapping_ != NULL) CloseHandle(mapping_);
+        if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+        if (data_ != nullptr) munmap(const_cast<uint8_t*>(data_), size_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    /**
+     * Drop the pages of the byte range [offset, offset+length) from the resident set.
+     * The data stays in the page cache and is faulted in again on the next access.
+     */
+    void release(size_t offset, size_t length) const
+    {
+#if !defined(_WIN32)
+        static const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t begin = (offset + page_size - 1) / page_size * page_size;  // only whole pages
+        size_t end = std::min(offset + length, size_) / page_size * page_size;
+        if (end > begin) madvise(const_cast<uint8_t*>(data_) + begin, end - begin, MADV_DONTNEED);
+#endif
+    }
+};
+
+/**
+ * Strided view of the rows of a memory mapped *vecs file with element type T.
+ */
+template<typename T>
+class VecsView
+{
+    MappedFile file_;
+    size_t dims_ = 0;
+    size_t n_ = 0;
+    size_t stride_ = 0;  // bytes per row including the header
+
+public:
+    explicit VecsView(const char* fname) : file_(fname)
+    {
+        if (file_.size() < sizeof(int))
+        {
+            std::cerr << "file " << fname << " is too small to be a vecs file" << std::endl;
+            abort();
+        }
+
+        int dims = *reinterpret_cast<const int*>(file_.data());
+        assert((dims > 0 && dims < 1000000) || !"unreasonable dimension");
+        dims_ = (size_t)dims;
+        stride_ = sizeof(int) + dims_ * sizeof(T);
+        assert(file_.size() % stride_ == 0 || !"weird file size");
+        n_ = file_.size() / stride_;
+    }
+
+    size_t dims() const { return dims_; }
+    size_t size() const { return n_; }
+
+    // pointer to the values of row i inside the mapping
+    const T* row(size_t i) const
+    {
+        return reinterpret_cast<const T*>(file_.data() + i * stride_ + sizeof(int));
+    }
+
+    // number of rows which fit into a buffer of the given size
+    size_t rows_per_chunk(size_t chunk_bytes = size_t(64) << 20) const
+    {
+        return std::max<size_t>(1, chunk_bytes / (dims_ * sizeof(T)));
+    }
+
+    // copy the rows [first, first+count) without headers into out, converting them to U
+    template<typename U>
+    void copy_rows(size_t first, size_t count, U* out) const
+    {
+        assert(first + count <= n_ || !"row range out of bounds");
+        for (size_t i = 0; i < count; i++)
+            convert_values(row(first + i), dims_, out + i * dims_);
+    }
+
+    // remove the rows [first, first+count) from the resident set
+    void release_rows(size_t first, size_t count) const
+    {
+        file_.release(first * stride_, count * stride_);
+    }
+
+    /**
+     * Calls fn(first, count, rows) for consecutive chunks of at most chunk_size rows of
+     * the row range [begin, end), rows being a contiguous buffer of count * dims() values.
+     * Already visited rows are released from the resident set if release_pages is set.
+     */
+    template<typename Fn>
+    void for_each_chunk(size_t begin, size_t end, size_t chunk_size, Fn&& fn, bool release_pages = true) const
+    {
+        assert((begin <= end && end <= n_) || !"row range out of bounds");
+        std::vector<T> buffer(std::min(chunk_size, end - begin) * dims_);
+        for (size_t first = begin; first < end; first += chunk_size)
+        {
+            size_t count = std::min(chunk_size, end - first);
+            copy_rows(first, count, buffer.data());
+            fn(first, count, (const T*)buffer.data());
+            if (release_pages) release_rows(first, count);
+        }
+    }
+
+    template<typename Fn>
+    void for_each_chunk(size_t chunk_size, Fn&& fn, bool release_pages = true) const
+    {
+        for_each_chunk(0, n_, chunk_size, std::forward<Fn>(fn), release_pages);
+    }
+
+    // contiguous copy of all rows, has to be freed with delete[]
+    template<typename U = T>
+    U* read_all() const
+    {
+        U* x = new U[n_ * dims_];
+        copy_rows(0, n_, x);
+        release_rows(0, n_);
+        return x;
+    }
+};
+
+using FVecsView = VecsView<float>;
+using IVecsView = VecsView<int>;
+using BVecsView = VecsView<uint8_t>;
+using Fp16VecsView = VecsView<float16>;
+using Bf16VecsView = VecsView<bfloat16>;
+
+// element type of a vector file, by its extension
+enum class VecsType { fp32, uint8, fp16, bf16 };
+
+inline VecsType vecs_type(const std::string& fname)
+{
+    auto ext = std::filesystem::path(fname).extension().string();
+    if (ext == ".bvecs") return VecsType::uint8;
+    if (ext == ".fp16vecs") return VecsType::fp16;
+    if (ext == ".bf16vecs") return VecsType::bf16;
+    return VecsType::fp32;
+}
+
+inline const char* vecs_type_name(VecsType type)
+{
+    switch (type)
+    {
+        case VecsType::uint8: return "uint8";
+        case VecsType::fp16:  return "fp16";
+        case VecsType::bf16:  return "bf16";
+        default:              return "fp32";
+    }
+}
+
+inline size_t vecs_value_size(VecsType type)
+{
+    return type == VecsType::uint8 ? 1 : type == VecsType::fp32 ? 4 : 2;
+}
+
+/**
+ * Maps a vector file of any element type and returns fn(view), the view being a
+ * VecsView of the element type given by the extension of the file.
+ */
+template<typename Fn>
+decltype(auto) with_vecs_view(const char* fname, Fn&& fn)
+{
+    switch (vecs_type(fname))
+    {
+        case VecsType::uint8: { BVecsView view(fname); return fn(view); }
+        case VecsType::fp16:  { Fp16VecsView view(fname); return fn(view); }
+        case VecsType::bf16:  { Bf16VecsView view(fname); return fn(view); }
+        default:              { FVecsView view(fname); return fn(view); }
+    }
+}
+
+// dimension and number of vectors of a vector file of any element type
+inline std::pair<size_t, size_t> vecs_shape(const char* fname)
+{
+    return with_vecs_view(fname, [](const auto& view) { return std::make_pair(view.dims(), view.size()); });
+}
+
+// all vectors of a vector file of any element type as floats, has to be freed with delete[]
+inline float* vecs_read(const char* fname, size_t* d_out, size_t* n_out)
+{
+    return with_vecs_view(fname, [&](const auto& view) {
+        *d_out = view.dims();
+        *n_out = view.size();
+        return view.template read_all<float>();
+    });
+}
+
+inline float* fvecs_read(const char* fname, size_t* d_out, size_t* n_out)
+{
+    FVecsView view(fname);
+    *d_out = view.dims();
+    *n_out = view.size();
+    return view.read_all();
+}
+
+inline int* ivecs_read(const char* fname, size_t* d_out, size_t* n_out)
+{
+    IVecsView view(fname);
+    *d_out = view.dims();
+    *n_out = view.size();
+    return view.read_all();
+}
+
+inline void ivecs_write(const char* fname, int d, int n, const int* v)
+{
+    auto ofstream = std::ofstream(fname, std::ios::binary);
+    if (!ofstream.is_open())
+    {
+        std::cerr << "could not open " << fname << std::endl;
+        perror("");
+        abort();
+    }
+
+    for (size_t i = 0; i < (size_t)n; i++)
+    {
+        ofstream.write(reinterpret_cast<char*>(&d), sizeof(int));
+        ofstream.write(reinterpret_cast<const char*>(v), d * sizeof(int));
+        v += d;
+    }
+
+    ofstream.close();
+}
+
+/**
+ * Writes float vectors to a vecs file with element type T, appended in batches. Used to
+ * create the reduced precision copies of fp32 files.
+ */
+template<typename T>
+class VecsWriter
+{
+    std::ofstream out_;
+    int d_;
+    std::vector<T> row_;
+
+public:
+    VecsWriter(const char* fname, size_t d) : out_(fname, std::ios::binary), d_((int)d), row_(d)
+    {
+        if (!out_.is_open())
+        {
+            std::cerr << "could not open " << fname << std::endl;
+            perror("");
+            abort();
+        }
+    }
+
+    void append(size_t n, const float* x)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            convert_values(x + i * d_, d_, row_.data());
+            out_.write(reinterpret_cast<const char*>(&d_), sizeof(int));
+            out_.write(reinterpret_cast<const char*>(row_.data()), d_ * sizeof(T));
+        }
+    }
+};
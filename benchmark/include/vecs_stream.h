@@ -0,0 +1,134 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "vecs_io.h"
+
+/**
+ * Streams the rows [begin, end) of a vecs file in chunks of chunk_size rows and calls
+ * fn(first, count, rows) for each of them in order. A reader thread de-strides the next
+ * chunk from the mapping into one of two buffers while fn processes the other one, so
+ * disk reads overlap with the work done in fn. Rows are released from the resident set
+ * once they have been copied, peak memory stays at two chunks. The rows are converted
+ * to U by the reader thread, e.g. stream_chunks<float16, float> for fp16 files.
+ */
+template<typename T, typename U = T, typename Fn>
+void stream_chunks(const VecsView<T>& view, size_t begin, size_t end, size_t chunk_size, Fn&& fn)
+{
+    struct Slot
+    {
+        std::vector<U> rows;
+        size_t first = 0;
+        size_t count = 0;
+        bool full = false;
+    };
+
+    const size_t chunk_count = (end - begin + chunk_size - 1) / chunk_size;
+    Slot slots[2];
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+
+    std::thread reader([&]() {
+        for (size_t c = 0; c < chunk_count; c++)
+        {
+            auto& slot = slots[c % 2];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return !slot.full || stop; });
+                if (stop) return;
+            }
+
+            slot.first = begin + c * chunk_size;
+            slot.count = std::min(chunk_size, end - slot.first);
+            slot.rows.resize(slot.count * view.dims());
+            view.copy_rows(slot.first, slot.count, slot.rows.data());
+            view.release_rows(slot.first, slot.count);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.full = true;
+            }
+            cv.notify_all();
+        }
+    });
+
+    try
+    {
+        for (size_t c = 0; c < chunk_count; c++)
+        {
+            auto& slot = slots[c % 2];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return slot.full; });
+            }
+
+            fn(slot.first, slot.count, (const U*)slot.rows.data());
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.full = false;
+            }
+            cv.notify_all();
+        }
+    }
+    catch (...)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+        reader.join();
+        throw;
+    }
+    reader.join();
+}
+
+template<typename T, typename U = T, typename Fn>
+void stream_chunks(const VecsView<T>& view, size_t chunk_size, Fn&& fn)
+{
+    stream_chunks<T, U>(view, 0, view.size(), chunk_size, std::forward<Fn>(fn));
+}
+
+/**
+ * Uniform random sample of sample_size rows of the range [begin, end) without replacement.
+ * The rows are selected in increasing order (selection sampling), hence only the pages of
+ * the sampled rows are touched and they are read front to back. The rows are converted to U.
+ */
+template<typename T, typename U = T>
+std::vector<U> sample_rows(const VecsView<T>& view, size_t begin, size_t end, size_t sample_size, uint64_t seed = 1234)
+{
+    sample_size = std::min(sample_size, end - begin);
+
+    std::vector<U> sample(sample_size * view.dims());
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+
+    size_t selected = 0;
+    for (size_t i = begin; i < end && selected < sample_size; i++)
+    {
+        size_t remaining = end - i;
+        if (uniform(rng) * remaining < sample_size - selected)
+        {
+            view.copy_rows(i, 1, sample.data() + selected * view.dims());
+            selected++;
+        }
+    }
+    view.release_rows(begin, end - begin);
+    return sample;
+}
+
+template<typename T, typename U = T>
+std::vector<U> sample_rows(const VecsView<T>& view, size_t sample_size, uint64_t seed = 1234)
+{
+    return sample_rows<T, U>(view, 0, view.size(), sample_size, seed);
+}
@@ -1,109 +1,309 @@
-#include <filesystem>
+/**
+ * Config driven benchmark driver. Runs every index factory string of the configuration
+ * with its search parameter grid against every dataset of the manifest in one process.
+ *
+ *   faiss_benchmark ../benchmark/config/datasets.ini ../benchmark/config/ivf_sweep.ini
+ *
+ * Base, query and ground truth data of a dataset is loaded once and reused for all
+ * index types. See benchmark/config for the format of the configuration files.
+ */
+
+#include <algorithm>
 #include <iostream>
-#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
 #include <vector>
-#include <unordered_set>
+
+#ifdef _OPENMP
 #include <omp.h>
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
 
-#include <faiss/index.h>
 #include <faiss/AutoTune.h>
-#include <faiss/index_io.h>
-#include <faiss/index_factory.h>
+#include <faiss/Index.h>
 
+#include "benchmark_config.h"
 #include "config.h"
-#include "example_lib.h"
-
-void load_data(const char* filename, float*& data, unsigned& num, unsigned& dim) {
-  std::ifstream in(filename, std::ios::binary);
-  if(!in.is_open()){std::cout<<"open file error"<<std::endl;exit(-1);}
-  in.read((char*)&dim,4);
-  in.seekg(0,std::ios::end);
-  std::ios::pos_type ss = in.tellg();
-  size_t fsize = (size_t)ss;
-  num = (unsigned)(fsize / (dim+1) / 4);
-  data = new float[num * dim * sizeof(float)];
-
-  in.seekg(0,std::ios::beg);
-  for(size_t i = 0; i < num; i++){
-    in.seekg(4,std::ios::cur);
-    in.read((char*)(data+i*dim),dim*4);
-  }
-  in.close();
+#include "index_cache.h"
+#include "latency.h"
+#include "measure.h"
+#include "perf_counters.h"
+#include "recall.h"
+#include "result_buffer.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "throughput.h"
+#include "vecs_io.h"
+
+// base, query and ground truth data of one dataset, shared across all index types
+struct Dataset
+{
+    std::string name;
+    std::string index_dir;
+    std::string base_file;
+    size_t d = 0;
+    size_t nq = 0;
+    std::vector<float> xq;
+    size_t k = 0;                   // nb of results per query in the GT
+    std::unique_ptr<GroundTruthFile> gt;  // mapped .gt or .ivecs file, read in place
+};
+
+static Dataset load_dataset(const ConfigSection& section, StopW& stopwatch)
+{
+    Dataset ds;
+    ds.name = section.name;
+    ds.index_dir = section.require("index_dir");
+    ds.base_file = section.require("base");
+
+    // base and queries can be fvecs, bvecs, fp16vecs or bf16vecs, the base is only
+    // mapped for index builds and the distance ratio
+    ds.d = vecs_shape(ds.base_file.c_str()).first;
+
+    printf("[%lld s] Loading queries\n", stopwatch.getElapsedTimeSeconds());
+    size_t dq;
+    std::unique_ptr<float[]> xq(vecs_read(section.require("query").c_str(), &dq, &ds.nq));
+    assert(ds.d == dq || !"query does not have same dimension as the base data");
+    ds.xq.assign(xq.get(), xq.get() + ds.nq * ds.d);
+
+    printf("[%lld s] Loading ground truth for %zu queries\n", stopwatch.getElapsedTimeSeconds(), ds.nq);
+    ds.gt = std::make_unique<GroundTruthFile>(section.require("groundtruth").c_str());
+    assert(ds.gt->nq() == ds.nq || !"incorrect nb of ground truth entries");
+    ds.k = ds.gt->k();
+
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading %s\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000, ds.name.c_str());
+    return ds;
 }
 
-static std::vector<std::unordered_set<uint32_t>> get_ground_truth(const uint32_t* ground_truth, const size_t ground_truth_size, const uint32_t ground_truth_dims, const size_t k)
+// cartesian product of the search parameter values of an index section
+struct ParameterGrid
 {
-    auto answers = std::vector<std::unordered_set<uint32_t>>(ground_truth_size);
-    answers.reserve(ground_truth_size);
-    for (int i = 0; i < ground_truth_size; i++)
+    std::vector<std::string> names;
+    std::vector<std::vector<double>> values;
+
+    size_t size() const
+    {
+        size_t n = 1;
+        for (const auto& v : values) n *= v.size();
+        return n;
+    }
+
+    // the i-th combination, the first parameter varies slowest
+    std::vector<double> point(size_t i) const
+    {
+        std::vector<double> p(names.size());
+        for (size_t j = names.size(); j-- > 0;)
+        {
+            p[j] = values[j][i % values[j].size()];
+            i /= values[j].size();
+        }
+        return p;
+    }
+
+    std::string describe(const std::vector<double>& p) const
     {
-        auto& gt = answers[i];
-        gt.reserve(k);
-        for (size_t j = 0; j < k; j++) 
-            gt.insert(ground_truth[ground_truth_dims * i + j]);
+        std::string s;
+        for (size_t j = 0; j < names.size(); j++)
+            s += string_format("%s%s=%g", j ? "," : "", names[j].c_str(), p[j]);
+        return s;
     }
+};
 
-    return answers;
+// keys of an index section which are not search parameters
+static bool is_index_setting(const std::string& key)
+{
+    return key == "factory" || key == "train_percentage" || key == "k" || key == "recall_at" ||
+           key == "max_train_points" || key == "kmeans_iterations" || key == "max_points_per_centroid" || key == "coarse_training";
 }
 
-int main() {
-    std::cout << "hello world" << std::endl;
+static ParameterGrid parameter_grid(const ConfigSection& section)
+{
+    ParameterGrid grid;
+    for (const auto& entry : section.entries)
+    {
+        if (is_index_setting(entry.first)) continue;
+        grid.names.push_back(entry.first);
+        grid.values.push_back(section.get_double_list(entry.first));
+    }
+    return grid;
+}
 
-    #if defined(USE_AVX)
-        std::cout << "use AVX2" << std::endl;
-    #elif defined(USE_SSE)
-        std::cout << "use SSE" << std::endl;
-    #else
-        std::cout << "use arch" << std::endl;
-    #endif
+struct RunSettings
+{
+    int threads;
+    int build_threads;  // of training and adding, independent of the search threads
+    size_t build_chunk_size;
+    size_t latency_batch_size;
+    bool throughput_mode;
+    std::vector<size_t> batch_sizes;
+    bool distance_ratio;
+    bool perf_counters;
+    ResultsStore store;  // JSON Lines file every operating point is appended to
+    TimingSettings timing;
+};
 
-    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+static void run_index(const Dataset& ds, const ConfigSection& section, const RunSettings& run, StopW& stopwatch)
+{
+    const auto index_type = section.get("factory", section.name);
+    const float train_percentage = (float)section.get_double("train_percentage", 10);
+    const size_t target_k = section.get_size("k", 100);
+    const size_t k_recall_at = section.get_size("recall_at", target_k);
+    assert(k_recall_at <= ds.k || !"ground truth does not contain enough neighbors");
 
-    // //SIFT1M
-    const auto repository_file =        (data_path / "SIFT1M/sift_base.fvecs").string();
-    const auto graph_file =             (data_path / "faiss" / "flat.faiss").string();
-    //const auto graph_file =             (data_path / "faiss" / "IVFPQ.faiss").string();
+    // load the cached index from the index directory, or build and cache it
+    BuildStats build_stats;
+    std::unique_ptr<faiss::Index> index(load_or_build_index(ds.index_dir, ds.base_file, index_type.c_str(), train_percentage, run.build_chunk_size, stopwatch,
+                                                            build_settings(section, run.build_threads), &build_stats));
+    printf("[%lld s] %s trained in %.1f s on %zu vectors (%.1f s per million) with %d threads\n", stopwatch.getElapsedTimeSeconds(), index_type.c_str(),
+           build_stats.train_s, build_stats.train_points, build_stats.train_s_per_million(), build_stats.threads);
+    assert(size_t(index->d) == ds.d || !"index does not have same dimension as the dataset");
 
-    // database features 
-    std::cout << "Load basedata and graph" << std::endl;
-    float* data_load = NULL;
-    unsigned points_num, dim;
-    load_data(repository_file.c_str(), data_load, points_num, dim);
-    std::cout << "points_num: " << points_num << ", dim: " << dim << std::endl;
+    #ifdef _OPENMP
+        omp_set_num_threads(run.threads);
+    #endif
 
+    RecallEvaluator evaluator(*ds.gt);
+    std::unique_ptr<PerfCounters> counters;
+    if (run.perf_counters) counters = std::make_unique<PerfCounters>();
+
+    // setup output buffers, pre-faulted once and reused by all configurations
+    ResultBuffer results(ds.nq, target_k);
+    faiss::idx_t* I = results.I();
+    float* D = results.D();
+
+    printf("[%lld s] Start testing %s on %s\n", stopwatch.getElapsedTimeSeconds(), index_type.c_str(), ds.name.c_str());
+    auto grid = parameter_grid(section);
+    for (size_t c = 0; c < grid.size(); c++)
+    {
+        auto point = grid.point(c);
+        for (size_t j = 0; j < grid.names.size(); j++)
+            faiss::ParameterSpace().set_index_parameter(index.get(), grid.names[j], point[j]);
 
-    // https://github.com/facebookresearch/faiss/wiki/The-index-factory
-    faiss::Index*  index = faiss::index_factory(dim, "Flat", faiss::METRIC_L2); // IndexFlat
-    //faiss::Index*  index = faiss::index_factory(dim, "PQ16x12", faiss::METRIC_L2); // IndexIVFPQ
-    index->train(points_num, data_load);
-    index->add(points_num, data_load);
+        // search, the results of the last repetition are evaluated
+        auto timing = measure_repeated(run.timing, [&]() { index->search(ds.nq, ds.xq.data(), target_k, D, I); }, counters.get());
+        auto duration_us = (long long)timing.median_us;
+        std::string perf_info = counters ? format_perf_counts(timing.perf, ds.nq * timing.samples_us.size(), timing.total_us) : "";
 
-    // store
-    faiss::write_index(index, graph_file.c_str());
+        // evaluate results
+        float recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+        float mrr = evaluator.mrr(I, target_k, target_k);
+        auto record = search_record("faiss_benchmark", ds.name, index_type, grid.describe(point), target_k, k_recall_at, recall, duration_us, ds.nq);
+        record.set("mrr", mrr)
+              .set("threads", run.threads)
+              .set("build_threads", build_stats.threads)
+              .set("train_s_per_million", build_stats.train_s_per_million())
+              .set("repetitions", timing.samples_us.size())
+              .set("mad_us_per_query", timing.mad_us / ds.nq)
+              .set("cpu_mhz_min", timing.min_mhz)
+              .set("cpu_mhz_max", timing.max_mhz)
+              .set("frequency_scaling", timing.frequency_scaling());
+        std::string ratio_info;
+        if (run.distance_ratio)
+        {
+            float ratio = with_vecs_view(ds.base_file.c_str(), [&](const auto& xb) {
+                return evaluator.distance_ratio(xb, ds.xq.data(), I, target_k, target_k);
+            });
+            ratio_info = string_format(", distance ratio = %.4f", ratio);
+            record.set("distance_ratio", ratio);
+        }
 
+        // per query latency percentiles, measured in a separate pass
+        std::string latency_info;
+        if (run.latency_batch_size > 0)
+        {
+            LatencyHistogram latency;
+            measure_latency(index.get(), ds.nq, ds.xq.data(), target_k, D, I, run.latency_batch_size, latency);
+            latency_info = ", " + format_percentiles(latency);
+            set_percentiles(record, latency);
+        }
+        printf("%s %s %zuR@%zu = %.4f, MRR = %.4f%s with %6.0f us/query at %s%s%s%s\n", ds.name.c_str(), index_type.c_str(), k_recall_at, target_k, recall, mrr, ratio_info.c_str(), duration_us / float(ds.nq), grid.describe(point).c_str(), format_timing(timing).c_str(), latency_info.c_str(), perf_info.c_str());
+        run.store.append(record);
 
-    std::cout << "Load Query Data" << std::endl;
-    size_t top_k;
-    size_t query_size;
-    auto ground_truth = ivecs_read(path_groundtruth.c_str(), top_k, query_size);
-    auto query_features = fvecs_read(path_query.c_str(), vecdim, query_size);
-    std::cout << "Actual memory usage: " << getCurrentRSS() / 1000000 << " Mb, Max memory usage: " << getPeakRSS() / 1000000 << " Mb after loading query data" << std::endl;
+        if (!run.batch_sizes.empty())
+            print_batch_sweep(index.get(), ds.nq, ds.xq.data(), target_k, D, I, run.batch_sizes);
 
+        if (run.throughput_mode)
+            print_throughput_curve(index.get(), ds.nq, ds.xq.data(), target_k, D, I, std::thread::hardware_concurrency());
+    }
+}
 
-    std::string search_key = parameters.Get<std::string>("pq_search_key");
-    faiss::ParameterSpace f_params;
-    f_params.set_index_parameters(index, search_key.c_str());
+int main(int argc, char** argv) {
 
-    faiss::idx_t *Ids = new faiss::idx_t[k];
-    float *Dists = new float[k];
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(USE_AVX512)
+        std::cout << "use AVX512" << std::endl;
+    #elif defined(USE_AVX)
+        std::cout << "use AVX2" << std::endl;
+    #elif defined(USE_SSE)
+        std::cout << "use SSE" << std::endl;
+    #else
+        std::cout << "use arch" << std::endl;
+    #endif
 
-    index->search(1, query, k, Dists, Ids);
-    for(unsigned i=0; i<k; i++){
-      indices[i] = Ids[i];
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <config.ini> [<config.ini> ...]" << std::endl;
+        return 1;
     }
 
+    BenchmarkConfig config;
+    for (int i = 1; i < argc; i++) config.load(argv[i]);
+
+    const auto& run_section = config.get("run");
+    RunSettings run;
+    run.threads = (int)run_section.get_size("threads", 1);
+    run.build_threads = (int)run_section.get_size("build_threads", 0);  // 0 = all cores
+    if (run.build_threads == 0) run.build_threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    run.build_chunk_size = run_section.get_size("build_chunk_size", 100000);
+    run.latency_batch_size = run_section.get_size("latency_batch_size", 0);
+    run.throughput_mode = run_section.get_bool("throughput", false);
+    for (double batch_size : run_section.get_double_list("batch_sizes"))
+        run.batch_sizes.push_back((size_t)batch_size);
+    run.distance_ratio = run_section.get_bool("distance_ratio", false);
+    run.perf_counters = run_section.get_bool("perf_counters", false);
+    run.store = ResultsStore(run_section.get("results", ""));
+    run.timing.warmup = run_section.get_size("warmup", 1);
+    run.timing.repetitions = run_section.get_size("repetitions", 5);
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        std::cout << "_OPENMP " << run.threads << " search threads, " << run.build_threads << " build threads" << std::endl;
+    #endif
+
+    // the datasets to run, all of the manifest by default
+    std::vector<const ConfigSection*> datasets;
+    if (run_section.has("datasets"))
+    {
+        for (const auto& name : run_section.get_list("datasets"))
+        {
+            auto section = config.find("dataset", name);
+            if (section == nullptr)
+            {
+                std::cerr << "dataset " << name << " is not part of the manifest" << std::endl;
+                return 1;
+            }
+            datasets.push_back(section);
+        }
+    }
+    else
+    {
+        datasets = config.all("dataset");
+    }
 
-    exampleLib::test_print();
+    StopW stopwatch;
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    for (auto dataset_section : datasets)
+    {
+        Dataset ds = load_dataset(*dataset_section, stopwatch);
+        for (auto index_section : config.all("index"))
+            run_index(ds, *index_section, run, stopwatch);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
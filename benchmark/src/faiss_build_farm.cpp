@@ -0,0 +1,216 @@
+/**
+ * Builds the indexes of a benchmark configuration for many datasets at once and stores
+ * them in the index cache, where faiss_benchmark and the other tools pick them up.
+ *
+ *   faiss_build_farm ../benchmark/config/datasets.ini ../benchmark/config/ivf_sweep.ini ../benchmark/config/build_farm.ini
+ *
+ * Every [index] section is built for every dataset of the [farm] section. The peak memory
+ * of each job is estimated up front from the dimension, size and code size. Jobs run
+ * concurrently as long as the sum of their estimates fits into the memory budget and the
+ * sum of their threads into the core budget, large jobs are started first. A job which
+ * throws (a bad factory string, std::bad_alloc) is reported and the others continue, the
+ * exit code is 1 if any job failed.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/Index.h>
+
+#include "benchmark_config.h"
+#include "index_build.h"
+#include "index_cache.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+struct BuildJob
+{
+    std::string dataset;
+    std::string base_file;
+    std::string index_dir;
+    std::string index_type;
+    float train_percentage;
+    BuildSettings settings;  // k-means settings of the index section, threads_per_job threads
+    size_t memory;  // estimated peak memory in bytes
+};
+
+int main(int argc, char** argv) {
+
+    if (argc < 2)
+    {
+        std::cerr << "usage: " << argv[0] << " <config.ini> [<config.ini> ...]" << std::endl;
+        return 1;
+    }
+
+    BenchmarkConfig config;
+    for (int i = 1; i < argc; i++) config.load(argv[i]);
+
+    const auto& farm = config.get("farm");
+    const size_t physical_memory = getPhysicalMemory();
+    const size_t memory_budget = farm.has("memory_budget_gb") ? size_t(farm.get_double("memory_budget_gb", 0) * 1e9) : physical_memory / 10 * 8;
+    const size_t cores = farm.get_size("cores", std::max(1u, std::thread::hardware_concurrency()));
+    const size_t threads_per_job = std::clamp<size_t>(farm.get_size("threads_per_job", 8), 1, cores);
+    const size_t build_chunk_size = farm.get_size("build_chunk_size", 100000);
+
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+    #endif
+
+    // the datasets to build, all of the manifest by default
+    std::vector<const ConfigSection*> datasets;
+    if (farm.has("datasets"))
+    {
+        for (const auto& name : farm.get_list("datasets"))
+        {
+            auto section = config.find("dataset", name);
+            if (section == nullptr)
+            {
+                std::cerr << "dataset " << name << " is not part of the manifest" << std::endl;
+                return 1;
+            }
+            datasets.push_back(section);
+        }
+    }
+    else
+    {
+        datasets = config.all("dataset");
+    }
+
+    StopW stopwatch;
+
+    // one job per dataset and index type
+    std::vector<BuildJob> jobs;
+    std::vector<std::string> failed;
+    for (auto dataset : datasets)
+    {
+        BuildJob job;
+        job.dataset = dataset->name;
+        job.base_file = dataset->require("base");
+        job.index_dir = dataset->require("index_dir");
+        if (!std::filesystem::exists(job.base_file))
+        {
+            std::cerr << "skipping dataset " << job.dataset << ", base file " << job.base_file << " does not exist" << std::endl;
+            continue;
+        }
+
+        auto [d, nb] = vecs_shape(job.base_file.c_str());
+        for (auto index : config.all("index"))
+        {
+            job.index_type = index->get("factory", index->name);
+            job.train_percentage = (float)index->get_double("train_percentage", 10);
+            job.settings = build_settings(*index, (int)threads_per_job);
+            if (std::filesystem::exists(cached_index_file(job.index_dir, job.base_file, job.index_type, job.train_percentage, job.settings)))
+            {
+                printf("[%lld s] %s on %s is already cached\n", stopwatch.getElapsedTimeSeconds(), job.index_type.c_str(), job.dataset.c_str());
+                continue;
+            }
+            try
+            {
+                job.memory = estimate_build_memory(d, nb, job.index_type.c_str(), job.train_percentage, build_chunk_size, job.settings);
+            }
+            catch (const std::exception& e)  // the factory string is parsed here first
+            {
+                printf("[%lld s] Failed %s on %s: %s\n", stopwatch.getElapsedTimeSeconds(), job.index_type.c_str(), job.dataset.c_str(), e.what());
+                failed.push_back(job.index_type + " on " + job.dataset);
+                continue;
+            }
+            jobs.push_back(job);
+        }
+    }
+    const size_t planned_failures = failed.size();
+    std::sort(jobs.begin(), jobs.end(), [](const BuildJob& a, const BuildJob& b) { return a.memory > b.memory; });
+
+    printf("[%lld s] %zu build jobs, memory budget %zu Mb of %zu Mb, %zu cores, %zu threads per job\n", stopwatch.getElapsedTimeSeconds(),
+           jobs.size(), memory_budget / 1000000, physical_memory / 1000000, cores, threads_per_job);
+    for (const auto& job : jobs)
+        printf("    %-16s %-40s ~%8zu Mb\n", job.dataset.c_str(), job.index_type.c_str(), job.memory / 1000000);
+
+    // start the largest job which fits into the remaining budget, a job larger than the whole
+    // budget runs on its own
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t used_memory = 0, used_cores = 0, running = 0;
+    std::vector<std::thread> workers;
+    std::vector<bool> started(jobs.size(), false);
+    for (size_t n = 0; n < jobs.size(); n++)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t next = jobs.size();
+        finished.wait(lock, [&]() {
+            for (size_t j = 0; j < jobs.size(); j++)
+            {
+                if (started[j]) continue;
+                bool fits = used_memory + jobs[j].memory <= memory_budget && used_cores + threads_per_job <= cores;
+                if (fits || running == 0)
+                {
+                    next = j;
+                    return true;
+                }
+            }
+            return false;
+        });
+
+        const auto& job = jobs[next];
+        started[next] = true;
+        used_memory += job.memory;
+        used_cores += threads_per_job;
+        running++;
+        printf("[%lld s] Starting %s on %s (~%zu Mb, %zu jobs running, %zu Mb reserved)\n", stopwatch.getElapsedTimeSeconds(),
+               job.index_type.c_str(), job.dataset.c_str(), job.memory / 1000000, running, used_memory / 1000000);
+
+        workers.emplace_back([&, next]() {
+            const auto& job = jobs[next];
+            StopW timer;  // the build sets threads_per_job OpenMP threads, only affects this worker
+            std::string error;  // a failed build (bad factory string, out of memory) does not stop the other jobs
+            try
+            {
+                delete load_or_build_index(job.index_dir, job.base_file, job.index_type.c_str(), job.train_percentage, build_chunk_size, stopwatch, job.settings);
+            }
+            catch (const std::exception& e)
+            {
+                error = e.what();
+            }
+
+            std::lock_guard<std::mutex> guard(mutex);
+            if (error.empty())
+            {
+                printf("[%lld s] Finished %s on %s in %lld s, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(),
+                       job.index_type.c_str(), job.dataset.c_str(), timer.getElapsedTimeSeconds(), getPeakRSS() / 1000000);
+            }
+            else
+            {
+                printf("[%lld s] Failed %s on %s after %lld s: %s\n", stopwatch.getElapsedTimeSeconds(),
+                       job.index_type.c_str(), job.dataset.c_str(), timer.getElapsedTimeSeconds(), error.c_str());
+                failed.push_back(job.index_type + " on " + job.dataset);
+            }
+            used_memory -= job.memory;
+            used_cores -= threads_per_job;
+            running--;
+            finished.notify_all();
+        });
+    }
+    for (auto& w : workers) w.join();
+
+    if (!failed.empty())
+    {
+        printf("[%lld s] %zu of %zu builds failed:\n", stopwatch.getElapsedTimeSeconds(), failed.size(), jobs.size() + planned_failures);
+        for (const auto& f : failed) printf("    %s\n", f.c_str());
+        return 1;
+    }
+    printf("[%lld s] All %zu indexes are cached\n", stopwatch.getElapsedTimeSeconds(), jobs.size());
+    return 0;
+}
@@ -0,0 +1,176 @@
+/**
+ * Build cost profile of the index types of faiss_index.cpp on SIFT1M. Every factory
+ * string is built from scratch (the index cache is bypassed) with all cores, while a
+ * background thread samples the resident set size every few milliseconds. Reported per
+ * index type are
+ *
+ *  - the train and add time in microseconds, and the training time per million vectors
+ *  - the add throughput in vectors/s of every chunk, as minimum, median and maximum
+ *  - the peak RSS of the train and of the add phase above the RSS before the build
+ *  - the bytes per vector of the serialized index and of the RSS growth of the build
+ *
+ * One JSON record per index type goes to the results file, the RSS timeline of all
+ * builds, labeled with their phase, to a second JSON Lines file.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/Index.h>
+
+#include "build_profile.h"
+#include "index_build.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+// profile of one build
+struct ProfileRow
+{
+    std::string index_type;
+    BuildStats stats;
+    ChunkThroughput throughput;
+    size_t rss_before = 0;
+    size_t peak_train = 0;
+    size_t peak_add = 0;
+    size_t rss_after = 0;
+    size_t index_bytes = 0;
+};
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+    #endif
+
+    // SIFT1M
+    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+    const auto repository_file = (data_path / "SIFT1M" / "sift_base.fvecs").string();
+    const auto results_file    = (data_path / "results" / "faiss_build_profile.jsonl").string();      // JSON Lines results, empty disables them
+    const auto timeline_file   = (data_path / "results" / "faiss_build_profile_rss.jsonl").string();  // RSS samples of all builds
+
+    // the index types of faiss_index.cpp
+    const std::vector<const char*> index_types = {
+        "IVF4096,Flat",
+        "IVF1024,Flat",
+        "Flat",
+        "PQ32",
+        "PCA80,Flat",
+        "IVF4096,PQ8+16",
+        "IVF4096,PQ32",
+        "IMI2x8,PQ32",
+        "IMI2x8,PQ8+16",
+        "OPQ16_64,IMI2x8,PQ8+16",
+        "IVF1024,SQ8",
+        "IVF1024,PQ64x4fs,Refine(SQfp16)",
+    };
+
+    const float train_percentage = 10;
+    const size_t build_chunk_size = 100000;
+    const unsigned rss_interval_ms = 20;
+
+    BuildSettings build_settings;
+    build_settings.threads = (int)std::max(1u, std::thread::hardware_concurrency());
+
+    StopW stopwatch;
+    FVecsView xb(repository_file.c_str());
+    const size_t nb = xb.size();
+    ResultsStore store(results_file);
+    ResultsStore timeline(timeline_file);
+    printf("[%lld s] Profiling %zu index types on %zu*%zu vectors with %d threads\n", stopwatch.getElapsedTimeSeconds(),
+           index_types.size(), nb, xb.dims(), build_settings.threads);
+
+    std::vector<ProfileRow> rows;
+    for (const char* index_type : index_types)
+    {
+        ProfileRow row;
+        row.index_type = index_type;
+
+        RssSampler sampler(rss_interval_ms);
+        BuildSettings settings = build_settings;
+        settings.on_phase = [&](const char* phase) { sampler.mark(phase); };
+        std::unique_ptr<faiss::Index> index(build_index(xb, index_type, train_percentage, build_chunk_size, stopwatch, settings, &row.stats));
+        sampler.stop();
+
+        row.throughput = chunk_throughput(row.stats.chunks);
+        row.rss_before = sampler.first();
+        row.rss_after = sampler.last();
+        for (size_t p = 0; p < sampler.phases().size(); p++)
+        {
+            if (sampler.phases()[p] == "train") row.peak_train = sampler.peak(p);
+            if (sampler.phases()[p] == "add") row.peak_add = sampler.peak(p);
+        }
+        row.index_bytes = serialized_index_bytes(index.get());
+        index.reset();
+
+        const size_t growth = row.rss_after > row.rss_before ? row.rss_after - row.rss_before : 0;
+        printf("[%lld s] %s: train %.0f us, add %.0f us, %.0f vectors/s median, %.1f bytes/vector, %zu RSS samples\n", stopwatch.getElapsedTimeSeconds(),
+               index_type, row.stats.train_s * 1e6, row.stats.add_s * 1e6, row.throughput.median, double(row.index_bytes) / nb, sampler.samples().size());
+
+        ResultRecord record;
+        record.set("benchmark", "faiss_build_profile")
+              .set("dataset", "sift1m")
+              .set("factory", index_type)
+              .set("nb", nb)
+              .set("threads", row.stats.threads)
+              .set("train_points", row.stats.train_points)
+              .set("train_us", (long long)(row.stats.train_s * 1e6))
+              .set("add_us", (long long)(row.stats.add_s * 1e6))
+              .set("train_s_per_million", row.stats.train_s_per_million())
+              .set("chunks", row.stats.chunks.size())
+              .set("add_vectors_per_s_min", row.throughput.min)
+              .set("add_vectors_per_s_median", row.throughput.median)
+              .set("add_vectors_per_s_max", row.throughput.max)
+              .set("rss_before_mb", row.rss_before / 1000000)
+              .set("peak_train_mb", row.peak_train / 1000000)
+              .set("peak_add_mb", row.peak_add / 1000000)
+              .set("rss_after_mb", row.rss_after / 1000000)
+              .set("index_bytes", row.index_bytes)
+              .set("bytes_per_vector", double(row.index_bytes) / nb)
+              .set("rss_bytes_per_vector", double(growth) / nb)
+              .set("cpu_model", cpu_model())
+              .set("git_sha", FAISSBENCH_GIT_SHA)
+              .set("timestamp", utc_timestamp());
+        store.append(record);
+
+        for (const auto& sample : sampler.samples())
+        {
+            ResultRecord point;
+            point.set("factory", index_type)
+                 .set("phase", sampler.phases()[sample.phase])
+                 .set("ms", sample.us / 1000.0)
+                 .set("rss_mb", sample.rss / 1e6);
+            timeline.append(point);
+        }
+        rows.push_back(row);
+    }
+
+    // peaks are relative to the RSS before the build, the base vectors are memory mapped
+    printf("\n%-32s %10s %10s %10s %12s %12s %12s %10s %10s %10s\n", "index", "train ms", "s/M train", "add ms", "min vec/s", "median vec/s", "max vec/s",
+           "train +MB", "add +MB", "bytes/vec");
+    for (const auto& row : rows)
+    {
+        auto above = [&](size_t rss) { return rss > row.rss_before ? (rss - row.rss_before) / 1e6 : 0.0; };
+        printf("%-32s %10.1f %10.2f %10.1f %12.0f %12.0f %12.0f %10.1f %10.1f %10.1f\n", row.index_type.c_str(), row.stats.train_s * 1e3, row.stats.train_s_per_million(),
+               row.stats.add_s * 1e3, row.throughput.min, row.throughput.median, row.throughput.max, above(row.peak_train), above(row.peak_add), double(row.index_bytes) / nb);
+    }
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    return 0;
+}
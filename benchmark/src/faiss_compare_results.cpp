@@ -0,0 +1,125 @@
+/**
+ * Compares the results of two benchmark runs, e.g. before and after a faiss upgrade in
+ * vcpkg.json, and reports the operating points whose throughput or recall regressed.
+ *
+ *   faiss_compare_results baseline.jsonl current.jsonl [max QPS drop in %] [max recall drop]
+ *
+ * Records are matched by benchmark, dataset, factory string, search parameters, k,
+ * recall_at, threads and batch_size, a field missing in both records matches. If a file
+ * contains several records of an operating point (repeated runs) the best QPS and recall
+ * of them are compared, which suppresses most run to run noise.
+ * A QPS drop of more than 5% or a recall drop of more than 0.005 counts as a regression
+ * by default. Returns 1 if any operating point regressed, 0 otherwise.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include "results_store.h"
+
+struct OperatingPoint
+{
+    double qps = 0;
+    double recall = 0;
+    std::set<std::string> faiss_versions;
+    std::set<std::string> cpu_models;
+};
+
+static std::string record_key(const std::map<std::string, std::string>& record)
+{
+    std::string key;
+    for (const char* field : { "benchmark", "dataset", "factory", "params", "k", "recall_at", "threads", "batch_size" })
+    {
+        auto it = record.find(field);
+        key += (key.empty() ? "" : " ") + (it != record.end() ? it->second : "-");
+    }
+    return key;
+}
+
+static std::map<std::string, OperatingPoint> operating_points(const std::string& fname)
+{
+    std::map<std::string, OperatingPoint> points;
+    for (const auto& record : read_records(fname))
+    {
+        auto qps = record.find("qps");
+        auto recall = record.find("recall");
+        if (qps == record.end() || recall == record.end()) continue;
+
+        auto& point = points[record_key(record)];
+        point.qps = std::max(point.qps, atof(qps->second.c_str()));
+        point.recall = std::max(point.recall, atof(recall->second.c_str()));
+        if (record.count("faiss_version")) point.faiss_versions.insert(record.at("faiss_version"));
+        if (record.count("cpu_model")) point.cpu_models.insert(record.at("cpu_model"));
+    }
+    return points;
+}
+
+static std::string join(const std::set<std::string>& values)
+{
+    std::string s;
+    for (const auto& v : values) s += (s.empty() ? "" : ", ") + v;
+    return s.empty() ? "unknown" : s;
+}
+
+int main(int argc, char** argv) {
+
+    if (argc < 3)
+    {
+        std::cerr << "usage: " << argv[0] << " <baseline.jsonl> <current.jsonl> [max QPS drop in %] [max recall drop]" << std::endl;
+        return 2;
+    }
+    const double max_qps_drop = argc > 3 ? atof(argv[3]) : 5.0;
+    const double max_recall_drop = argc > 4 ? atof(argv[4]) : 0.005;
+
+    const auto baseline = operating_points(argv[1]);
+    const auto current = operating_points(argv[2]);
+
+    std::set<std::string> baseline_versions, current_versions, baseline_cpus, current_cpus;
+    for (const auto& [key, point] : baseline)
+    {
+        baseline_versions.insert(point.faiss_versions.begin(), point.faiss_versions.end());
+        baseline_cpus.insert(point.cpu_models.begin(), point.cpu_models.end());
+    }
+    for (const auto& [key, point] : current)
+    {
+        current_versions.insert(point.faiss_versions.begin(), point.faiss_versions.end());
+        current_cpus.insert(point.cpu_models.begin(), point.cpu_models.end());
+    }
+    printf("baseline: %zu operating points, faiss %s on %s\n", baseline.size(), join(baseline_versions).c_str(), join(baseline_cpus).c_str());
+    printf("current:  %zu operating points, faiss %s on %s\n", current.size(), join(current_versions).c_str(), join(current_cpus).c_str());
+    if (baseline_cpus != current_cpus)
+        printf("warning: the runs were measured on different CPUs, throughput is not comparable\n");
+    printf("regression thresholds: QPS drop > %.1f%%, recall drop > %.4f\n\n", max_qps_drop, max_recall_drop);
+
+    size_t regressions = 0, missing = 0;
+    for (const auto& [key, base] : baseline)
+    {
+        auto it = current.find(key);
+        if (it == current.end())
+        {
+            printf("MISSING     %s\n", key.c_str());
+            missing++;
+            continue;
+        }
+
+        const auto& cur = it->second;
+        double qps_change = base.qps > 0 ? 100.0 * (cur.qps / base.qps - 1) : 0.0;
+        double recall_change = cur.recall - base.recall;
+        bool regressed = qps_change < -max_qps_drop || recall_change < -max_recall_drop;
+        if (regressed) regressions++;
+        printf("%-11s %s: %9.0f -> %9.0f QPS (%+6.1f%%), recall %.4f -> %.4f (%+.4f)\n", regressed ? "REGRESSION" : "ok",
+               key.c_str(), base.qps, cur.qps, qps_change, base.recall, cur.recall, recall_change);
+    }
+    for (const auto& [key, point] : current)
+        if (baseline.count(key) == 0) printf("NEW         %s: %9.0f QPS, recall %.4f\n", key.c_str(), point.qps, point.recall);
+
+    printf("\n%zu of %zu operating points regressed, %zu missing in the current results\n", regressions, baseline.size(), missing);
+    return regressions > 0 ? 1 : 0;
+}
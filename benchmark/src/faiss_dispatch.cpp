@@ -0,0 +1,208 @@
+/**
+ * Starts the ISA variant of a benchmark which fits the CPU best, see FAISSBENCH_ISA_VARIANTS.
+ *
+ *   faiss_dispatch faiss_benchmark datasets.ini ivf_sweep.ini
+ *
+ * picks faiss_benchmark_avx512, faiss_benchmark_avx2 or faiss_benchmark_generic from the
+ * directory of the dispatcher, depending on the CPUID feature flags. With --compare all
+ * variants supported by the CPU are run one after the other and their search times are
+ * compared on the same hardware:
+ *
+ *   faiss_dispatch --compare faiss_ivfpq_index
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+  #include <intrin.h>
+  #include <immintrin.h>
+  #define popen _popen
+  #define pclose _pclose
+#endif
+
+#if !defined(_WIN32)
+  #include <sys/wait.h>
+#endif
+
+// variants from best to worst
+static const std::vector<std::string> isa_levels = { "avx512", "avx2", "generic" };
+
+// whether the CPU and the OS support the instructions of an ISA level
+static bool cpu_supports(const std::string& isa)
+{
+    if (isa == "generic") return true;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    if (!osxsave) return false;
+    unsigned long long xcr0 = _xgetbv(0);
+    __cpuidex(info, 7, 0);
+    if (isa == "avx2") return fma && (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+    if (isa == "avx512")  // F, DQ, CD, BW, VL as required by -march=skylake-avx512
+        return (xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16)) && (info[1] & (1 << 17)) && (info[1] & (1 << 28)) &&
+               (info[1] & (1 << 30)) && (info[1] & (1u << 31));
+    return false;
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (isa == "avx2") return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (isa == "avx512")
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512cd") &&
+               __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl");
+    return false;
+#else
+    return false;
+#endif
+}
+
+static std::filesystem::path variant_path(const std::filesystem::path& dir, const std::string& benchmark, const std::string& isa)
+{
+#if defined(_WIN32)
+    return dir / (benchmark + "_" + isa + ".exe");
+#else
+    return dir / (benchmark + "_" + isa);
+#endif
+}
+
+static std::string command_line(const std::filesystem::path& program, int argc, char** argv, int first_arg)
+{
+    std::string cmd = "\"" + program.string() + "\"";
+    for (int i = first_arg; i < argc; i++) cmd += std::string(" \"") + argv[i] + "\"";
+#if defined(_WIN32)
+    cmd = "\"" + cmd + "\"";  // cmd.exe strips the outer quotes
+#endif
+    return cmd;
+}
+
+// exit code of a command from the status of std::system or pclose, on Windows the status is the exit code
+static int exit_code(int status)
+{
+#if defined(_WIN32)
+    return status;
+#else
+    if (status == -1) return 1;
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 1;
+#endif
+}
+
+// the search time of a result line, the number next to "us/query"
+static bool parse_us_per_query(const std::string& line, double& us)
+{
+    auto pos = line.find("us/query");
+    if (pos == std::string::npos) return false;
+
+    // "... with  123 us/query ..."
+    size_t end = pos > 0 ? line.find_last_not_of(' ', pos - 1) : std::string::npos;
+    if (end != std::string::npos)
+    {
+        size_t begin = line.find_last_of(' ', end);
+        begin = begin == std::string::npos ? 0 : begin + 1;
+        char* parsed = nullptr;
+        auto value = line.substr(begin, end - begin + 1);
+        us = std::strtod(value.c_str(), &parsed);
+        if (parsed != value.c_str()) return true;
+    }
+
+    // "us/query = 123.45, ..."
+    auto eq = line.find('=', pos);
+    if (eq == std::string::npos) return false;
+    char* parsed = nullptr;
+    us = std::strtod(line.c_str() + eq + 1, &parsed);
+    return parsed != line.c_str() + eq + 1;
+}
+
+int main(int argc, char** argv) {
+
+    bool compare = argc > 1 && std::string(argv[1]) == "--compare";
+    int benchmark_arg = compare ? 2 : 1;
+    if (argc <= benchmark_arg)
+    {
+        std::cerr << "usage: " << argv[0] << " [--compare] <benchmark> [<arguments> ...]" << std::endl;
+        return 1;
+    }
+
+    const std::string benchmark = argv[benchmark_arg];
+    const auto dir = std::filesystem::absolute(argv[0]).parent_path();
+
+    // variants which exist and can run on this CPU
+    std::vector<std::string> runnable;
+    for (const auto& isa : isa_levels)
+    {
+        bool supported = cpu_supports(isa);
+        bool exists = std::filesystem::exists(variant_path(dir, benchmark, isa));
+        std::cout << "ISA " << isa << ": " << (supported ? "supported" : "not supported") << " by the CPU, "
+                  << (exists ? "built" : "not built") << std::endl;
+        if (supported && exists) runnable.push_back(isa);
+    }
+    if (runnable.empty())
+    {
+        std::cerr << "no variant of " << benchmark << " can run on this CPU, configure with -DFAISSBENCH_ISA_VARIANTS=ON" << std::endl;
+        return 1;
+    }
+
+    if (!compare)
+    {
+        auto cmd = command_line(variant_path(dir, benchmark, runnable.front()), argc, argv, benchmark_arg + 1);
+        std::cout << "run " << cmd << std::endl;
+        std::cout.flush();
+        return exit_code(std::system(cmd.c_str()));
+    }
+
+    // run every variant, forward its output and collect the search times of its result lines
+    std::vector<std::vector<double>> times(runnable.size());
+    for (size_t v = 0; v < runnable.size(); v++)
+    {
+        auto cmd = command_line(variant_path(dir, benchmark, runnable[v]), argc, argv, benchmark_arg + 1);
+        std::cout << "run " << cmd << std::endl;
+        FILE* pipe = popen(cmd.c_str(), "r");
+        if (pipe == nullptr)
+        {
+            std::cerr << "could not start " << cmd << std::endl;
+            perror("");
+            return 1;
+        }
+
+        char buffer[4096];
+        while (fgets(buffer, sizeof(buffer), pipe) != nullptr)
+        {
+            std::string line(buffer);
+            printf("[%s] %s", runnable[v].c_str(), line.c_str());
+            double us;
+            if (parse_us_per_query(line, us)) times[v].push_back(us);
+        }
+        int code = exit_code(pclose(pipe));
+        if (code != 0)
+        {
+            std::cerr << runnable[v] << " variant failed with exit code " << code << std::endl;
+            return code;
+        }
+    }
+
+    // compare the result lines of all variants one by one, relative to the slowest ISA level
+    const auto& baseline = times.back();
+    printf("\nSearch time comparison of %s (relative to %s)\n", benchmark.c_str(), runnable.back().c_str());
+    for (size_t v = 0; v < runnable.size(); v++)
+    {
+        size_t n = std::min(times[v].size(), baseline.size());
+        double sum = 0, baseline_sum = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sum += times[v][i];
+            baseline_sum += baseline[i];
+        }
+        printf("%8s: %4zu result lines, mean %10.2f us/query, speedup %5.2fx\n", runnable[v].c_str(), times[v].size(),
+               n ? sum / n : 0.0, sum > 0 ? baseline_sum / sum : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+/**
+ * Microbenchmark of the dimension specialized distance kernels of distance_kernels.h
+ * against faiss::fvec_L2sqr and the generic runtime dimension kernel of the harness.
+ *
+ * For every benchmarked dimension (and one without a specialization as reference) the
+ * squared L2 distances of all pairs of a small query and base set of random vectors
+ * are computed single threaded. The base set fits into the L2 cache for the small
+ * dimensions, so the kernels and not the memory bandwidth are measured. Reported are
+ * the nanoseconds per distance, the speedup over faiss and the largest relative
+ * deviation from a double precision reference.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/utils/distances.h>
+
+#include "distance_kernels.h"
+#include "measure.h"
+#include "stopwatch.h"
+
+// sum of all distances of the nq x nb pairs, returned so that the loops are not optimized away
+template <typename Kernel>
+static double all_pairs(Kernel kernel, const float* xq, size_t nq, const float* xb, size_t nb, size_t d)
+{
+    double sum = 0;
+    for (size_t i = 0; i < nq; i++)
+    {
+        float row = 0;
+        for (size_t j = 0; j < nb; j++) row += kernel(xq + i * d, xb + j * d, d);
+        sum += row;
+    }
+    return sum;
+}
+
+// largest relative deviation of a kernel from the double precision squared L2 distance
+static double max_relative_error(DistanceKernel kernel, const float* xq, size_t nq, const float* xb, size_t nb, size_t d)
+{
+    double worst = 0;
+    for (size_t i = 0; i < nq; i++)
+    {
+        for (size_t j = 0; j < nb; j++)
+        {
+            double exact = 0;
+            for (size_t c = 0; c < d; c++)
+            {
+                double t = double(xq[i * d + c]) - xb[j * d + c];
+                exact += t * t;
+            }
+            if (exact > 0) worst = std::max(worst, std::abs(kernel(xq + i * d, xb + j * d, d) - exact) / exact);
+        }
+    }
+    return worst;
+}
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(USE_AVX512)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(USE_AVX)
+        std::cout << "use AVX  ..." << std::endl;
+    #else
+        std::cout << "use arch  ..." << std::endl;
+    #endif
+    #ifdef FAISSBENCH_FMA
+        std::cout << "use FMA  ..." << std::endl;
+    #endif
+
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        omp_set_num_threads(1); // kernels are compared single threaded
+    #endif
+
+    // the specialized dimensions plus one without a specialization
+    std::vector<size_t> dimensions(std::begin(specialized_dimensions), std::end(specialized_dimensions));
+    dimensions.push_back(200);
+
+    const size_t nq = 64;
+    const size_t nb = 2048;
+    TimingSettings timing_settings;
+    timing_settings.warmup = 2;
+    timing_settings.repetitions = 15;
+
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    printf("%6s %12s %12s %12s %10s %10s %12s %12s\n", "d", "faiss ns", "generic ns", "fixed ns", "generic x", "fixed x", "generic err", "fixed err");
+    for (size_t d : dimensions)
+    {
+        std::vector<float> xq(nq * d), xb(nb * d);
+        for (auto& v : xq) v = uniform(rng);
+        for (auto& v : xb) v = uniform(rng);
+
+        volatile double sink = 0;
+        auto faiss_l2 = [](const float* a, const float* b, size_t dim) { return faiss::fvec_L2sqr(a, b, dim); };
+        const DistanceKernel fixed = l2sqr_kernel(d);
+
+        auto t_faiss = measure_repeated(timing_settings, [&]() { sink = sink + all_pairs(faiss_l2, xq.data(), nq, xb.data(), nb, d); });
+        auto t_generic = measure_repeated(timing_settings, [&]() { sink = sink + all_pairs(l2sqr_dynamic, xq.data(), nq, xb.data(), nb, d); });
+        auto t_fixed = measure_repeated(timing_settings, [&]() { sink = sink + all_pairs(fixed, xq.data(), nq, xb.data(), nb, d); });
+
+        const double pairs = double(nq) * nb;
+        const double ns_faiss = t_faiss.median_us * 1000 / pairs;
+        const double ns_generic = t_generic.median_us * 1000 / pairs;
+        const double ns_fixed = t_fixed.median_us * 1000 / pairs;
+        printf("%6zu %12.2f %12.2f %12.2f %10.2f %10.2f %12.2e %12.2e%s%s\n", d, ns_faiss, ns_generic, ns_fixed,
+               ns_faiss / std::max(ns_generic, 1e-9), ns_faiss / std::max(ns_fixed, 1e-9),
+               max_relative_error(&l2sqr_dynamic, xq.data(), 8, xb.data(), nb, d), max_relative_error(fixed, xq.data(), 8, xb.data(), nb, d),
+               has_specialized_kernel(d) ? "" : " (not specialized)", t_fixed.frequency_scaling() ? " WARNING frequency scaling" : "");
+    }
+    return 0;
+}
@@ -10,6 +10,8 @@
 #include <filesystem>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <thread>
 #include <vector>
 #include <unordered_set>
 
@@ -30,9 +32,19 @@
 #include <faiss/index_factory.h>
 #include <faiss/IndexRefine.h>
 #include <faiss/IndexIVFPQFastScan.h>
-#include <faiss/index_io.h>
 
+#include "filtered_search.h"
+#include "index_cache.h"
+#include "latency.h"
+#include "pareto.h"
+#include "perf_counters.h"
+#include "recall.h"
+#include "result_buffer.h"
+#include "results_store.h"
+#include "search_phases.h"
 #include "stopwatch.h"
+#include "throughput.h"
+#include "vecs_io.h"
 
 /**
  * To run this demo, please download the ANN_SIFT1M dataset from
@@ -42,56 +54,14 @@
  * and unzip it to the sudirectory sift1M.
  **/
 
-/*****************************************************
- * I/O functions for fvecs and ivecs
- *****************************************************/
-float* fvecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    std::error_code ec{};
-    auto file_size = std::filesystem::file_size(fname, ec);
-    if (ec != std::error_code{})
-    {
-        std::cerr << "error when accessing file " << fname << ", size is: " << file_size << " message: " << ec.message() << std::endl;
-        perror("");
-        abort();
-    }
-
-    auto ifstream = std::ifstream(fname, std::ios::binary);
-    if (!ifstream.is_open())
-    {
-        std::cerr << "could not open " << fname << std::endl;
-        perror("");
-        abort();
-    }
-
-    int dims;
-    ifstream.read(reinterpret_cast<char*>(&dims), sizeof(int));
-    assert((dims > 0 && dims < 1000000) || !"unreasonable dimension");
-    assert(file_size % ((dims + 1) * 4) == 0 || !"weird file size");
-    size_t n = file_size / ((dims + 1) * 4);
-
-    *d_out = dims;
-    *n_out = n;
-
-    float* x = new float[n * (dims + 1)];
-    ifstream.seekg(0);
-    ifstream.read(reinterpret_cast<char*>(x), n * (dims + 1) * sizeof(float));
-    if (!ifstream) assert(ifstream.gcount() == static_cast<int>(n * (dims + 1)) || !"could not read whole file");
-
-    // shift array to remove row headers
-    for (size_t i = 0; i < n; i++) std::memmove(&x[i * dims], &x[1 + i * (dims + 1)], dims * sizeof(float));
-
-    ifstream.close();
-    return x;
-}
-
-// not very clean, but works as long as sizeof(int) == sizeof(float)
-int* ivecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    return (int*)fvecs_read(fname, d_out, n_out);
-}
-
 int main() {
 
-    #if defined(__AVX2__)
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(__AVX512F__)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(__AVX2__)
         std::cout << "use AVX2  ..." << std::endl;
     #elif defined(__AVX__)
         std::cout << "use AVX  ..." << std::endl;
@@ -104,7 +74,7 @@ int main() {
     // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
     #ifdef _OPENMP
         omp_set_dynamic(0);     // Explicitly disable dynamic teams
-        omp_set_num_threads(1); // Use 1 threads for all consecutive parallel regions
+        omp_set_num_threads(1); // Use 1 threads for all consecutive parallel regions, the index build uses its own threads
 
         std::cout << "_OPENMP " << omp_get_num_threads() << " threads" << std::endl;
     #endif
@@ -116,6 +86,7 @@ int main() {
     const auto query_file       = (data_path / "SIFT1M" / "sift_query.fvecs").string();
     const auto groundtruth_file = (data_path / "SIFT1M" / "sift_groundtruth.ivecs").string();
     const auto index_dir        = (data_path / "faiss").string();
+    const auto results_file     = (data_path / "results" / "faiss_fastscan_index.jsonl").string();  // JSON Lines results, empty disables them
 
     // faiss index type
     auto index_type = "IVF1024,PQ64x4fs,Refine(SQfp16)";  // IVFPQ nlist=1024, ncodes=64, nbits=4, FastScan, Rerank
@@ -123,53 +94,63 @@ int main() {
     // how many percent of the data should be used to train the index
     float train_percentage = 10.0f;
 
+    // the base data is streamed into the index in chunks of this many vectors
+    const size_t build_chunk_size = 100000;
+
+    // training and adding run with all cores, independent of the single threaded searches. The
+    // random training sample is capped at max_train_points (0 = no cap), the coarse quantizer is
+    // trained with flat, hierarchical (two-level) or gpu k-means
+    BuildSettings build_settings;
+    build_settings.threads = (int)std::max(1u, std::thread::hardware_concurrency());
+    build_settings.max_train_points = 0;
+    build_settings.kmeans_iterations = 0;  // 0 = faiss default
+    build_settings.coarse = CoarseTraining::flat;
+
     // find k best elements
     const auto target_k = 1;
     const auto k_recall_at = 1;
 
-    // index file name
-    const auto index_file = string_format("%s/%s,Train%4.1f.ivf", index_dir.c_str(), index_type, train_percentage);
-       
-    StopW stopwatch;
-    faiss::IndexRefine* index;
-    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    // queries per search call when recording the latency percentiles, 0 disables the latency pass
+    const size_t latency_batch_size = 1;
 
-    size_t d;
-    printf("[%lld s] Check file %s \n", stopwatch.getElapsedTimeSeconds(), index_file.c_str());
-    if(std::filesystem::exists(index_file.c_str()))
-    {
-        index = reinterpret_cast<faiss::IndexRefine*>(faiss::read_index(index_file.c_str()));
-    } 
-    else 
-    {
-        // printf("[%lld s] Loading train set\n", stopwatch.getElapsedTimeSeconds());
-        // size_t nt;
-        // float* xt = fvecs_read(learn_file.c_str(), &d, &nt);
+    // query batch sizes of the batch-size sweep of every operating point (0 = all queries), empty disables
+    // the sweep, e.g. { 1, 8, 64, 1024, 0 }
+    const std::vector<size_t> batch_sizes = {};
 
-        printf("[%lld s] Loading database\n", stopwatch.getElapsedTimeSeconds());
-        size_t nb;
-        float* xb = fvecs_read(repository_file.c_str(), &d, &nb);
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    // measure the QPS-vs-threads scaling curve of every operating point, up to all cores
+    const bool throughput_mode = false;
 
-        printf("[%lld s] Preparing index \"%s\" d=%zu\n", stopwatch.getElapsedTimeSeconds(), index_type, d);
-        index = reinterpret_cast<faiss::IndexRefine*>(faiss::index_factory((int)d, index_type, faiss::METRIC_L2));
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after creating the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    // read the hardware performance counters around the timed searches (Linux only)
+    const bool perf_counters = false;
 
-        auto train_size = size_t(nb * (train_percentage / 100));
-        printf("[%lld s] Train database, size %zu*%zu\n", stopwatch.getElapsedTimeSeconds(), train_size, d);
-        index->train(train_size, xb);
-        // index->train(nt, xt);
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after training the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    // time the coarse quantization, the list scan and the refine pass of every operating point separately
+    const bool phase_breakdown = false;
 
-        printf("[%lld s] Indexing database, size %zu*%zu\n", stopwatch.getElapsedTimeSeconds(), nb, d);
-        index->add(nb, xb);
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after filling the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    // search parameter ladders, the adaptive sweep measures them coarse to fine around the
+    // recall-vs-QPS frontier, otherwise every combination is measured
+    const std::vector<double> nprobe_ladder = { 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128 };
+    const std::vector<double> k_factor_ladder = { 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128 };
+    const bool adaptive_grid = true;
+    const size_t initial_stride = 4;
 
-        // store
-        faiss::write_index(index, index_file.c_str());
+    // report the cheapest configuration of the frontier reaching this recall
+    const double target_recall = 0.95;
 
-        delete[] xb;
-    }
+    // filtered searches at every frontier configuration with synthetic attribute filters of 50%,
+    // 10%, 1% and 0.1% selectivity, pre-filtered by an IDSelector and post-filtered by over-fetching
+    const bool filtered_search = false;
+    FilteredSearchSettings filter_settings;
+
+    StopW stopwatch;
+    faiss::IndexRefine* index;
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    // load the cached index, or build and cache it
+    BuildStats build_stats;
+    index = reinterpret_cast<faiss::IndexRefine*>(load_or_build_index(index_dir, repository_file, index_type, train_percentage, build_chunk_size, stopwatch, build_settings, &build_stats));
+    printf("[%lld s] Index trained in %.1f s on %zu vectors (%.1f s per million) with %d threads\n", stopwatch.getElapsedTimeSeconds(),
+           build_stats.train_s, build_stats.train_points, build_stats.train_s_per_million(), build_stats.threads);
+    size_t d = index->d;
 
     size_t nq;
     float* xq;
@@ -181,80 +162,104 @@ int main() {
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the query data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
     }
 
-    size_t k;                   // nb of results per query in the GT
-    faiss::idx_t* gt;    // nq * k matrix of ground-truth nearest-neighbors
+    // ground truth (.gt or .ivecs), the evaluator reads its int32 ids in place from the mapping
+    printf("[%lld s] Loading ground truth for %zu queries\n", stopwatch.getElapsedTimeSeconds(), nq);
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the ground truth data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    // the exact results among the base vectors passing each filter
+    std::vector<FilteredCase> filtered_gt;
+    if (filtered_search)
     {
-        // load ground-truth and convert int to long
-        printf("[%lld s] Loading ground truth for %zu queries\n", stopwatch.getElapsedTimeSeconds(), nq);
-        size_t nq2;
-        int* gt_int = ivecs_read(groundtruth_file.c_str(), &k, &nq2);
-        assert(nq2 == nq || !"incorrect nb of ground truth entries");
-
-        gt = new faiss::idx_t[k * nq];
-        for (int i = 0; i < k * nq; i++)
-            gt[i] = gt_int[i];
-
-        delete[] gt_int;
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the ground truth data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+        FVecsView xb(repository_file.c_str());
+        filtered_gt = filtered_cases(xb, nq, xq, target_k, filter_settings, stopwatch);
     }
 
     { // Use the found configuration to perform a search
 
-        // setup output buffers
-        faiss::idx_t* I = new faiss::idx_t[nq * target_k];
-        float* D = new float[nq * target_k];
+        RecallEvaluator evaluator(gt);
+        ResultsStore store(results_file);
+        std::unique_ptr<PerfCounters> counters;
+        if (perf_counters) counters = std::make_unique<PerfCounters>();
+
+        // setup output buffers, pre-faulted once and reused by all configurations
+        ResultBuffer results(nq, target_k);
+        faiss::idx_t* I = results.I();
+        float* D = results.D();
         printf("[%lld s] Start testing\n", stopwatch.getElapsedTimeSeconds());
   
-        std::vector<size_t> nprobe_parameter = { 8,16,32,64 }; 
-        for (size_t nprobe : nprobe_parameter) {
-
-            std::vector<float> k_factor_parameter = { 1,2,4,8,16,32,64,128 }; 
-            for (float k_factor : k_factor_parameter) {
-            
-                // https://github.com/facebookresearch/faiss/wiki/FAQ#what-does-it-mean-when-a-search-returns--1-ids
-                index->k_factor = k_factor;
-                //index->refine_index->
-
-                // setup search parameters
-                faiss::IndexIVFPQFastScan* base_index = reinterpret_cast<faiss::IndexIVFPQFastScan*>(index->base_index);
-                base_index->nprobe = nprobe;
-
-                // faiss::ParameterSpace().set_index_parameter(index, "nprobe", nprobe);
-                // faiss::ParameterSpace().set_index_parameter(index, "k_factor_rf", 1);
-
-                // search
-                StopW timer;
-                index->search(nq, xq, target_k, D, I);
-                auto duration_us = timer.getElapsedTimeMicro();
-
-                // evaluate results
-                int recall_at_k = 0;
-                for (int i = 0; i < nq; i++) {
-                    auto gt_nn = gt + i * k;
-                    auto result_nn = I + i * target_k;
-                    for (int m = 0; m < target_k; m++) {
-                        auto result_entry = result_nn[m];
-
-                        // check if result_entry is in the first k elements of the ground truth data
-                        for (int j = 0; j < k_recall_at; j++) {        
-                            if (gt_nn[j] == result_entry) {
-                                recall_at_k++;
-                                break;
-                            }
-                        }
-                    }
-                }
-                printf("%d-R@%d = %.4f with %6.0f us/query at k_factor=%3.0f,nprobe=%3zu\n", k_recall_at, target_k, recall_at_k / float(nq) / k_recall_at, duration_us / float(nq), k_factor, nprobe);
-
+        AdaptiveGrid grid({ nprobe_ladder, k_factor_ladder });
+        auto measure = [&](const std::vector<double>& params) {
+            const size_t nprobe = (size_t)params[0];
+            const float k_factor = (float)params[1];
+
+            // https://github.com/facebookresearch/faiss/wiki/FAQ#what-does-it-mean-when-a-search-returns--1-ids
+            index->k_factor = k_factor;
+
+            // setup search parameters
+            faiss::IndexIVFPQFastScan* base_index = reinterpret_cast<faiss::IndexIVFPQFastScan*>(index->base_index);
+            base_index->nprobe = nprobe;
+
+            // search
+            if (counters) counters->start();
+            StopW timer;
+            index->search(nq, xq, target_k, D, I);
+            auto duration_us = timer.getElapsedTimeMicro();
+            std::string perf_info = counters ? format_perf_counts(counters->stop(), nq, duration_us) : "";
+
+            // evaluate results
+            float recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+            auto record = search_record("faiss_fastscan_index", "sift1m", index_type, string_format("nprobe=%zu,k_factor=%g", nprobe, k_factor), target_k, k_recall_at, recall, duration_us, nq);
+            record.set("train_s_per_million", build_stats.train_s_per_million())
+                  .set("build_threads", build_stats.threads);
+
+            // per query latency percentiles, measured in a separate pass
+            std::string latency_info;
+            if (latency_batch_size > 0) {
+                LatencyHistogram latency;
+                measure_latency(index, nq, xq, target_k, D, I, latency_batch_size, latency);
+                latency_info = ", " + format_percentiles(latency);
+                set_percentiles(record, latency);
             }
+            printf("%d-R@%d = %.4f with %6.0f us/query at k_factor=%3.0f,nprobe=%3zu%s%s\n", k_recall_at, target_k, recall, duration_us / float(nq), k_factor, nprobe, latency_info.c_str(), perf_info.c_str());
+            store.append(record);
+
+            if (phase_breakdown)
+                printf("%s\n", format_phases(measure_refine_phases(index, nq, xq, target_k, D, I)).c_str());
+
+            if (!batch_sizes.empty())
+                print_batch_sweep(index, nq, xq, target_k, D, I, batch_sizes);
+
+            if (throughput_mode)
+                print_throughput_curve(index, nq, xq, target_k, D, I, std::thread::hardware_concurrency());
+
+            return std::make_pair(double(recall), nq / (std::max<long long>(duration_us, 1) / 1000000.0));
+        };
+        auto points = grid.run(measure, adaptive_grid ? initial_stride : 1);
+
+        const std::vector<std::string> names = { "nprobe", "k_factor" };
+        auto frontier = pareto_frontier(points);
+        printf("[%lld s] Recall-vs-QPS frontier, %zu of %zu measured configurations (grid of %zu):\n", stopwatch.getElapsedTimeSeconds(), frontier.size(), grid.evaluations(), grid.grid_size());
+        print_frontier(frontier, names);
+
+        auto target = cheapest_at_recall(frontier, target_recall);
+        if (target.reached)
+            printf("cheapest configuration with %d-R@%d >= %.4f: %s with %.4f at %.0f QPS, frontier interpolated to %.4f: %.0f QPS\n", k_recall_at, target_k, target_recall,
+                   describe_params(target.cheapest, names).c_str(), target.cheapest.recall, target.cheapest.qps, target_recall, target.interpolated_qps);
+        else
+            printf("no measured configuration reaches %d-R@%d >= %.4f\n", k_recall_at, target_k, target_recall);
+
+        if (filtered_search)
+        {
+            printf("[%lld s] Filtered searches at the frontier configurations\n", stopwatch.getElapsedTimeSeconds());
+            for (const auto& p : frontier)
+                filtered_search_sweep("faiss_fastscan_index", "sift1m", index_type, index, nq, xq, target_k, k_recall_at, (size_t)p.params[0], (float)p.params[1],
+                                      filtered_gt, filter_settings, store);
         }
-
-        delete[] I;
-        delete[] D;
     }
 
     delete[] xq;
-    delete[] gt;
     delete index;
     return 0;
 }
\ No newline at end of file
@@ -29,7 +29,10 @@
 #include <faiss/AutoTune.h>
 #include <faiss/index_factory.h>
 
+#include "recall.h"
+#include "result_buffer.h"
 #include "stopwatch.h"
+#include "vecs_io.h"
 
 /**
  * To run this demo, please download the ANN_SIFT1M dataset from
@@ -39,56 +42,14 @@
  * and unzip it to the sudirectory sift1M.
  **/
 
-/*****************************************************
- * I/O functions for fvecs and ivecs
- *****************************************************/
-float* fvecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    std::error_code ec{};
-    auto file_size = std::filesystem::file_size(fname, ec);
-    if (ec != std::error_code{})
-    {
-        std::cerr << "error when accessing file " << fname << ", size is: " << file_size << " message: " << ec.message() << std::endl;
-        perror("");
-        abort();
-    }
-
-    auto ifstream = std::ifstream(fname, std::ios::binary);
-    if (!ifstream.is_open())
-    {
-        std::cerr << "could not open " << fname << std::endl;
-        perror("");
-        abort();
-    }
-
-    int dims;
-    ifstream.read(reinterpret_cast<char*>(&dims), sizeof(int));
-    assert((dims > 0 && dims < 1000000) || !"unreasonable dimension");
-    assert(file_size % ((dims + 1) * 4) == 0 || !"weird file size");
-    size_t n = file_size / ((dims + 1) * 4);
-
-    *d_out = dims;
-    *n_out = n;
-
-    float* x = new float[n * (dims + 1)];
-    ifstream.seekg(0);
-    ifstream.read(reinterpret_cast<char*>(x), n * (dims + 1) * sizeof(float));
-    if (!ifstream) assert(ifstream.gcount() == static_cast<int>(n * (dims + 1)) || !"could not read whole file");
-
-    // shift array to remove row headers
-    for (size_t i = 0; i < n; i++) std::memmove(&x[i * dims], &x[1 + i * (dims + 1)], dims * sizeof(float));
-
-    ifstream.close();
-    return x;
-}
-
-// not very clean, but works as long as sizeof(int) == sizeof(float)
-int* ivecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    return (int*)fvecs_read(fname, d_out, n_out);
-}
-
 int main() {
 
-    #if defined(__AVX2__)
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(__AVX512F__)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(__AVX2__)
         std::cout << "use AVX2  ..." << std::endl;
     #elif defined(__AVX__)
         std::cout << "use AVX  ..." << std::endl;
@@ -183,9 +144,10 @@ int main() {
     size_t d;
     {
         printf("[%lld s] Loading database\n", stopwatch.getElapsedTimeSeconds());
-        size_t nb;
-        float* xb = fvecs_read(repository_file.c_str(), &d, &nb);
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+        FVecsView xb(repository_file.c_str());
+        size_t nb = xb.size();
+        d = xb.dims();
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after mapping data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
         // reduce data set size
         auto reduce_count = size_t(nb * (reduce_index_by / 100));
@@ -196,10 +158,8 @@ int main() {
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after creating the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
         printf("[%lld s] Indexing database, size %zu*%zu\n", stopwatch.getElapsedTimeSeconds(), nb, d);
-        index->add(nb, xb);
+        xb.for_each_chunk(0, nb, xb.rows_per_chunk(), [&](size_t, size_t count, const float* x) { index->add(count, x); });
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after filling the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
-
-        delete[] xb;
     }
 
     size_t nq;
@@ -213,29 +173,20 @@ int main() {
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the query data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
     }
 
-    size_t k;                   // nb of results per query in the GT
-    faiss::idx_t* gt;    // nq * k matrix of ground-truth nearest-neighbors
-    {
-        // load ground-truth and convert int to long
-        printf("[%lld s] Loading ground truth for %zu queries\n", stopwatch.getElapsedTimeSeconds(), nq);
-        size_t nq2;
-        int* gt_int = ivecs_read(groundtruth_file.c_str(), &k, &nq2);
-        assert(nq2 == nq || !"incorrect nb of ground truth entries");
-
-        gt = new faiss::idx_t[k * nq];
-        for (int i = 0; i < k * nq; i++)
-            gt[i] = gt_int[i];
-
-        delete[] gt_int;
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the ground truth data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
-    }
+    // ground truth (.gt or .ivecs), the evaluator reads its int32 ids in place from the mapping
+    printf("[%lld s] Loading ground truth for %zu queries\n", stopwatch.getElapsedTimeSeconds(), nq);
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    size_t k = gt.k();  // nb of results per query in the GT
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the ground truth data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
     { // Use the found configuration to perform a search
 
         // setup output buffers
         printf("[%lld s] Setup search structures\n", stopwatch.getElapsedTimeSeconds()); 
-        faiss::idx_t* I = new faiss::idx_t[nq * k];
-        float* D = new float[nq * k];
+        ResultBuffer results(nq, k);
+        faiss::idx_t* I = results.I();
+        float* D = results.D();
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after setting up the search output structures\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
         // search
@@ -246,30 +197,11 @@ int main() {
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after performing the search\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
         // evaluate results
-        int precisionAtK = 0;
-        for (int i = 0; i < nq; i++) {
-            auto gt_nn = gt + i * k;
-            auto result_nn = I + i * k;
-            for (int m = 0; m < k; m++) {
-                auto result_entry = result_nn[m];
-
-                // check if result_entry is in the first k elements of the ground truth data
-                for (int j = 0; j < k; j++) {     
-                    if (gt_nn[j] == result_entry) {
-                        precisionAtK++;
-                        break;
-                    }
-                }
-            }
-        }
-        printf("R@%d = %.4f with %8.4f us/query\n", k, precisionAtK / float(nq) / k, duration_us / float(nq));
-
-        delete[] I;
-        delete[] D;
+        float recall = RecallEvaluator(gt).recall(I, k, k, k);
+        printf("R@%zu = %.4f with %8.4f us/query\n", k, recall, duration_us / float(nq));
     }
 
     delete[] xq;
-    delete[] gt;
     delete index;
     return 0;
 }
\ No newline at end of file
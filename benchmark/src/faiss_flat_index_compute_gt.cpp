@@ -27,10 +27,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
-#include <faiss/AutoTune.h>
-#include <faiss/index_factory.h>
 
+#include "gt_engine.h"
+#include "gt_format.h"
 #include "stopwatch.h"
+#include "vecs_io.h"
 
 /**
  * To run this demo, please download the ANN_SIFT1M dataset from
@@ -40,75 +41,14 @@
  * and unzip it to the sudirectory sift1M.
  **/
 
-/*****************************************************
- * I/O functions for fvecs and ivecs
- *****************************************************/
-float* fvecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    std::error_code ec{};
-    auto file_size = std::filesystem::file_size(fname, ec);
-    if (ec != std::error_code{}) {
-        std::cerr << "error when accessing file " << fname << ", size is: " << file_size << " message: " << ec.message() << std::endl;
-        perror("");
-        abort();
-    }
-
-    auto ifstream = std::ifstream(fname, std::ios::binary);
-    if (!ifstream.is_open())
-    {
-        std::cerr << "could not open " << fname << std::endl;
-        perror("");
-        abort();
-    }
-
-    int dims;
-    ifstream.read(reinterpret_cast<char*>(&dims), sizeof(int));
-    assert((dims > 0 && dims < 1000000) || !"unreasonable dimension");
-    assert(file_size % ((dims + 1) * 4) == 0 || !"weird file size");
-    size_t n = file_size / ((dims + 1) * 4);
-
-    *d_out = dims;
-    *n_out = n;
-
-    float* x = new float[n * (dims + 1)];
-    ifstream.seekg(0);
-    ifstream.read(reinterpret_cast<char*>(x), n * (dims + 1) * sizeof(float));
-    if (!ifstream) assert(ifstream.gcount() == static_cast<int>(n * (dims + 1)) || !"could not read whole file");
-
-    // shift array to remove row headers
-    for (size_t i = 0; i < n; i++) std::memmove(&x[i * dims], &x[1 + i * (dims + 1)], dims * sizeof(float));
-
-    ifstream.close();
-    return x;
-}
-
-// not very clean, but works as long as sizeof(int) == sizeof(float)
-int* ivecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    return (int*)fvecs_read(fname, d_out, n_out);
-}
-
-void ivecs_write (const char *fname, int d, int n, const int *v)
-{
-    auto ofstream = std::ofstream(fname, std::ios::binary);
-    if (!ofstream.is_open())
-    {
-        std::cerr << "could not open " << fname << std::endl;
-        perror("");
-        abort();
-    }
-
-    for (size_t i = 0; i < n; i++) {
-        ofstream.write(reinterpret_cast<char*>(&d), sizeof(int));
-        ofstream.write(const_cast<char*>(reinterpret_cast<const char*>(v)), d * sizeof(int));
-        v += d;
-    }
-
-    ofstream.close();
-}
-
-
 int main() {
 
-    #if defined(__AVX2__)
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(__AVX512F__)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(__AVX2__)
         std::cout << "use AVX2  ..." << std::endl;
     #elif defined(__AVX__)
         std::cout << "use AVX  ..." << std::endl;
@@ -121,9 +61,9 @@ int main() {
     // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
     #ifdef _OPENMP
         omp_set_dynamic(0);     // Explicitly disable dynamic teams
-        omp_set_num_threads(4); // Use 1 threads for all consecutive parallel regions
+        omp_set_num_threads(omp_get_num_procs()); // Use all cores for all consecutive parallel regions
 
-        std::cout << "_OPENMP " << omp_get_num_threads() << " threads" << std::endl;
+        std::cout << "_OPENMP " << omp_get_max_threads() << " threads" << std::endl;
     #endif
 
     // glove
@@ -136,28 +76,23 @@ int main() {
     size_t k = 1024;       // top-k
     size_t step_size = 100000; // how many base vectors to add per step
 
-    // faiss index type
-    auto index_type = "Flat";
+    // query block and base tile sizes of the ground truth engine
+    size_t query_block = 1024;
+    size_t base_tile = 8192;
 
     StopW stopwatch;
-    faiss::Index* index;
     printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
     size_t d;
-    // keep base dataset and its size in scope for the ground-truth loop
-    size_t nb_total;
-    float* xb_full;
+    // keep the mapped base dataset and its size in scope for the ground-truth loop
+    printf("[%lld s] Mapping database\n", stopwatch.getElapsedTimeSeconds());
+    FVecsView xb_full(repository_file.c_str());
+    size_t nb_total = xb_full.size();
     {
-        printf("[%lld s] Loading database\n", stopwatch.getElapsedTimeSeconds());
-        xb_full = fvecs_read(repository_file.c_str(), &d, &nb_total);
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
-
-        printf("[%lld s] Preparing index \"%s\" d=%zu\n", stopwatch.getElapsedTimeSeconds(), index_type, d);
-        index = faiss::index_factory((int)d, index_type, faiss::METRIC_L2);
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after creating the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+        d = xb_full.dims();
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after mapping data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
-        // We will add the base vectors in chunks of step_size later below.
-        // Keep xb_full alive for the whole run.
+        // The base vectors are streamed tile by tile from the mapping, see below.
     }
 
     size_t nq;
@@ -172,7 +107,12 @@ int main() {
 
 
     {
-        // For each base size step, extend the index and compute ground truth.
+        // For each base size step, only the newly added base vectors are compared with the
+        // queries, the engine keeps the running top-k of all vectors added so far.
+        GroundTruthEngine engine(nq, d, xq, k, query_block, base_tile);
+        std::vector<float> D(nq * k);
+        std::vector<faiss::idx_t> I(nq * k);
+
         size_t nb_current = 0;
         size_t step_idx   = 0;
 
@@ -180,18 +120,11 @@ int main() {
             size_t nb_next = std::min(nb_current + step_size, nb_total);
             size_t to_add  = nb_next - nb_current;
 
-            printf("[%lld s] Step %zu: adding base vectors [%zu, %zu) (count=%zu)\n",
-                   stopwatch.getElapsedTimeSeconds(), step_idx, nb_current, nb_next, to_add);
-
-            index->add(to_add, xb_full + nb_current * d);
-
-            printf("[%lld s] Computing ground truth for %zu queries with k=%zu on nb=%zu base vectors\n",
-                   stopwatch.getElapsedTimeSeconds(), nq, k, nb_next);
-
-            faiss::idx_t* I = new faiss::idx_t[nq * k];
-            float* D = new float[nq * k];
+            printf("[%lld s] Step %zu: computing ground truth for %zu queries with k=%zu on base vectors [%zu, %zu) (count=%zu)\n",
+                   stopwatch.getElapsedTimeSeconds(), step_idx, nq, k, nb_current, nb_next, to_add);
 
-            index->search(nq, xq, k, D, I);
+            engine.add(xb_full, nb_current, nb_next);
+            engine.result(D.data(), I.data());
 
             std::vector<int> gt_ids(nq * k);
             for (size_t i = 0; i < nq * k; ++i) {
@@ -205,8 +138,10 @@ int main() {
             printf("[%lld s] Writing ground truth to %s\n", stopwatch.getElapsedTimeSeconds(), gt_filename.c_str());
             ivecs_write(gt_filename.c_str(), (int)k, (int)nq, gt_ids.data());
 
-            delete[] I;
-            delete[] D;
+            // compact copy with bitpacked ids and the distances, used by RecallEvaluator for the distance ratio
+            auto gt_compact_filename = gt_filename.substr(0, gt_filename.size() - 6) + ".gt";
+            printf("[%lld s] Writing compact ground truth to %s\n", stopwatch.getElapsedTimeSeconds(), gt_compact_filename.c_str());
+            write_ground_truth(gt_compact_filename.c_str(), nq, k, I.data(), D.data());
 
             nb_current = nb_next;
             ++step_idx;
@@ -214,7 +149,5 @@ int main() {
     }
 
     delete[] xq;
-    delete[] xb_full;
-    delete index;
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,306 @@
+/**
+ * GPU variants of the IVF-PQ sweep of faiss_ivfpq_index and the exact search of
+ * faiss_flat_index_compute_gt, run on GpuIndexIVFPQ and GpuIndexFlat. Only built with
+ * FAISSBENCH_GPU=ON against a faiss with CUDA support (vcpkg feature gpu).
+ *
+ * Every operating point is measured on the CPU (all cores), on a single GPU and, with
+ * more than one GPU, with the index sharded across all of them. On a single GPU the search
+ * is additionally replayed on device resident data to time the host-to-device copy of the
+ * queries, the search kernels and the device-to-host copy of the results separately with
+ * CUDA events, the QPS are those of the plain search from host memory, transfers included.
+ * All results are printed in one table at the end.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <cuda_runtime.h>
+
+#include <faiss/IndexFlat.h>
+#include <faiss/gpu/GpuAutoTune.h>
+#include <faiss/gpu/GpuCloner.h>
+#include <faiss/gpu/StandardGpuResources.h>
+#include <faiss/gpu/utils/DeviceUtils.h>
+
+#include "gt_engine.h"
+#include "index_cache.h"
+#include "recall.h"
+#include "result_buffer.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+static void cuda_check(cudaError_t error, const char* what)
+{
+    if (error != cudaSuccess)
+    {
+        std::cerr << what << " failed: " << cudaGetErrorString(error) << std::endl;
+        abort();
+    }
+}
+
+// one line of the result table, negative transfer times were not measured
+struct TableRow
+{
+    std::string backend;
+    std::string index;
+    std::string params;
+    double recall = 0;
+    double qps = 0;
+    double h2d_ms = -1;
+    double kernel_ms = -1;
+    double d2h_ms = -1;
+};
+
+struct TransferTiming
+{
+    double h2d_ms = 0;
+    double kernel_ms = 0;
+    double d2h_ms = 0;
+};
+
+/**
+ * Copies the queries to the device, searches the device resident queries into device
+ * buffers and copies the results back, each step timed with CUDA events on the default
+ * stream of the faiss resources, which the search kernels run on as well.
+ */
+static TransferTiming time_device_search(faiss::gpu::StandardGpuResources& res, int device, const faiss::Index* index,
+                                         size_t nq, const float* xq, size_t k, float* D, faiss::idx_t* I)
+{
+    cuda_check(cudaSetDevice(device), "cudaSetDevice");
+    cudaStream_t stream = res.getDefaultStream(device);
+
+    float* d_xq;
+    float* d_D;
+    faiss::idx_t* d_I;
+    cuda_check(cudaMalloc((void**)&d_xq, nq * index->d * sizeof(float)), "cudaMalloc");
+    cuda_check(cudaMalloc((void**)&d_D, nq * k * sizeof(float)), "cudaMalloc");
+    cuda_check(cudaMalloc((void**)&d_I, nq * k * sizeof(faiss::idx_t)), "cudaMalloc");
+
+    cudaEvent_t events[4];
+    for (auto& e : events) cuda_check(cudaEventCreate(&e), "cudaEventCreate");
+
+    cuda_check(cudaEventRecord(events[0], stream), "cudaEventRecord");
+    cuda_check(cudaMemcpyAsync(d_xq, xq, nq * index->d * sizeof(float), cudaMemcpyHostToDevice, stream), "cudaMemcpyAsync");
+    cuda_check(cudaEventRecord(events[1], stream), "cudaEventRecord");
+    index->search(nq, d_xq, k, d_D, d_I);
+    cuda_check(cudaEventRecord(events[2], stream), "cudaEventRecord");
+    cuda_check(cudaMemcpyAsync(D, d_D, nq * k * sizeof(float), cudaMemcpyDeviceToHost, stream), "cudaMemcpyAsync");
+    cuda_check(cudaMemcpyAsync(I, d_I, nq * k * sizeof(faiss::idx_t), cudaMemcpyDeviceToHost, stream), "cudaMemcpyAsync");
+    cuda_check(cudaEventRecord(events[3], stream), "cudaEventRecord");
+    cuda_check(cudaEventSynchronize(events[3]), "cudaEventSynchronize");
+
+    float ms[3];
+    for (int i = 0; i < 3; i++) cuda_check(cudaEventElapsedTime(&ms[i], events[i], events[i + 1]), "cudaEventElapsedTime");
+
+    for (auto& e : events) cudaEventDestroy(e);
+    cudaFree(d_xq);
+    cudaFree(d_D);
+    cudaFree(d_I);
+    return { ms[0], ms[1], ms[2] };
+}
+
+// queries per second of one search of all queries from host memory
+static double host_search_qps(const faiss::Index* index, size_t nq, const float* xq, size_t k, float* D, faiss::idx_t* I)
+{
+    StopW timer;
+    index->search(nq, xq, k, D, I);
+    return nq / (std::max<long long>(timer.getElapsedTimeMicro(), 1) / 1000000.0);
+}
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        omp_set_num_threads(omp_get_num_procs()); // the CPU rows use all cores
+    #endif
+
+    // SIFT1M
+    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+    const auto repository_file  = (data_path / "SIFT1M" / "sift_base.fvecs").string();
+    const auto query_file       = (data_path / "SIFT1M" / "sift_query.fvecs").string();
+    const auto groundtruth_file = (data_path / "SIFT1M" / "sift_groundtruth.ivecs").string();
+    const auto index_dir        = (data_path / "faiss").string();
+    const auto results_file     = (data_path / "results" / "faiss_gpu_index.jsonl").string();  // JSON Lines results, empty disables them
+
+    // GpuIndexIVFPQ supports 8 bit PQ codes, the fast scan and refine indexes of the CPU sweeps have no GPU version
+    auto ivfpq_type = "IVF1024,PQ32x8";
+    const float train_percentage = 10;
+    const size_t build_chunk_size = 100000;
+    const std::vector<double> nprobe_parameter = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    // find k best elements
+    const size_t target_k = 100;
+    const size_t k_recall_at = 100;
+
+    const int gpus = faiss::gpu::getNumDevices();
+    if (gpus < 1)
+    {
+        std::cerr << "no CUDA device found" << std::endl;
+        return 1;
+    }
+    for (int g = 0; g < gpus; g++)
+    {
+        cudaDeviceProp prop;
+        cuda_check(cudaGetDeviceProperties(&prop, g), "cudaGetDeviceProperties");
+        std::cout << "GPU " << g << ": " << prop.name << ", " << prop.totalGlobalMem / 1000000 << " Mb" << std::endl;
+    }
+
+    std::vector<std::unique_ptr<faiss::gpu::StandardGpuResources>> resources;
+    std::vector<faiss::gpu::GpuResourcesProvider*> providers;
+    std::vector<int> devices;
+    for (int g = 0; g < gpus; g++)
+    {
+        resources.push_back(std::make_unique<faiss::gpu::StandardGpuResources>());
+        providers.push_back(resources.back().get());
+        devices.push_back(g);
+    }
+    faiss::gpu::GpuMultipleClonerOptions shard_options;
+    shard_options.shard = true;
+
+    StopW stopwatch;
+    printf("[%lld s] Loading queries and ground truth\n", stopwatch.getElapsedTimeSeconds());
+    FVecsView xq_view(query_file.c_str());
+    const size_t d = xq_view.dims();
+    const size_t nq = xq_view.size();
+    std::vector<float> xq(nq * d);
+    xq_view.copy_rows(0, nq, xq.data());
+
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    RecallEvaluator evaluator(gt);
+
+    ResultBuffer results(nq, target_k);
+    faiss::idx_t* I = results.I();
+    float* D = results.D();
+    std::vector<TableRow> table;
+
+    // IVF-PQ sweep
+    {
+        std::unique_ptr<faiss::Index> cpu_index(load_or_build_index(index_dir, repository_file, ivfpq_type, train_percentage, build_chunk_size, stopwatch));
+        assert(size_t(cpu_index->d) == d || !"index does not have same dimension as the queries");
+
+        printf("[%lld s] Copying %s to %d GPU(s)\n", stopwatch.getElapsedTimeSeconds(), ivfpq_type, gpus);
+        std::unique_ptr<faiss::Index> gpu_index(faiss::gpu::index_cpu_to_gpu(resources[0].get(), 0, cpu_index.get()));
+        std::unique_ptr<faiss::Index> sharded;
+        if (gpus > 1) sharded.reset(faiss::gpu::index_cpu_to_gpu_multiple(providers, devices, cpu_index.get(), &shard_options));
+
+        for (double nprobe : nprobe_parameter)
+        {
+            const std::string params = string_format("nprobe=%g", nprobe);
+            faiss::ParameterSpace().set_index_parameter(cpu_index.get(), "nprobe", nprobe);
+            faiss::gpu::GpuParameterSpace().set_index_parameter(gpu_index.get(), "nprobe", nprobe);
+            if (sharded) faiss::gpu::GpuParameterSpace().set_index_parameter(sharded.get(), "nprobe", nprobe);
+
+            TableRow cpu{ "cpu", ivfpq_type, params };
+            cpu.qps = host_search_qps(cpu_index.get(), nq, xq.data(), target_k, D, I);
+            cpu.recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+            table.push_back(cpu);
+
+            TableRow gpu{ "gpu", ivfpq_type, params };
+            host_search_qps(gpu_index.get(), nq, xq.data(), target_k, D, I);  // warm up
+            gpu.qps = host_search_qps(gpu_index.get(), nq, xq.data(), target_k, D, I);
+            gpu.recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+            auto timing = time_device_search(*resources[0], 0, gpu_index.get(), nq, xq.data(), target_k, D, I);
+            gpu.h2d_ms = timing.h2d_ms;
+            gpu.kernel_ms = timing.kernel_ms;
+            gpu.d2h_ms = timing.d2h_ms;
+            table.push_back(gpu);
+
+            if (sharded)
+            {
+                TableRow multi{ string_format("%d gpu shards", gpus), ivfpq_type, params };
+                host_search_qps(sharded.get(), nq, xq.data(), target_k, D, I);  // warm up
+                multi.qps = host_search_qps(sharded.get(), nq, xq.data(), target_k, D, I);
+                multi.recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+                table.push_back(multi);
+            }
+            printf("[%lld s] %s: cpu %.0f QPS, gpu %.0f QPS\n", stopwatch.getElapsedTimeSeconds(), params.c_str(), cpu.qps, gpu.qps);
+        }
+    }
+
+    // exact search, as used to compute the ground truth
+    {
+        FVecsView xb(repository_file.c_str());
+        assert(xb.dims() == d || !"base data does not have same dimension as the queries");
+
+        TableRow cpu{ "cpu", "Flat", "exact" };
+        {
+            StopW timer;
+            GroundTruthEngine engine(nq, d, xq.data(), target_k);
+            engine.add(xb, 0, xb.size());
+            engine.result(D, I);
+            cpu.qps = nq / (std::max<long long>(timer.getElapsedTimeMicro(), 1) / 1000000.0);
+            cpu.recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+        }
+        table.push_back(cpu);
+        printf("[%lld s] Flat: cpu %.0f QPS\n", stopwatch.getElapsedTimeSeconds(), cpu.qps);
+
+        // the base data is uploaded in chunks, the upload is not part of the search time
+        faiss::IndexFlatL2 empty(d);
+        auto upload = [&](faiss::Index* index, const char* name) {
+            StopW timer;
+            xb.for_each_chunk(0, xb.size(), build_chunk_size, [&](size_t, size_t count, const float* x) { index->add(count, x); });
+            printf("[%lld s] Uploaded %zu base vectors to %s in %lld ms\n", stopwatch.getElapsedTimeSeconds(), xb.size(), name, timer.getElapsedTimeMicro() / 1000);
+        };
+
+        TableRow gpu{ "gpu", "Flat", "exact" };
+        {
+            std::unique_ptr<faiss::Index> gpu_flat(faiss::gpu::index_cpu_to_gpu(resources[0].get(), 0, &empty));
+            upload(gpu_flat.get(), "GPU 0");
+            host_search_qps(gpu_flat.get(), nq, xq.data(), target_k, D, I);  // warm up
+            gpu.qps = host_search_qps(gpu_flat.get(), nq, xq.data(), target_k, D, I);
+            gpu.recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+            auto timing = time_device_search(*resources[0], 0, gpu_flat.get(), nq, xq.data(), target_k, D, I);
+            gpu.h2d_ms = timing.h2d_ms;
+            gpu.kernel_ms = timing.kernel_ms;
+            gpu.d2h_ms = timing.d2h_ms;
+        }
+        table.push_back(gpu);
+
+        if (gpus > 1)
+        {
+            TableRow multi{ string_format("%d gpu shards", gpus), "Flat", "exact" };
+            std::unique_ptr<faiss::Index> sharded(faiss::gpu::index_cpu_to_gpu_multiple(providers, devices, &empty, &shard_options));
+            upload(sharded.get(), "all GPUs");
+            host_search_qps(sharded.get(), nq, xq.data(), target_k, D, I);  // warm up
+            multi.qps = host_search_qps(sharded.get(), nq, xq.data(), target_k, D, I);
+            multi.recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+            table.push_back(multi);
+        }
+    }
+
+    ResultsStore store(results_file);
+    auto ms = [](double v) { return v < 0 ? std::string("-") : string_format("%.2f", v); };
+    printf("\n%-14s %-16s %-12s %8s %10s %10s %10s %10s\n", "backend", "index", "params",
+           string_format("%zuR@%zu", k_recall_at, target_k).c_str(), "QPS", "H2D ms", "kernel ms", "D2H ms");
+    for (const auto& row : table)
+    {
+        printf("%-14s %-16s %-12s %8.4f %10.0f %10s %10s %10s\n", row.backend.c_str(), row.index.c_str(), row.params.c_str(),
+               row.recall, row.qps, ms(row.h2d_ms).c_str(), ms(row.kernel_ms).c_str(), ms(row.d2h_ms).c_str());
+
+        auto record = search_record("faiss_gpu_index", "sift1m", row.index, row.params + ",backend=" + row.backend, target_k, k_recall_at,
+                                    row.recall, (long long)(nq / row.qps * 1e6), nq);
+        record.set("backend", row.backend).set("gpus", row.backend == "cpu" ? 0 : row.backend == "gpu" ? 1 : gpus);
+        if (row.kernel_ms >= 0) record.set("h2d_ms", row.h2d_ms).set("kernel_ms", row.kernel_ms).set("d2h_ms", row.d2h_ms);
+        store.append(record);
+    }
+    return 0;
+}
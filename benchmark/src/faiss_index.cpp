@@ -26,7 +26,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "autotune.h"
+#include "recall.h"
+#include "result_buffer.h"
 #include "stopwatch.h"
+#include "vecs_io.h"
 
 #include <faiss/AutoTune.h>
 #include <faiss/index_factory.h>
@@ -40,59 +44,17 @@
  * and unzip it to the sudirectory sift1M.
  **/
 
-/*****************************************************
- * I/O functions for fvecs and ivecs
- *****************************************************/
-float* fvecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    std::error_code ec{};
-    auto file_size = std::filesystem::file_size(fname, ec);
-    if (ec != std::error_code{})
-    {
-        std::cerr << "error when accessing file " << fname << ", size is: " << file_size << " message: " << ec.message() << std::endl;
-        perror("");
-        abort();
-    }
-
-    auto ifstream = std::ifstream(fname, std::ios::binary);
-    if (!ifstream.is_open())
-    {
-        std::cerr << "could not open " << fname << std::endl;
-        perror("");
-        abort();
-    }
-
-    int dims;
-    ifstream.read(reinterpret_cast<char*>(&dims), sizeof(int));
-    assert((dims > 0 && dims < 1000000) || !"unreasonable dimension");
-    assert(file_size % ((dims + 1) * 4) == 0 || !"weird file size");
-    size_t n = file_size / ((dims + 1) * 4);
-
-    *d_out = dims;
-    *n_out = n;
-
-    float* x = new float[n * (dims + 1)];
-    ifstream.seekg(0);
-    ifstream.read(reinterpret_cast<char*>(x), n * (dims + 1) * sizeof(float));
-    if (!ifstream) assert(ifstream.gcount() == static_cast<int>(n * (dims + 1)) || !"could not read whole file");
-
-    // shift array to remove row headers
-    for (size_t i = 0; i < n; i++) std::memmove(&x[i * dims], &x[1 + i * (dims + 1)], dims * sizeof(float));
-
-    ifstream.close();
-    return x;
-}
-
-// not very clean, but works as long as sizeof(int) == sizeof(float)
-int* ivecs_read(const char* fname, size_t* d_out, size_t* n_out) {
-    return (int*)fvecs_read(fname, d_out, n_out);
-}
-
 /**
  * https://github.com/facebookresearch/faiss/blob/main/demos/demo_sift1M.cpp
  */
 int main() {
 
-    #if defined(__AVX2__)
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(__AVX512F__)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(__AVX2__)
         std::cout << "use AVX2  ..." << std::endl;
     #elif defined(__AVX__)
         std::cout << "use AVX  ..." << std::endl;
@@ -167,10 +129,10 @@ int main() {
     {
         printf("[%lld s] Loading database\n", stopwatch.getElapsedTimeSeconds());
 
-        size_t nb, d2;
-        float* xb = fvecs_read(repository_file.c_str(), &d2, &nb);
-        assert(d == d2 || !"dataset does not have same dimension as train set");
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+        FVecsView xb(repository_file.c_str());
+        size_t nb = xb.size();
+        assert(d == xb.dims() || !"dataset does not have same dimension as train set");
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after mapping data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after creating the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
@@ -179,13 +141,11 @@ int main() {
                nb,
                d);
 
-        index->add(nb, xb);
+        xb.for_each_chunk(xb.rows_per_chunk(), [&](size_t, size_t count, const float* x) { index->add(count, x); });
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after filling the index\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
         // store
         faiss::write_index(index, index_file.c_str());
-
-        delete[] xb;
     }
 
     // load queries
@@ -200,68 +160,44 @@ int main() {
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the query data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
     }
 
-    // load ground truth
-    size_t k;         // nb of results per query in the GT
-    faiss::idx_t* gt; // nq * k matrix of ground-truth nearest-neighbors
-    {
-        printf("[%lld s] Loading ground truth for %zu queries\n",
-               stopwatch.getElapsedTimeSeconds(),
-               nq);
-
-        // load ground-truth and convert int to long
-        size_t nq2;
-        int* gt_int = ivecs_read(groundtruth_file.c_str(), &k, &nq2);
-        assert(nq2 == nq || !"incorrect nb of ground truth entries");
-
-        gt = new faiss::idx_t[k * nq];
-        for (int i = 0; i < k * nq; i++) {
-            gt[i] = gt_int[i];
-        }
-        delete[] gt_int;
-        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the ground truth data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
-    }
+    // ground truth (.gt or .ivecs), read in place from the mapping by the auto-tuning and the evaluator
+    printf("[%lld s] Loading ground truth for %zu queries\n",
+           stopwatch.getElapsedTimeSeconds(),
+           nq);
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    const size_t k = gt.k();  // nb of results per query in the GT
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after loading the ground truth data\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
     // run auto-tuning finds good nprobe and hamming threshold for an efficent search
     faiss::OperatingPoints ops; // Result of the auto-tuning
-    //  std::string selected_params; // Result of the auto-tuning
     { 
-        printf("[%lld s] Preparing auto-tune criterion 1-recall at 1 "
+        printf("[%lld s] Preparing auto-tune criterion %d-recall at 1 "
                "criterion, with k=%zu nq=%zu\n",
                stopwatch.getElapsedTimeSeconds(),
+               k_recall_at,
                k,
                nq);
 
         // https://github.com/facebookresearch/faiss/wiki/Index-IO,-cloning-and-hyper-parameter-tuning#auto-tuning-the-runtime-parameters
-        faiss::OneRecallAtRCriterion crit(nq, 1); // 1-recall@R 
-        // faiss::IntersectionCriterion crit(nq, 100); // // 100-recall@R (aka. intersection)
-        crit.set_groundtruth((int)k, nullptr, gt);
-        crit.nnn = k; // by default, the criterion will request only 1 NN
-
-        printf("[%lld s] Preparing auto-tune parameters\n", stopwatch.getElapsedTimeSeconds());
-
         faiss::ParameterSpace params;
         params.initialize(index);
-        params.thread_over_batches = false;
 
         printf("[%lld s] Auto-tuning over %zu parameters (%zu combinations)\n",
                stopwatch.getElapsedTimeSeconds(),
                params.parameter_ranges.size(),
                params.n_combinations());
 
-        params.explore(index, nq, xq, crit, &ops);
+        // screen all combinations on a query subsample in parallel, confirm the frontier on all queries
+        AutoTuneSettings settings;
+        settings.subsample = 1000;
+        settings.memory_budget = size_t(8) * 1024 * 1024 * 1024;
+        ops = auto_tune(index, params, nq, xq, gt, k, k_recall_at, 1, settings, stopwatch);
 
-        printf("[%lld s] Found the following operating points: \n", stopwatch.getElapsedTimeSeconds());
+        printf("[%lld s] Found the following operating points (t in us/query): \n", stopwatch.getElapsedTimeSeconds());
 
         ops.display();
 
-        // // keep the first parameter that obtains > 0.5 1-recall@1
-        // for (int i = 0; i < ops.optimal_pts.size(); i++) {
-        //     if (ops.optimal_pts[i].perf > 0.5) {
-        //         selected_params = ops.optimal_pts[i].key;
-        //         break;
-        //     }
-        // }
-        // assert(selected_params.size() >= 0 || !"could not find good enough op point");
         printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after auto tuning\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
     }
 
@@ -276,6 +212,14 @@ int main() {
 
     // Use the found configuration to perform a search
     printf("[%lld s] Perform a search on %zu queries\n", stopwatch.getElapsedTimeSeconds(), nq);
+
+    // output buffers, pre-faulted once and reused by all operating points
+    ResultBuffer results(nq, k);
+    faiss::idx_t* I = results.I();
+    float* D = results.D();
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after setting up the search output structures\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    RecallEvaluator evaluator(gt);
+
     for (int o = 0; o < ops.optimal_pts.size(); o++) {
 
         // skip bad configurations
@@ -290,50 +234,19 @@ int main() {
             params.set_index_parameters(index, selected_params.c_str());
         }
 
-        // output buffers
-        faiss::idx_t* I = new faiss::idx_t[nq * k];
-        float* D = new float[nq * k];
-        // printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after setting up the search output structures\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
-
         StopW timer;
         index->search(nq, xq, k, D, I);
         auto duration_us = timer.getElapsedTimeMicro();
         // printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb after performing the search\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
 
-        // evaluate result by hand.
-        // printf("[%lld s] Compute recalls\n", stopwatch.getElapsedTimeSeconds());
-        int n_1 = 0, n_10 = 0, n_100 = 0;
-        for (int i = 0; i < nq; i++) {
-            auto gt_nn = gt + i * k;
-
-            // iterate over all ground thruth data
-            for (int m = 0; m < k_recall_at; m++) {
-                auto gt_value = gt_nn[m];
-
-                // k1-recall@k (is in the k first elements of the predicion, the k first best ground truth element)
-                for (int j = 0; j < k; j++) {
-                    if (I[i * k + j] == gt_value) {
-                        if (j < 1)
-                            n_1++;
-                        if (j < 10)
-                            n_10++;
-                        if (j < 100)
-                            n_100++;
-                    }
-                }
-            }
-        }
-        float p_1 = n_1 / float(nq) / std::min(k_recall_at, 1);
-        float p_10 = n_10 / float(nq) / std::min(k_recall_at, 10);
-        float p_100 = n_100 / float(nq) / std::min(k_recall_at, 100);
+        // evaluate result, k1-recall@k (how many of the k1 first ground truth elements are in the k first elements of the prediction)
+        float p_1 = evaluator.recall(I, k, k_recall_at, 1);
+        float p_10 = evaluator.recall(I, k, k_recall_at, 10);
+        float p_100 = evaluator.recall(I, k, k_recall_at, 100);
         printf("us/query = %8.2f, %d-R@1 = %.4f, %d-R@10 = %.4f, %d-R@100 = %.4f with parameter %s \n", duration_us / float(nq), k_recall_at, p_1, k_recall_at, p_10, k_recall_at, p_100, selected_params.c_str());
-
-        delete[] I;
-        delete[] D;
     }
 
     delete[] xq;
-    delete[] gt;
     delete index;
     return 0;
 }
\ No newline at end of file
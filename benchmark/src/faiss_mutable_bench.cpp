@@ -0,0 +1,363 @@
+/**
+ * Mixed read/write benchmark of a mutable IVF index. Reader threads keep searching single
+ * queries while writer threads continuously insert batches with add_with_ids and remove
+ * the batch inserted window batches earlier with remove_ids, the index size stays about
+ * constant. faiss indexes must not be modified while they are searched, two strategies
+ * to make that safe are compared:
+ *
+ *   shared_mutex   readers share a reader-writer lock, every write batch holds it exclusively
+ *   double buffer  readers search the published copy of two replicas without waiting, a write
+ *                  batch is applied to the standby copy, the copies are swapped and, once the
+ *                  last reader left the old copy, the batch is applied to it as well
+ *
+ * For every strategy and mix of reader and writer threads the read QPS, the search latency
+ * percentiles and their degradation against the read-only run, and the insert throughput
+ * are reported. The double buffer trades twice the memory and twice the write work for
+ * reads which never block.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/AutoTune.h>
+#include <faiss/Index.h>
+#include <faiss/clone_index.h>
+#include <faiss/impl/IDSelector.h>
+#include <faiss/index_io.h>
+
+#include "index_cache.h"
+#include "latency.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+// one write operation of a writer thread: insert a batch and remove an older one
+struct WriteBatch
+{
+    size_t n = 0;
+    const float* x = nullptr;
+    std::vector<faiss::idx_t> ids;
+    faiss::idx_t remove_begin = 0;  // ids [remove_begin, remove_end) are removed
+    faiss::idx_t remove_end = 0;
+};
+
+static void apply_batch(faiss::Index* index, const WriteBatch& batch)
+{
+    index->add_with_ids(batch.n, batch.x, batch.ids.data());
+    if (batch.remove_end > batch.remove_begin)
+    {
+        faiss::IDSelectorRange range(batch.remove_begin, batch.remove_end);
+        index->remove_ids(range);
+    }
+}
+
+// readers share the lock, writers hold it exclusively
+class SharedMutexIndex
+{
+    std::unique_ptr<faiss::Index> index_;
+    mutable std::shared_mutex mutex_;
+
+public:
+    explicit SharedMutexIndex(faiss::Index* index) : index_(index) {}
+
+    void search(const float* x, size_t k, float* D, faiss::idx_t* I) const
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        index_->search(1, x, k, D, I);
+    }
+
+    void write(const WriteBatch& batch)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        apply_batch(index_.get(), batch);
+    }
+};
+
+/**
+ * Two replicas of the index, readers search the published one. Publishing is an index swap
+ * under a mutex which readers only hold while they pick the published replica and count
+ * themselves in its reader counter. A reader leaves with a release decrement, the writer
+ * waits for the counter of the old replica to drop to zero with acquire loads, so the
+ * searches of the readers happen before the writer modifies the replica.
+ */
+class DoubleBufferedIndex
+{
+    struct Replica
+    {
+        std::unique_ptr<faiss::Index> index;
+        std::atomic<size_t> readers{ 0 };
+    };
+
+    mutable std::mutex publish_mutex_;
+    mutable Replica replicas_[2];
+    size_t front_ = 0;        // published replica, guarded by publish_mutex_
+    std::mutex write_mutex_;  // write batches are applied one after another
+
+    Replica& acquire() const
+    {
+        std::lock_guard<std::mutex> lock(publish_mutex_);
+        Replica& replica = replicas_[front_];
+        replica.readers.fetch_add(1, std::memory_order_relaxed);  // ordered before a swap by the mutex
+        return replica;
+    }
+
+public:
+    explicit DoubleBufferedIndex(faiss::Index* index)
+    {
+        replicas_[0].index.reset(index);
+        replicas_[1].index.reset(faiss::clone_index(index));
+    }
+
+    void search(const float* x, size_t k, float* D, faiss::idx_t* I) const
+    {
+        Replica& replica = acquire();
+        replica.index->search(1, x, k, D, I);
+        replica.readers.fetch_sub(1, std::memory_order_release);
+    }
+
+    void write(const WriteBatch& batch)
+    {
+        std::lock_guard<std::mutex> guard(write_mutex_);
+        size_t back;
+        {
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            back = 1 - front_;
+        }
+        apply_batch(replicas_[back].index.get(), batch);
+        {
+            std::lock_guard<std::mutex> lock(publish_mutex_);
+            std::swap(front_, back);
+        }
+        // readers still searching the old replica
+        while (replicas_[back].readers.load(std::memory_order_acquire) > 0) std::this_thread::yield();
+        apply_batch(replicas_[back].index.get(), batch);
+    }
+};
+
+// measurements of one read/write mix
+struct MixResult
+{
+    double read_qps = 0;
+    double insert_rate = 0;  // inserted vectors per second
+    LatencyHistogram latency;
+};
+
+/**
+ * Runs readers search threads and writers write threads on the index for the given number
+ * of seconds. Writer batches insert rows of xw with ids from next_id on and remove the
+ * batch inserted window batches before, once that batch has been written.
+ */
+template <typename MutableIndex>
+static MixResult run_mix(MutableIndex& index, size_t readers, size_t writers, double seconds, size_t nq, const float* xq,
+                         size_t d, size_t k, const FVecsView& xw, size_t batch_size, size_t window, faiss::idx_t& next_id)
+{
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> next_batch{ 0 };
+    std::vector<std::atomic<size_t>> written(window);  // b + 1 once batch b is in the index, at slot b % window
+    std::atomic<size_t> searched{ 0 };
+    std::vector<LatencyHistogram> latencies(readers);
+    const faiss::idx_t first_id = next_id;
+    const size_t batches_in_source = std::max<size_t>(xw.size() / batch_size, 1);
+
+    std::vector<std::thread> threads;
+    for (size_t r = 0; r < readers; r++)
+    {
+        threads.emplace_back([&, r]() {
+            #ifdef _OPENMP
+                omp_set_num_threads(1);  // only affects the calling thread
+            #endif
+            std::vector<float> D(k);
+            std::vector<faiss::idx_t> I(k);
+            size_t count = 0;
+            for (size_t q = r % nq; !stop.load(std::memory_order_relaxed); q = (q + readers) % nq)
+            {
+                StopW timer;
+                index.search(xq + q * d, k, D.data(), I.data());
+                latencies[r].record((uint64_t)timer.getElapsedTimeNano());
+                count++;
+            }
+            searched += count;
+        });
+    }
+    for (size_t w = 0; w < writers; w++)
+    {
+        threads.emplace_back([&]() {
+            #ifdef _OPENMP
+                omp_set_num_threads(1);  // only affects the calling thread
+            #endif
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                size_t b = next_batch++;
+                WriteBatch batch;
+                batch.n = batch_size;
+                batch.x = xw.row((b % batches_in_source) * batch_size);
+                for (size_t i = 0; i < batch_size; i++) batch.ids.push_back(first_id + faiss::idx_t(b * batch_size + i));
+                auto& slot = written[b % window];
+                if (b >= window)
+                {
+                    // with several writers the batch to remove may still be on its way into the index
+                    for (size_t s = slot.load(); s != b - window + 1; s = slot.load()) slot.wait(s);
+                    batch.remove_begin = first_id + faiss::idx_t((b - window) * batch_size);
+                    batch.remove_end = batch.remove_begin + faiss::idx_t(batch_size);
+                }
+                index.write(batch);
+                slot = b + 1;
+                slot.notify_all();
+            }
+        });
+    }
+
+    StopW timer;
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto& t : threads) t.join();
+    const double duration_s = timer.getElapsedTimeMicro() / 1e6;
+
+    // the batches still in the window stay in the index, the next mix continues with fresh ids
+    const size_t batches = next_batch.load();
+    next_id = first_id + faiss::idx_t(batches * batch_size);
+
+    MixResult result;
+    result.read_qps = searched / duration_s;
+    result.insert_rate = batches * batch_size / duration_s;
+    for (const auto& latency : latencies) result.latency.merge(latency);
+    return result;
+}
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(__AVX512F__)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(__AVX2__)
+        std::cout << "use AVX2  ..." << std::endl;
+    #elif defined(__AVX__)
+        std::cout << "use AVX  ..." << std::endl;
+    #elif defined(__SSE2__)
+        std::cout << "use SSE  ..." << std::endl;
+    #else
+        std::cout << "use arch  ..." << std::endl;
+    #endif
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        omp_set_num_threads(1); // every reader and writer works single threaded
+    #endif
+
+    // SIFT1M, the learn vectors are inserted by the writers
+    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+    const auto learn_file       = (data_path / "SIFT1M" / "sift_learn.fvecs").string();
+    const auto repository_file  = (data_path / "SIFT1M" / "sift_base.fvecs").string();
+    const auto query_file       = (data_path / "SIFT1M" / "sift_query.fvecs").string();
+    const auto index_dir        = (data_path / "faiss").string();
+    const auto results_file     = (data_path / "results" / "faiss_mutable_bench.jsonl").string();  // JSON Lines results, empty disables them
+
+    // faiss index type, an IVF index with array inverted lists supports add_with_ids and remove_ids
+    auto index_type = "IVF1024,Flat";
+    const float train_percentage = 10;
+    const size_t build_chunk_size = 100000;
+    const double nprobe = 16;
+    const size_t target_k = 10;
+
+    // vectors per write batch and how many batches stay in the index before they are removed again
+    const size_t batch_size = 100;
+    const size_t window = 64;
+
+    // duration of every mix and the worker threads, split into readers and writers
+    const double mix_seconds = 10;
+    const size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    std::vector<std::pair<size_t, size_t>> mixes = { { threads, 0 } };   // read only reference
+    for (size_t ratio : { 16, 8, 4, 2, 1 })                             // readers per writer
+    {
+        size_t writers = std::max<size_t>(1, threads / (ratio + 1));
+        if (mixes.back().second != writers) mixes.push_back({ threads - writers, writers });
+    }
+
+    StopW stopwatch;
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    // build and cache the index if needed, cached indexes are mapped read-only, the
+    // benchmark needs a modifiable copy in memory
+    delete load_or_build_index(index_dir, repository_file, index_type, train_percentage, build_chunk_size, stopwatch);
+    const auto index_file = cached_index_file(index_dir, repository_file, index_type, train_percentage);
+
+    printf("[%lld s] Loading queries and insert data\n", stopwatch.getElapsedTimeSeconds());
+    FVecsView xq_view(query_file.c_str());
+    const size_t d = xq_view.dims();
+    const size_t nq = xq_view.size();
+    std::vector<float> xq(nq * d);
+    xq_view.copy_rows(0, nq, xq.data());
+    FVecsView xw(learn_file.c_str());
+    assert(xw.dims() == d || !"learn data does not have same dimension as the queries");
+
+    ResultsStore store(results_file);
+    for (const char* strategy : { "shared_mutex", "double_buffer" })
+    {
+        printf("[%lld s] Loading %s into memory for the %s strategy\n", stopwatch.getElapsedTimeSeconds(), index_file.c_str(), strategy);
+        faiss::Index* index = faiss::read_index(index_file.c_str());
+        assert(size_t(index->d) == d || !"index does not have same dimension as the queries");
+        faiss::ParameterSpace().set_index_parameter(index, "nprobe", nprobe);
+        faiss::idx_t next_id = index->ntotal;
+
+        std::unique_ptr<SharedMutexIndex> locked;
+        std::unique_ptr<DoubleBufferedIndex> buffered;
+        if (std::string(strategy) == "shared_mutex") locked = std::make_unique<SharedMutexIndex>(index);
+        else buffered = std::make_unique<DoubleBufferedIndex>(index);
+        printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+        double reference_qps = 0, reference_p99 = 0;
+        for (auto [readers, writers] : mixes)
+        {
+            auto result = locked ? run_mix(*locked, readers, writers, mix_seconds, nq, xq.data(), d, target_k, xw, batch_size, window, next_id)
+                                 : run_mix(*buffered, readers, writers, mix_seconds, nq, xq.data(), d, target_k, xw, batch_size, window, next_id);
+            const double p99 = result.latency.percentile(99) / 1000.0;
+            if (writers == 0)
+            {
+                reference_qps = result.read_qps;
+                reference_p99 = p99;
+            }
+
+            printf("%-13s %3zu readers %3zu writers: %9.0f read QPS (%+6.1f%%), %s (p99 %+6.1f%%), %9.0f inserts/s\n", strategy, readers, writers,
+                   result.read_qps, 100.0 * (result.read_qps / reference_qps - 1), format_percentiles(result.latency).c_str(),
+                   100.0 * (p99 / std::max(reference_p99, 1e-9) - 1), result.insert_rate);
+
+            ResultRecord record;
+            record.set("benchmark", "faiss_mutable_bench")
+                  .set("dataset", "sift1m")
+                  .set("factory", index_type)
+                  .set("params", string_format("nprobe=%g,strategy=%s,readers=%zu,writers=%zu", nprobe, strategy, readers, writers))
+                  .set("k", target_k)
+                  .set("qps", result.read_qps)
+                  .set("insert_rate", result.insert_rate)
+                  .set("batch_size", batch_size)
+                  .set("rss_mb", getCurrentRSS() / 1000000)
+                  .set("cpu_model", cpu_model())
+                  .set("git_sha", FAISSBENCH_GIT_SHA)
+                  .set("timestamp", utc_timestamp());
+            set_percentiles(record, result.latency);
+            store.append(record);
+        }
+    }
+
+    printf("[%lld s] Done\n", stopwatch.getElapsedTimeSeconds());
+    return 0;
+}
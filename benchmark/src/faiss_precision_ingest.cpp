@@ -0,0 +1,184 @@
+/**
+ * Ingestion of reduced precision base vectors. The fp32 SIFT1M base is converted once
+ * to uint8 (.bvecs), fp16 (.fp16vecs) and bf16 (.bf16vecs) copies, then every index type
+ * is built from the fp32 file and from the reduced precision files it can take:
+ *
+ *  - IVF1024,SQ8 from all formats, the reduced precision rows are converted to float
+ *    chunk by chunk by the reader thread of the stream and added as usual
+ *  - SQfp16, SQbf16 and SQ8_direct from the format they store, the rows are appended to
+ *    the codes as they are, without any float staging and without encoding
+ *
+ * Reported per build are the bytes of the base vectors (what a full load of the file
+ * would take), the bytes staged in the two chunks of the stream, the memory saved
+ * compared with the fp32 input, the ingest time (training and adding) with the speedup
+ * over the fp32 input, and the recall of the built index, which shows the precision
+ * lost by the reduced precision input.
+ */
+
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/Index.h>
+#include <faiss/IndexIVF.h>
+
+#include "index_build.h"
+#include "recall.h"
+#include "result_buffer.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+#include "vecs_stream.h"
+
+// result of one build
+struct IngestRow
+{
+    std::string index_type;
+    VecsType input;
+    bool raw_codes = false;  // rows were appended to the codes without conversion
+    size_t base_bytes = 0;
+    size_t staging_bytes = 0;
+    double ingest_s = 0;
+    double recall = 0;
+};
+
+// writes a T copy of the fp32 file in chunks, unless it exists already
+template<typename T>
+static void convert_base(const FVecsView& xb, const std::string& fname, size_t chunk_size, StopW& stopwatch)
+{
+    if (std::filesystem::exists(fname)) return;
+    printf("[%lld s] Writing %s\n", stopwatch.getElapsedTimeSeconds(), fname.c_str());
+    const auto temp_file = fname + ".tmp";
+    {
+        VecsWriter<T> writer(temp_file.c_str(), xb.dims());
+        stream_chunks(xb, chunk_size, [&](size_t, size_t count, const float* x) { writer.append(count, x); });
+    }
+    std::filesystem::rename(temp_file, fname);
+}
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        omp_set_num_threads(omp_get_num_procs());
+    #endif
+
+    // SIFT1M, the reduced precision copies are written next to the fp32 base file
+    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+    const auto repository_file  = (data_path / "SIFT1M" / "sift_base.fvecs").string();
+    const auto query_file       = (data_path / "SIFT1M" / "sift_query.fvecs").string();
+    const auto groundtruth_file = (data_path / "SIFT1M" / "sift_groundtruth.ivecs").string();
+    const auto results_file     = (data_path / "results" / "faiss_precision_ingest.jsonl").string();  // JSON Lines results, empty disables them
+    const auto base_stem        = (data_path / "SIFT1M" / "sift_base").string();
+
+    const float train_percentage = 10;
+    const size_t build_chunk_size = 100000;
+    const double nprobe = 16;
+
+    // find k best elements
+    const size_t target_k = 10;
+    const size_t k_recall_at = 10;
+
+    // index types and the input formats they are built from, fp32 first as reference
+    const std::vector<std::pair<const char*, std::vector<VecsType>>> builds = {
+        { "IVF1024,SQ8", { VecsType::fp32, VecsType::fp16, VecsType::bf16, VecsType::uint8 } },
+        { "SQfp16",      { VecsType::fp32, VecsType::fp16 } },
+#if FAISS_VERSION_MAJOR > 1 || FAISS_VERSION_MINOR >= 8
+        { "SQbf16",      { VecsType::fp32, VecsType::bf16 } },  // added in faiss 1.8
+#endif
+        { "SQ8_direct",  { VecsType::fp32, VecsType::uint8 } },
+    };
+
+    StopW stopwatch;
+    std::string input_files[4];
+    input_files[(int)VecsType::fp32] = repository_file;
+    input_files[(int)VecsType::uint8] = base_stem + ".bvecs";
+    input_files[(int)VecsType::fp16] = base_stem + ".fp16vecs";
+    input_files[(int)VecsType::bf16] = base_stem + ".bf16vecs";
+    {
+        FVecsView xb(repository_file.c_str());
+        convert_base<uint8_t>(xb, input_files[(int)VecsType::uint8], build_chunk_size, stopwatch);  // SIFT values are integers in [0, 255]
+        convert_base<float16>(xb, input_files[(int)VecsType::fp16], build_chunk_size, stopwatch);
+        convert_base<bfloat16>(xb, input_files[(int)VecsType::bf16], build_chunk_size, stopwatch);
+    }
+
+    printf("[%lld s] Loading queries and ground truth\n", stopwatch.getElapsedTimeSeconds());
+    size_t d, nq;
+    std::unique_ptr<float[]> xq(vecs_read(query_file.c_str(), &d, &nq));
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    RecallEvaluator evaluator(gt);
+    ResultsStore store(results_file);
+    ResultBuffer results(nq, target_k);
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    std::vector<IngestRow> rows;
+    for (const auto& [index_type, inputs] : builds)
+    {
+        for (VecsType input : inputs)
+        {
+            IngestRow row;
+            row.index_type = index_type;
+            row.input = input;
+
+            std::unique_ptr<faiss::Index> index(with_vecs_view(input_files[(int)input].c_str(), [&](const auto& xb) {
+                using T = std::remove_cv_t<std::remove_pointer_t<decltype(xb.row(0))>>;
+                assert(xb.dims() == d || !"query does not have same dimension as the base data");
+                StopW timer;
+                faiss::Index* built = build_index(xb, index_type, train_percentage, build_chunk_size, stopwatch);
+                row.ingest_s = timer.getElapsedTimeMicro() / 1e6;
+                row.raw_codes = stores_raw_values<T>(built);
+                row.base_bytes = xb.size() * xb.dims() * sizeof(T);
+                row.staging_bytes = 2 * build_chunk_size * xb.dims() * (row.raw_codes ? sizeof(T) : sizeof(float));
+                return built;
+            }));
+
+            if (auto ivf = dynamic_cast<faiss::IndexIVF*>(index.get())) ivf->nprobe = (size_t)nprobe;
+            StopW search_timer;
+            index->search(nq, xq.get(), target_k, results.D(), results.I());
+            const long long search_us = search_timer.getElapsedTimeMicro();
+            row.recall = evaluator.recall(results.I(), target_k, k_recall_at, target_k);
+            printf("[%lld s] %s from %s: %.2f s, %zuR@%zu = %.4f\n", stopwatch.getElapsedTimeSeconds(), index_type, vecs_type_name(input),
+                   row.ingest_s, k_recall_at, target_k, row.recall);
+
+            auto record = search_record("faiss_precision_ingest", "sift1m", index_type, string_format("input=%s", vecs_type_name(input)),
+                                        target_k, k_recall_at, row.recall, search_us, nq);
+            record.set("raw_codes", row.raw_codes)
+                  .set("base_bytes", row.base_bytes)
+                  .set("staging_bytes", row.staging_bytes)
+                  .set("ingest_s", row.ingest_s);
+            store.append(record);
+            rows.push_back(row);
+        }
+    }
+
+    // compared with the fp32 build of the same index type, the first row of every type
+    printf("\n%-12s %-6s %-5s %10s %10s %10s %10s %8s %8s\n", "index", "input", "raw", "base MB", "staging MB", "saved MB", "ingest s", "speedup", "recall");
+    const IngestRow* reference = nullptr;
+    for (const auto& row : rows)
+    {
+        if (reference == nullptr || reference->index_type != row.index_type) reference = &row;
+        const double saved = (double(reference->base_bytes) + reference->staging_bytes - double(row.base_bytes) - row.staging_bytes) / 1e6;
+        printf("%-12s %-6s %-5s %10.1f %10.1f %10.1f %10.2f %7.2fx %8.4f\n", row.index_type.c_str(), vecs_type_name(row.input), row.raw_codes ? "yes" : "no",
+               row.base_bytes / 1e6, row.staging_bytes / 1e6, saved, row.ingest_s, reference->ingest_s / std::max(row.ingest_s, 1e-9), row.recall);
+    }
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * Range search benchmark of Flat and IVF indexes on SIFT1M. The radii are quantiles of
+ * the distances of the queries to their ground truth neighbors, the exact range results
+ * are collected by the streaming GroundTruthEngine in one pass over the base vectors for
+ * the largest radius.
+ *
+ * For every index, nprobe and radius the range searches of all queries run with all
+ * cores, each into a fresh RangeSearchResult. Reported are the QPS, the distribution of
+ * the number of results per query, the volume of the heap allocations of one search (the
+ * per thread result buffers of faiss and the final result arrays) and the precision and
+ * recall against the exact range results.
+ *
+ * The allocations are counted by replacing the global operator new of this program. When
+ * faiss is a DLL on Windows its internal allocations do not go through it, then only the
+ * final result arrays are reported as allocation volume.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/Index.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/impl/AuxIndexStructures.h>
+
+#include "gt_engine.h"
+#include "gt_format.h"
+#include "index_cache.h"
+#include "measure.h"
+#include "range_search.h"
+#include "recall.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "vecs_io.h"
+
+// heap allocations of the program, counted while allocation_counting is set
+static std::atomic<bool> allocation_counting{ false };
+static std::atomic<size_t> allocated_bytes{ 0 };
+static std::atomic<size_t> allocation_count{ 0 };
+
+void* operator new(size_t size)
+{
+    if (allocation_counting.load(std::memory_order_relaxed))
+    {
+        allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        omp_set_num_threads(omp_get_num_procs());  // range search buffers are per thread, load them all
+        std::cout << "_OPENMP " << omp_get_num_procs() << " threads" << std::endl;
+    #endif
+
+    // SIFT1M
+    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+    const auto repository_file  = (data_path / "SIFT1M" / "sift_base.fvecs").string();
+    const auto query_file       = (data_path / "SIFT1M" / "sift_query.fvecs").string();
+    const auto groundtruth_file = (data_path / "SIFT1M" / "sift_groundtruth.ivecs").string();
+    const auto index_dir        = (data_path / "faiss").string();
+    const auto results_file     = (data_path / "results" / "faiss_range_search.jsonl").string();  // JSON Lines results, empty disables them
+
+    // index types and the nprobe values of the IVF indexes
+    const std::vector<const char*> index_types = { "Flat", "IVF1024,Flat", "IVF4096,Flat" };
+    const std::vector<size_t> nprobe_values = { 8, 32, 128 };
+    const float train_percentage = 10;
+    const size_t build_chunk_size = 100000;
+
+    // radii at these quantiles of the distances to the first quantile_neighbors ground truth neighbors
+    const std::vector<double> radius_quantiles = { 0.001, 0.01, 0.1, 0.5 };
+    const size_t quantile_neighbors = 100;
+
+    TimingSettings timing_settings;
+    timing_settings.warmup = 1;
+    timing_settings.repetitions = 5;
+
+    StopW stopwatch;
+    FVecsView xb(repository_file.c_str());
+    size_t d, nq;
+    std::unique_ptr<float[]> xq(vecs_read(query_file.c_str(), &d, &nq));
+    assert(xb.dims() == d || !"query does not have same dimension as the base data");
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    RecallEvaluator evaluator(gt);
+    ResultsStore store(results_file);
+
+    auto radii = radii_from_quantiles(evaluator.gt_distances(xb, xq.get(), quantile_neighbors), radius_quantiles);
+    printf("[%lld s] Radii", stopwatch.getElapsedTimeSeconds());
+    for (size_t r = 0; r < radii.size(); r++) printf(" %g at quantile %g", radii[r], radius_quantiles[r]);
+    printf("\n");
+
+    // exact range results of the largest radius, the smaller ones are subsets
+    printf("[%lld s] Exact range search of %zu queries over %zu base vectors\n", stopwatch.getElapsedTimeSeconds(), nq, xb.size());
+    GroundTruthEngine exact(nq, d, xq.get(), 1);
+    exact.collect_range(*std::max_element(radii.begin(), radii.end()));
+    exact.add(xb, 0, xb.size());
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    printf("\n%-14s %7s %9s %10s %9s %7s %7s %7s %7s %7s %11s %8s %9s %9s\n", "index", "nprobe", "radius", "QPS", "mean", "p50", "p90", "p99", "max",
+           "empty", "alloc MB", "allocs", "precision", "recall");
+    for (const char* index_type : index_types)
+    {
+        std::unique_ptr<faiss::Index> index(load_or_build_index(index_dir, repository_file, index_type, train_percentage, build_chunk_size, stopwatch));
+        auto ivf = dynamic_cast<faiss::IndexIVF*>(index.get());
+        const std::vector<size_t> nprobes = ivf != nullptr ? nprobe_values : std::vector<size_t>{ 0 };
+
+        for (size_t nprobe : nprobes)
+        {
+            if (ivf != nullptr) ivf->nprobe = nprobe;
+            for (size_t r = 0; r < radii.size(); r++)
+            {
+                // every search fills a new result, the allocations of the last one are reported
+                std::unique_ptr<faiss::RangeSearchResult> result;
+                size_t bytes = 0, allocations = 0;
+                auto timing = measure_repeated(timing_settings, [&]() {
+                    result.reset();
+                    allocated_bytes = 0;
+                    allocation_count = 0;
+                    allocation_counting = true;
+                    result = std::make_unique<faiss::RangeSearchResult>(nq);
+                    index->range_search(nq, xq.get(), radii[r], result.get());
+                    allocation_counting = false;
+                    bytes = allocated_bytes;
+                    allocations = allocation_count;
+                });
+                const size_t result_bytes = range_result_bytes(*result);
+                bytes = std::max(bytes, result_bytes);
+
+                auto counts = range_counts(*result);
+                auto accuracy = range_accuracy(*result, exact, radii[r]);
+                const auto duration_us = (long long)timing.median_us;
+                const double qps = nq / (std::max<long long>(duration_us, 1) / 1e6);
+                printf("%-14s %7zu %9.0f %10.0f %9.1f %7zu %7zu %7zu %7zu %6.1f%% %11.1f %8zu %9.4f %9.4f%s\n", index_type, nprobe, radii[r], qps,
+                       counts.mean, counts.p50, counts.p90, counts.p99, counts.max, counts.empty_fraction * 100, bytes / 1e6, allocations,
+                       accuracy.precision(), accuracy.recall(), timing.frequency_scaling() ? " WARNING frequency scaling" : "");
+
+                auto record = search_record("faiss_range_search", "sift1m", index_type, string_format("nprobe=%zu,radius_quantile=%g", nprobe, radius_quantiles[r]),
+                                            0, 0, accuracy.recall(), duration_us, nq);
+                record.set("radius", radii[r])
+                      .set("precision", accuracy.precision())
+                      .set("results", counts.total)
+                      .set("results_mean", counts.mean)
+                      .set("results_p50", counts.p50)
+                      .set("results_p90", counts.p90)
+                      .set("results_p99", counts.p99)
+                      .set("results_max", counts.max)
+                      .set("empty_fraction", counts.empty_fraction)
+                      .set("allocated_bytes", bytes)
+                      .set("allocations", allocations)
+                      .set("result_bytes", result_bytes)
+                      .set("allocated_bytes_per_result", counts.total > 0 ? double(bytes) / counts.total : 0.0)
+                      .set("repetitions", timing.samples_us.size())
+                      .set("mad_us_per_query", timing.mad_us / nq);
+                store.append(record);
+            }
+        }
+    }
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+    return 0;
+}
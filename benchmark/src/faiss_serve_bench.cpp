@@ -0,0 +1,258 @@
+/**
+ * Query serving benchmark. A pool of search workers takes single queries from a lock-free
+ * queue, like the request handlers of a search service, while an open-loop load generator
+ * submits queries with exponentially distributed inter-arrival times (a Poisson process)
+ * at a target QPS, independent of how fast they are answered.
+ *
+ * The closed-loop capacity of the pool is measured first. The offered load is then raised
+ * in steps of a fraction of it until the pool saturates. For every step the achieved
+ * throughput, the queueing delay (arrival to start of the search) and the end-to-end
+ * latency (arrival to result) are reported. Latencies are measured from the scheduled
+ * arrival time, a generator falling behind does not hide queueing delay.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+
+#include <faiss/AutoTune.h>
+#include <faiss/Index.h>
+
+#include "index_cache.h"
+#include "latency.h"
+#include "mpmc_queue.h"
+#include "recall.h"
+#include "result_buffer.h"
+#include "results_store.h"
+#include "stopwatch.h"
+#include "throughput.h"
+#include "vecs_io.h"
+
+using Clock = std::chrono::steady_clock;
+
+// a submitted query
+struct Request
+{
+    size_t query;                 // row of the query data
+    Clock::time_point arrival;    // scheduled arrival time
+};
+
+// latencies of one load step, in nanoseconds
+struct StepLatency
+{
+    LatencyHistogram queueing;
+    LatencyHistogram service;
+    LatencyHistogram end_to_end;
+
+    void merge(const StepLatency& other)
+    {
+        queueing.merge(other.queueing);
+        service.merge(other.service);
+        end_to_end.merge(other.end_to_end);
+    }
+};
+
+// sleeps until the given time, the last 100 us are spun for an accurate arrival time
+static void wait_until(Clock::time_point t)
+{
+    auto now = Clock::now();
+    if (t - now > std::chrono::microseconds(200))
+        std::this_thread::sleep_for(t - now - std::chrono::microseconds(100));
+    while (Clock::now() < t) {}
+}
+
+int main() {
+
+    #ifdef FAISSBENCH_ISA
+        std::cout << "ISA variant " << FAISSBENCH_ISA << std::endl;
+    #endif
+    #if defined(__AVX512F__)
+        std::cout << "use AVX512  ..." << std::endl;
+    #elif defined(__AVX2__)
+        std::cout << "use AVX2  ..." << std::endl;
+    #elif defined(__AVX__)
+        std::cout << "use AVX  ..." << std::endl;
+    #elif defined(__SSE2__)
+        std::cout << "use SSE  ..." << std::endl;
+    #else
+        std::cout << "use arch  ..." << std::endl;
+    #endif
+
+    // https://github.com/facebookresearch/faiss/wiki/Threads-and-asynchronous-calls
+    #ifdef _OPENMP
+        omp_set_dynamic(0);     // Explicitly disable dynamic teams
+        omp_set_num_threads(1); // every worker searches its query single threaded
+    #endif
+
+    // SIFT1M
+    const auto data_path = std::filesystem::path("e:/Data/Feature/SIFT1M/");
+    const auto repository_file  = (data_path / "SIFT1M" / "sift_base.fvecs").string();
+    const auto query_file       = (data_path / "SIFT1M" / "sift_query.fvecs").string();
+    const auto groundtruth_file = (data_path / "SIFT1M" / "sift_groundtruth.ivecs").string();
+    const auto index_dir        = (data_path / "faiss").string();
+    const auto results_file     = (data_path / "results" / "faiss_serve_bench.jsonl").string();  // JSON Lines results, empty disables them
+
+    // faiss index type and the operating point it is served at
+    auto index_type = "IVF1024,PQ64x4fs,RFlat";
+    const float train_percentage = 10;
+    const size_t build_chunk_size = 100000;
+    const double nprobe = 16;
+    const double k_factor_rf = 2;
+
+    // find k best elements
+    const size_t target_k = 10;
+    const size_t k_recall_at = 10;
+
+    // search worker threads, one core is left to the request generator which spins like the workers,
+    // queue capacity (a full queue drops queries) and duration of every load step
+    const size_t workers = std::max(2u, std::thread::hardware_concurrency()) - 1;
+    const size_t queue_capacity = 1 << 16;
+    const double step_seconds = 5;
+
+    // offered load of the steps as fraction of the closed-loop capacity, the sweep ends
+    // after the first saturated step (throughput below 95% of the offered load)
+    const std::vector<double> load_fractions = { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.85, 0.9, 0.95, 1.0, 1.05, 1.1, 1.2 };
+
+    StopW stopwatch;
+    printf("[%lld s] Actual memory usage: %zu Mb, Max memory usage: %zu Mb\n", stopwatch.getElapsedTimeSeconds(), getCurrentRSS() / 1000000, getPeakRSS() / 1000000);
+
+    // load the cached index, or build and cache it
+    std::unique_ptr<faiss::Index> index(load_or_build_index(index_dir, repository_file, index_type, train_percentage, build_chunk_size, stopwatch));
+    faiss::ParameterSpace().set_index_parameter(index.get(), "nprobe", nprobe);
+    faiss::ParameterSpace().set_index_parameter(index.get(), "k_factor_rf", k_factor_rf);
+    const std::string params = string_format("nprobe=%g,k_factor_rf=%g", nprobe, k_factor_rf);
+    const size_t d = index->d;
+
+    printf("[%lld s] Loading queries and ground truth\n", stopwatch.getElapsedTimeSeconds());
+    FVecsView xq_view(query_file.c_str());
+    assert(d == xq_view.dims() || !"query does not have same dimension as the index");
+    const size_t nq = xq_view.size();
+    std::vector<float> xq(nq * d);
+    xq_view.copy_rows(0, nq, xq.data());
+
+    GroundTruthFile gt(groundtruth_file.c_str());
+    assert(gt.nq() == nq || !"incorrect nb of ground truth entries");
+    RecallEvaluator evaluator(gt);
+    ResultsStore store(results_file);
+
+    // results of the closed-loop searches, the search results do not depend on the load
+    ResultBuffer results(nq, target_k);
+    faiss::idx_t* I = results.I();
+    float* D = results.D();
+
+    // closed-loop capacity, every worker searches the next query as soon as it is done
+    measure_external_qps(index.get(), nq, xq.data(), target_k, D, I, workers);  // warm up
+    const double capacity = measure_external_qps(index.get(), nq, xq.data(), target_k, D, I, workers);
+    const float recall = evaluator.recall(I, target_k, k_recall_at, target_k);
+    printf("[%lld s] Closed-loop capacity of %zu workers: %.0f QPS at %s, %zuR@%zu = %.4f\n", stopwatch.getElapsedTimeSeconds(),
+           workers, capacity, params.c_str(), k_recall_at, target_k, recall);
+
+    MPMCQueue<Request> queue(queue_capacity);
+    std::atomic<bool> stop{ false };
+    std::atomic<size_t> completed{ 0 };
+    std::vector<StepLatency> latencies(workers);
+
+    // search workers, they spin on the queue to keep the wake up latency out of the measurement.
+    // The queue can hold the same query several times, hence every worker has its own output row.
+    std::vector<std::thread> pool;
+    for (size_t w = 0; w < workers; w++)
+    {
+        pool.emplace_back([&, w]() {
+            #ifdef _OPENMP
+                omp_set_num_threads(1);  // only affects the calling thread
+            #endif
+            std::vector<float> worker_D(target_k);
+            std::vector<faiss::idx_t> worker_I(target_k);
+            Request request;
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                if (!queue.try_pop(request))
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                auto start = Clock::now();
+                size_t q = request.query;
+                index->search(1, xq.data() + q * d, target_k, worker_D.data(), worker_I.data());
+                auto end = Clock::now();
+
+                auto& latency = latencies[w];
+                latency.queueing.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(start - request.arrival).count());
+                latency.service.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+                latency.end_to_end.record((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - request.arrival).count());
+                completed.fetch_add(1, std::memory_order_release);
+            }
+        });
+    }
+
+    std::mt19937_64 rng(1234);
+    for (double fraction : load_fractions)
+    {
+        const double offered_qps = fraction * capacity;
+        std::exponential_distribution<double> inter_arrival(offered_qps);
+        for (auto& latency : latencies) latency = StepLatency();  // the workers are idle in between steps
+        completed.store(0);
+
+        // open loop: arrivals follow the schedule, whether or not earlier queries are answered
+        size_t submitted = 0, dropped = 0;
+        const auto begin = Clock::now();
+        const auto end = begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(step_seconds));
+        auto arrival = begin;
+        for (size_t q = 0;; q = (q + 1) % nq)
+        {
+            arrival += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(inter_arrival(rng)));
+            if (arrival >= end) break;
+            wait_until(arrival);
+            if (queue.try_push({ q, arrival })) submitted++;
+            else dropped++;
+        }
+
+        // drain the queue, the step lasts until its last query is answered
+        while (completed.load(std::memory_order_acquire) < submitted) std::this_thread::yield();
+        const double duration_s = std::chrono::duration<double>(Clock::now() - begin).count();
+        const double achieved_qps = submitted / duration_s;
+
+        StepLatency step;
+        for (const auto& latency : latencies) step.merge(latency);
+        const bool saturated = achieved_qps < 0.95 * offered_qps || dropped > 0;
+        printf("load %4.0f%%: offered %9.0f QPS, achieved %9.0f QPS, %zu dropped, queueing %s, end-to-end mean = %6.0f us, %s%s\n",
+               100 * fraction, offered_qps, achieved_qps, dropped, format_percentiles(step.queueing).c_str(), step.end_to_end.mean() / 1000.0,
+               format_percentiles(step.end_to_end).c_str(), saturated ? ", saturated" : "");
+
+        auto record = search_record("faiss_serve_bench", "sift1m", index_type, string_format("%s,load=%g", params.c_str(), fraction),
+                                    target_k, k_recall_at, recall, (long long)(duration_s * 1e6), submitted);
+        set_percentiles(record, step.end_to_end);
+        record.set("workers", workers)
+              .set("offered_qps", offered_qps)
+              .set("achieved_qps", achieved_qps)
+              .set("dropped", dropped)
+              .set("queueing_p50_us", step.queueing.percentile(50) / 1000.0)
+              .set("queueing_p99_us", step.queueing.percentile(99) / 1000.0)
+              .set("service_p50_us", step.service.percentile(50) / 1000.0)
+              .set("service_p99_us", step.service.percentile(99) / 1000.0)
+              .set("saturated", saturated);
+        store.append(record);
+
+        if (saturated) break;
+    }
+
+    stop = true;
+    for (auto& worker : pool) worker.join();
+    printf("[%lld s] Done\n", stopwatch.getElapsedTimeSeconds());
+    return 0;
+}